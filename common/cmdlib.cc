@@ -23,11 +23,14 @@
 
 #ifdef _WIN32
 #include <windows.h>
+#include <psapi.h>
 
 // don't break std::min
 #ifdef min
 #undef min
 #endif
+#else
+#include <sys/resource.h>
 #endif
 
 #ifdef LINUX
@@ -684,6 +687,29 @@ time_point I_FloatTime()
     return qclock::now();
 }
 
+size_t I_PeakMemoryUsage()
+{
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+        return counters.PeakWorkingSetSize;
+    }
+    return 0;
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+        return 0;
+    }
+#ifdef __APPLE__
+    // bytes on macOS
+    return static_cast<size_t>(usage.ru_maxrss);
+#else
+    // kilobytes on Linux
+    return static_cast<size_t>(usage.ru_maxrss) * 1024;
+#endif
+#endif
+}
+
 namespace detail
 {
 int32_t endian_i()
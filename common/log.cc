@@ -53,6 +53,7 @@ namespace logging
 {
 bitflags<flag> mask = bitflags<flag>(flag::ALL) & ~bitflags<flag>(flag::VERBOSE);
 bool enable_color_codes = true;
+thread_local std::optional<bitflags<flag>> thread_mask;
 
 void preinitialize()
 {
@@ -88,7 +89,7 @@ void set_print_callback(print_callback_t cb)
 
 void print(flag logflag, const char *str)
 {
-    if (!(mask & logflag)) {
+    if (!(current_mask() & logflag)) {
         return;
     }
 
@@ -191,7 +192,13 @@ void percent(uint64_t count, uint64_t max, bool displayElapsed)
 {
     bool expected = false;
 
-    if (!(logging::mask & flag::CLOCK_ELAPSED)) {
+    // there's only one progress bar, so threads with their own mask that hides
+    // it must not touch it at all
+    if (thread_mask && !(*thread_mask & flag::PERCENT)) {
+        return;
+    }
+
+    if (!(current_mask() & flag::CLOCK_ELAPSED)) {
         displayElapsed = false;
     }
 
@@ -104,6 +104,9 @@ using time_point = std::chrono::time_point<qclock, duration>;
 
 time_point I_FloatTime();
 
+// peak resident set size of the process in bytes, or 0 if unavailable
+size_t I_PeakMemoryUsage();
+
 /*
  * ============================================================================
  *                            BYTE ORDER FUNCTIONS
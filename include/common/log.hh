@@ -61,6 +61,16 @@ enum class flag : uint8_t
 extern bitflags<flag> mask;
 extern bool enable_color_codes;
 
+// if set, replaces `mask` for the calling thread; lets work running alongside
+// other output (e.g. qbsp's concurrent collision hulls) keep quiet without
+// touching the global mask
+extern thread_local std::optional<bitflags<flag>> thread_mask;
+
+inline bitflags<flag> current_mask()
+{
+    return thread_mask.value_or(mask);
+}
+
 // Windows: calls SetConsoleMode for ANSI escape sequence processing (so colors work)
 void preinitialize();
 
@@ -87,7 +97,7 @@ void vprint(fmt::string_view format, fmt::format_args args);
 template<typename... T>
 inline void print(flag type, fmt::format_string<T...> format, T &&...args)
 {
-    if (mask & type) {
+    if (current_mask() & type) {
         vprint(type, format, fmt::make_format_args(args...));
     }
 }
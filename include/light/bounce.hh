@@ -25,8 +25,10 @@ namespace settings
 class worldspawn_keys;
 }
 struct mbsp_t;
+struct mface_t;
 
 // public functions
 
+bool Face_ShouldBounce(const mbsp_t *bsp, const mface_t *face);
 bool MakeBounceLights(const settings::worldspawn_keys &cfg, const mbsp_t *bsp, size_t depth);
 
@@ -41,7 +41,7 @@ constexpr vec_t MAX_SKY_DIST = 1000000;
 struct lightsample_t
 {
     qvec3f color;
-    qvec3d direction;
+    qvec3f direction;
 };
 
 // CHECK: isn't average a bad algorithm for color brightness?
@@ -112,21 +112,34 @@ struct lightsurf_t
 
     faceextents_t extents, vanilla_extents;
 
-    // width * height sample points in world space
+    // width * height sample points in world space, one array per field
+    // so the per-light loops only stream through what they use
     struct sample_data_t
     {
-        qvec3d point;
-        qvec3d normal;
-        bool occluded;
-        int32_t realfacenum;
+        std::vector<qvec3f> point;
+        std::vector<qvec3f> normal;
+        std::vector<uint8_t> occluded;
+        std::vector<int32_t> realfacenum;
         /*
         raw ambient occlusion amount per sample point, 0-1, where 1 is
         fully occluded. dirtgain/dirtscale are not applied yet
         */
-        float occlusion;
+        std::vector<float> occlusion;
+
+        inline size_t size() const { return point.size(); }
+        inline bool empty() const { return point.empty(); }
+
+        inline void resize(size_t n)
+        {
+            point.resize(n);
+            normal.resize(n);
+            occluded.resize(n);
+            realfacenum.resize(n);
+            occlusion.resize(n);
+        }
     };
 
-    std::vector<sample_data_t> samples;
+    sample_data_t samples;
 
     /*
      pvs for the entire light surface. generated by ORing together
@@ -139,6 +152,29 @@ struct lightsurf_t
     // output height * extra
     int height;
 
+    // -adaptive: state kept between the direct lighting passes
+    struct adaptive_t
+    {
+        // samples.occluded as computed by CalcPoints
+        std::vector<uint8_t> occluded;
+        // samples.occlusion after the first pass
+        std::vector<float> occlusion;
+        // per output luxel: the sample lit in the first pass, or -1 if all are occluded
+        std::vector<int> rep;
+        // per output luxel: supersampled in the second pass
+        std::vector<bool> refined;
+        size_t num_refined = 0;
+        // per style, by sample: the first pass color of each rep from the
+        // lights that add to bounce_color (all but LF_LOCALMIN minlight)
+        std::map<int, std::vector<qvec3f>> bounce_colors;
+    };
+
+    std::unique_ptr<adaptive_t> adaptive;
+
+    // -lightcache: lightmapsByStyle was reused from the previous run,
+    // so the face isn't lit again
+    bool cached = false;
+
     // ray batch stuff
     std::unique_ptr<raystream_occlusion_t> occlusion_stream;
     std::unique_ptr<raystream_intersection_t> intersection_stream;
@@ -163,7 +199,8 @@ enum class debugmodes
     debugneighbours,
     phong_tangents,
     phong_bitangents,
-    mottle
+    mottle,
+    cost
 };
 
 enum class lightfile
@@ -370,6 +407,8 @@ public:
     };
 
     void CheckNoDebugModeSet();
+    // true if the debug mode still needs the regular lighting passes
+    bool DebugModeLights() const;
 
     setting_bool surflight_dump;
     setting_scalar surflight_subdivide;
@@ -383,11 +422,18 @@ public:
     setting_vec3 debugface;
     setting_vec3 debugvert;
     setting_bool highlightseams;
+    setting_bool verifylightindex;
     setting_soft soft;
     setting_set radlights;
     setting_int32 lightmap_scale;
     setting_extra extra;
+    setting_scalar adaptive;
+    setting_int32 tilesize;
+    setting_bool lightcache;
+    setting_bool profile;
     setting_enum<emissivequality_t> emissivequality;
+    setting_scalar lightcuts;
+    setting_bool wavefront;
     setting_enum<visapprox_t> visapprox;
     setting_func lit;
     setting_func lit2;
@@ -404,6 +450,7 @@ public:
     setting_int32 lmshift;
     setting_bool lightgrid;
     setting_vec3 lightgrid_dist;
+    setting_scalar lightgrid_threshold;
     setting_enum<lightgrid_format_t> lightgrid_format;
 
     setting_func dirtdebug;
@@ -414,6 +461,7 @@ public:
     setting_func debugoccluded;
     setting_func debugneighbours;
     setting_func debugmottle;
+    setting_func debugcost;
 
     light_settings();
 
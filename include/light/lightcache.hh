@@ -0,0 +1,67 @@
+/*  Copyright (C) 1996-1997  Id Software, Inc.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+
+    See file, 'COPYING', for details.
+*/
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include <common/fs.hh>
+
+struct mbsp_t;
+struct lightsurf_t;
+
+/*
+ * Incremental relighting cache (-lightcache).
+ *
+ * The cache file stores, for every lightmapped face, the post-processed
+ * lightmaps (and occluded mask) of the previous run together with the hashes
+ * of the light entities that could reach the face (the ones CullLight
+ * doesn't reject).
+ *
+ * A face is reused if the geometry and everything else that isn't a light
+ * entity (the settings that change the output, worldspawn, other entities,
+ * suns, surface light templates) hashes the same, and
+ * the set of lights that can reach it now is the same set of hashes; moving,
+ * editing, adding or removing a light changes the set of every face it
+ * reached or reaches. With -bounce every face depends on every other face,
+ * so either all faces are reused or none are.
+ */
+
+// hashes the current map and loads the cache at `path` if it matches;
+// call after SetupLights
+void LightCache_Load(const mbsp_t *bsp, const fs::path &path);
+
+// fills in lightsurf.lightmapsByStyle and samples.occluded and sets
+// lightsurf.cached if the face can be reused; records the lights reaching
+// the face for LightCache_Write
+void LightCache_Lookup(const mbsp_t *bsp, lightsurf_t &lightsurf);
+
+// undoes a reuse by LightCache_Lookup, so the face is lit from scratch
+void LightCache_Release(const mbsp_t *bsp, lightsurf_t &lightsurf);
+
+// writes the lightmaps of `surfaces` (one per face, before FinishLightmapSurface)
+// to the path given to LightCache_Load
+void LightCache_Write(const mbsp_t *bsp, const std::vector<std::unique_ptr<lightsurf_t>> &surfaces);
+
+void ResetLightCache();
+
+extern std::atomic<uint64_t> total_lightcache_faces, total_lightcache_hits;
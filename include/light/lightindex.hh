@@ -0,0 +1,56 @@
+/*  Copyright (C) 1996-1997  Id Software, Inc.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+
+    See file, 'COPYING', for details.
+*/
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+struct mbsp_t;
+struct lightsurf_t;
+
+/*
+ * Light acceleration structure used by DirectLightFace.
+ *
+ * With -visapprox vis, lights are bucketed by the vis cell (Q1 visleaf / Q2 cluster)
+ * they sit in, so a face only visits the buckets whose bit is set in its pvs.
+ * With -visapprox rays, a BVH over the estimated visible bounds of each light
+ * is queried with the face bounds.
+ *
+ * The index only discards lights that VisCullEntity / CullLight would reject
+ * anyway; LightFace_Entity still performs its own tests on the candidates.
+ */
+
+// builds the index over GetLights(); call after SetupLights
+void SetupLightIndex(const mbsp_t *bsp);
+
+// fills `out` with indices into GetLights(), in ascending order, of the
+// lights that may reach the given surface
+void LightIndex_CandidateLights(const lightsurf_t &lightsurf, std::vector<uint32_t> &out);
+
+// -verifylightindex: counts the lights that pass the vis and sphere culls
+// LightFace_Entity would do, but are missing from `candidates`
+uint32_t LightIndex_MissedLights(
+    const mbsp_t *bsp, const lightsurf_t &lightsurf, const std::vector<uint32_t> &candidates);
+
+void ResetLightIndex();
+
+extern std::atomic<uint64_t> total_lightindex_faces, total_lightindex_lights, total_lightindex_culled,
+    total_lightindex_missed;
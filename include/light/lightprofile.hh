@@ -0,0 +1,96 @@
+/*  Copyright (C) 1996-1997  Id Software, Inc.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+
+    See file, 'COPYING', for details.
+*/
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+
+#include <common/fs.hh>
+
+struct mbsp_t;
+struct lightsurf_t;
+
+/*
+ * Per-face and per-light cost profiling (-profile, -debugcost).
+ *
+ * A profile_scope_t around each lighting stage of a face adds its wall time
+ * and the rays traced inside it to the face; scopes nest (e.g. negative
+ * lights inside post-processing) and only count their own time, so the
+ * stages of a face add up to the time spent lighting it. Scopes given a
+ * light number also add to that light's totals.
+ *
+ * With -wavefront, point light rays are traced when the batches are flushed,
+ * outside any face; they are counted but their trace time isn't.
+ */
+
+enum class profile_stage_t
+{
+    dirt,
+    entity,
+    sky,
+    surface,
+    bounce,
+    postprocess,
+    TOTAL
+};
+
+struct profile_scope_t
+{
+    int facenum = -1;
+    profile_stage_t stage;
+    int lightnum;
+
+    std::chrono::steady_clock::time_point start;
+    // time spent in nested scopes
+    std::chrono::steady_clock::duration nested{};
+    uint64_t rays = 0;
+
+    profile_scope_t *parent = nullptr;
+
+    // no-op unless -profile or -debugcost is in use
+    profile_scope_t(const mbsp_t *bsp, const lightsurf_t *lightsurf, profile_stage_t stage, int lightnum = -1);
+    ~profile_scope_t();
+
+    profile_scope_t(const profile_scope_t &) = delete;
+    profile_scope_t &operator=(const profile_scope_t &) = delete;
+};
+
+extern thread_local profile_scope_t *profile_current_scope;
+
+// adds rays traced by the current thread to the innermost scope
+inline void Profile_CountRays(uint64_t count)
+{
+    if (profile_current_scope) {
+        profile_current_scope->rays += count;
+    }
+}
+
+// call after SetupLights
+void Profile_Setup(const mbsp_t *bsp);
+bool Profile_Enabled();
+
+// total profiled seconds of the face, and the largest over all faces
+double Profile_FaceSeconds(int facenum);
+double Profile_MaxFaceSeconds();
+
+// writes faces and lights, most expensive first
+void Profile_Write(const mbsp_t *bsp, const fs::path &path);
+
+void ResetProfile();
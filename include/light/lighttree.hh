@@ -0,0 +1,92 @@
+/*  Copyright (C) 1996-1997  Id Software, Inc.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+
+    See file, 'COPYING', for details.
+*/
+
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+#include <common/qvec.hh>
+#include <common/aabb.hh>
+#include <light/surflight.hh>
+
+struct mleaf_t;
+struct mbsp_t;
+struct lightsurf_t;
+
+/*
+ * Lightcuts-style light tree over surface light / bounce light points (-lightcuts).
+ *
+ * One binary tree is built per (style, omnidirectional, rescale) for the
+ * emitters of a single bounce level. For each lightsurf a cut through the
+ * tree is chosen so that the upper bound on the error of every clustered node
+ * is below `-lightcuts` times the estimated total contribution. Clustered
+ * nodes are shaded from a representative point carrying the summed power of
+ * their emitters; leaves are shaded exactly as the per-point path does.
+ */
+
+struct lighttree_emitter_t
+{
+    qvec3f pos;
+    const surfacelight_t *vpl;
+    const surfacelight_t::per_style_t *setting;
+    const mleaf_t *leaf;
+};
+
+struct lighttree_node_t
+{
+    // bounds of the emitter points
+    aabb3f bounds;
+    // union of the estimated visible bounds of the surface lights, for -visapprox rays
+    aabb3d cullbounds;
+    // bounding cone of the emitter normals
+    qvec3f axis;
+    float cos_half_angle;
+    // sum of color * intensity of the emitters
+    qvec3d power;
+    // representative emitter
+    uint32_t rep;
+    // leaf if count != 0, in which case first indexes emitters;
+    // otherwise first is the left child and first + 1 the right child
+    uint32_t first;
+    uint32_t count;
+};
+
+struct lighttree_t
+{
+    int32_t style;
+    bool omnidirectional;
+    bool rescale;
+
+    std::vector<lighttree_emitter_t> emitters;
+    std::vector<lighttree_node_t> nodes;
+};
+
+// rebuilds the trees from EmissiveLightSurfaces() for the given bounce level
+// (std::nullopt for direct surface lights). trees of other levels are kept, but
+// point into the surface lights, so rebuild them after adding bounce lights
+void BuildLightTrees(std::optional<size_t> bounce_depth);
+const std::vector<lighttree_t> &LightTrees(std::optional<size_t> bounce_depth);
+
+// selects the cut through `tree` for the given lightsurf; returns node indices
+void LightTree_SelectCut(const mbsp_t *bsp, const lighttree_t &tree, const lightsurf_t *lightsurf, float scale,
+    float hotspot_clamp, float gate, std::vector<uint32_t> &cut);
+
+void ResetLightTree();
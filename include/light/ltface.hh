@@ -23,9 +23,11 @@
 
 #include <atomic>
 #include <memory>
+#include <vector>
 
 struct mface_t;
 struct mbsp_t;
+struct mleaf_t;
 
 namespace settings
 {
@@ -35,28 +37,68 @@ struct lightsurf_t;
 struct bspx_decoupled_lm_perface;
 class faceextents_t;
 class light_t;
+class lightmap_t;
 struct facesup_t;
 
 extern std::atomic<uint32_t> total_light_rays, total_light_ray_hits, total_samplepoints;
 extern std::atomic<uint32_t> total_bounce_rays, total_bounce_ray_hits;
 extern std::atomic<uint32_t> total_surflight_rays, total_surflight_ray_hits; // mxd
+extern std::atomic<uint64_t> total_lightcuts, total_lightcut_nodes;
+extern std::atomic<uint64_t> total_adaptive_luxels, total_adaptive_refined;
 extern std::atomic<uint32_t> fully_transparent_lightmaps;
 
 void PrintFaceInfo(const mface_t *face, const mbsp_t *bsp);
 // FIXME: remove light param. add normal param and dir params.
 vec_t GetLightValue(const settings::worldspawn_keys &cfg, const light_t *entity, vec_t dist);
 void SetupDirt(settings::worldspawn_keys &cfg);
+bool VisCullEntity(const mbsp_t *bsp, const std::vector<uint8_t> &pvs, const mleaf_t *entleaf);
+// false if CullLight rejects the light for every sample of the surface
+bool Light_CanReachSurface(const light_t *entity, const lightsurf_t *lightsurf);
 std::unique_ptr<lightsurf_t> CreateLightmapSurface(const mbsp_t *bsp, const mface_t *face, const facesup_t *facesup,
     const bspx_decoupled_lm_perface *facesup_decoupled, const settings::worldspawn_keys &cfg);
 bool Face_IsLightmapped(const mbsp_t *bsp, const mface_t *face);
 bool Face_IsEmissive(const mbsp_t *bsp, const mface_t *face);
 void DirectLightFace(const mbsp_t *bsp, lightsurf_t &lightsurf, const settings::worldspawn_keys &cfg);
+// -wavefront: DirectLightFace split in two. QueueDirectLightFace queues the point light rays
+// on a per-thread wavefront, FlushDirectLightWavefronts traces them, then FinishDirectLightFace
+// does the rest. All faces have to finish a pass before the next one is queued.
+int DirectLightPasses();
+void QueueDirectLightFace(const mbsp_t *bsp, lightsurf_t &lightsurf, const settings::worldspawn_keys &cfg, int pass);
+void FlushDirectLightWavefronts();
+void FinishDirectLightFace(const mbsp_t *bsp, lightsurf_t &lightsurf, const settings::worldspawn_keys &cfg, int pass);
+void DirtLightFace(const mbsp_t *bsp, lightsurf_t &lightsurf);
 void IndirectLightFace(const mbsp_t *bsp, lightsurf_t &lightsurf, const settings::worldspawn_keys &cfg, size_t bounce_depth);
 void PostProcessLightFace(const mbsp_t *bsp, lightsurf_t &lightsurf, const settings::worldspawn_keys &cfg);
+void CostDebugLightFace(const mbsp_t *bsp, lightsurf_t &lightsurf, float cost);
 void FinishLightmapSurface(const mbsp_t *bsp, lightsurf_t *lightsurf);
-void SaveLightmapSurface(const mbsp_t *bsp, mface_t *face, facesup_t *facesup,
+
+// one lightmap output of a face; a face with both LMSHIFT and vanilla output has two
+struct lightmap_save_t
+{
+    mface_t *face;
+    facesup_t *facesup;
+    bspx_decoupled_lm_perface *facesup_decoupled;
+    lightsurf_t *lightsurf;
+    const faceextents_t *extents;
+    const faceextents_t *output_extents;
+
+    // lightmaps to write, in output style order
+    std::vector<const lightmap_t *> sorted;
+
+    // filled in by AllocateLightmapSurface
+    uint8_t *out = nullptr, *lit = nullptr, *lux = nullptr;
+    uint8_t *vanilla_out = nullptr, *vanilla_lit = nullptr, *vanilla_lux = nullptr;
+};
+
+// Saving a lightmap is split in three so the output layout doesn't depend on thread scheduling:
+// PlanLightmapSurface picks the styles and updates the face info (thread-safe per face),
+// AllocateLightmapSurface reserves file space and sets the offsets (call serially, in face order),
+// WriteLightmapSurface fills in the reserved space (thread-safe per face).
+lightmap_save_t PlanLightmapSurface(const mbsp_t *bsp, mface_t *face, facesup_t *facesup,
     bspx_decoupled_lm_perface *facesup_decoupled, lightsurf_t *lightsurf, const faceextents_t &extents,
     const faceextents_t &output_extents);
+void AllocateLightmapSurface(const mbsp_t *bsp, lightmap_save_t &save);
+void WriteLightmapSurface(const mbsp_t *bsp, const lightmap_save_t &save);
 
 struct lightgrid_sample_t
 {
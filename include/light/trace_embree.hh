@@ -21,8 +21,11 @@
 
 #include <common/aligned_allocator.hh>
 #include <common/qvec.hh>
+#include <common/aabb.hh>
 #include <common/log.hh> // for FError
 
+#include <algorithm>
+#include <functional>
 #include <vector>
 
 struct mbsp_t;
@@ -345,4 +348,159 @@ public:
     inline bool getPushedRayOccluded(size_t j) { return (_rays[j].tfar < 0.0f); }
 
     inline qvec3d getPushedRayDir(size_t j) { return {_rays[j].dir_x, _rays[j].dir_y, _rays[j].dir_z}; }
-};
\ No newline at end of file
+};
+
+/*
+ * Wavefront ray scheduler (-wavefront).
+ *
+ * Occlusion rays from many faces and lights are queued (one queue per thread)
+ * instead of being traced a face at a time. Once the queue is full it is
+ * traced in large batches: rays are grouped by shadow context (self, shadowmask)
+ * and sorted by direction octant and the morton code of their origin for
+ * coherence. The unoccluded rays are then handed to `scatter` in push order, so
+ * accumulation order is the same as with the per-face raystreams.
+ */
+template<typename Payload>
+class raystream_wavefront_t
+{
+public:
+    // called for every unoccluded ray; color has glass tinting applied
+    using scatter_fn = std::function<void(Payload &payload, const qvec3f &color, int dynamic_style)>;
+
+private:
+    struct queued_ray_t
+    {
+        qvec3f origin;
+        qvec3f dir;
+        float dist;
+        qvec3f color;
+        const modelinfo_t *self;
+        int shadowmask;
+    };
+
+    size_t _capacity;
+    scatter_fn _scatter;
+
+    std::vector<queued_ray_t> _queue;
+    std::vector<Payload> _payloads;
+
+    // scratch, reused between flushes
+    raystream_occlusion_t _batch;
+    std::vector<std::pair<uint64_t, uint32_t>> _order;
+    std::vector<uint8_t> _occluded;
+    std::vector<qvec3f> _colors;
+    std::vector<int> _dynamic_styles;
+
+    static uint32_t expandBits(uint32_t v)
+    {
+        v = (v * 0x00010001u) & 0xFF0000FFu;
+        v = (v * 0x00000101u) & 0x0F00F00Fu;
+        v = (v * 0x00000011u) & 0xC30C30C3u;
+        v = (v * 0x00000005u) & 0x49249249u;
+        return v;
+    }
+
+public:
+    inline raystream_wavefront_t(size_t capacity, scatter_fn scatter)
+        : _capacity(capacity), _scatter(std::move(scatter)), _batch(capacity)
+    {
+        _queue.reserve(capacity);
+        _payloads.reserve(capacity);
+    }
+
+    inline size_t numQueuedRays() const { return _queue.size(); }
+
+    inline void pushRay(const modelinfo_t *self, int shadowmask, const qvec3d &origin, const qvec3d &dir, float dist,
+        const qvec3f &color, const Payload &payload)
+    {
+        _queue.push_back({origin, dir, dist, color, self, shadowmask});
+        _payloads.push_back(payload);
+
+        if (_queue.size() >= _capacity) {
+            flush();
+        }
+    }
+
+    void flush()
+    {
+        const size_t n = _queue.size();
+
+        if (!n) {
+            return;
+        }
+
+        // assign shadow contexts in order of appearance
+        std::vector<std::pair<const modelinfo_t *, int>> groups;
+        aabb3f bounds;
+
+        for (const auto &ray : _queue) {
+            bounds += ray.origin;
+        }
+
+        const qvec3f extent = bounds.size();
+        const float scale = 1023.0f / std::max({extent[0], extent[1], extent[2], 1.0f});
+
+        _order.resize(n);
+
+        for (size_t i = 0; i < n; i++) {
+            const auto &ray = _queue[i];
+            const auto context = std::make_pair(ray.self, ray.shadowmask);
+
+            auto it = std::find(groups.begin(), groups.end(), context);
+            const uint64_t group = it - groups.begin();
+            if (it == groups.end()) {
+                groups.push_back(context);
+            }
+
+            const uint32_t octant = (ray.dir[0] < 0 ? 1 : 0) | (ray.dir[1] < 0 ? 2 : 0) | (ray.dir[2] < 0 ? 4 : 0);
+            const qvec3f cell = (ray.origin - bounds.mins()) * scale;
+            const uint32_t morton = (expandBits(static_cast<uint32_t>(cell[0])) << 2) |
+                                    (expandBits(static_cast<uint32_t>(cell[1])) << 1) |
+                                    expandBits(static_cast<uint32_t>(cell[2]));
+
+            _order[i] = {(group << 33) | (static_cast<uint64_t>(octant) << 30) | morton, static_cast<uint32_t>(i)};
+        }
+
+        std::sort(_order.begin(), _order.end());
+
+        _occluded.resize(n);
+        _colors.resize(n);
+        _dynamic_styles.resize(n);
+
+        // trace each shadow context as one batch
+        for (size_t start = 0; start < n;) {
+            const uint64_t group = _order[start].first >> 33;
+            const auto &context = groups[group];
+
+            _batch.clearPushedRays();
+
+            size_t end = start;
+            for (; end < n && (_order[end].first >> 33) == group; end++) {
+                const auto &ray = _queue[_order[end].second];
+                _batch.pushRay(_order[end].second, ray.origin, ray.dir, ray.dist, &ray.color);
+            }
+
+            _batch.tracePushedRaysOcclusion(context.first, context.second);
+
+            for (size_t j = 0; j < _batch.numPushedRays(); j++) {
+                const int i = _batch.getPushedRayPointIndex(j);
+                _occluded[i] = _batch.getPushedRayOccluded(j);
+                _colors[i] = _batch.getPushedRayColor(j);
+                _dynamic_styles[i] = _batch.getPushedRayDynamicStyle(j);
+            }
+
+            start = end;
+        }
+
+        // scatter in push order
+        for (size_t i = 0; i < n; i++) {
+            if (!_occluded[i]) {
+                _scatter(_payloads[i], _colors[i], _dynamic_styles[i]);
+            }
+        }
+
+        _queue.clear();
+        _payloads.clear();
+    }
+};
+
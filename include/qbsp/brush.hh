@@ -42,6 +42,7 @@ struct side_t
     bool onnode; // has this face been used as a BSP node plane yet?
     bool bevel; // don't ever use for bsp splitting
     mapface_t *source; // the mapface we were generated from
+    uint8_t hull; // index into source->visible
 
     bool tested;
 
@@ -0,0 +1,189 @@
+/*
+    Copyright (C) 1996-1997  Id Software, Inc.
+    Copyright (C) 1997       Greg Lewis
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+
+    See file, 'COPYING', for details.
+*/
+
+#pragma once
+
+#include <common/qvec.hh>
+
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <unordered_map>
+#include <vector>
+
+/*
+ * Maps points to values, finding them by points that are equal within an
+ * epsilon: a point matches if none of its components differs by more than
+ * half the epsilon of that axis.
+ *
+ * Points are hashed by the grid cell they fall in. Cells are a few epsilons
+ * wide and centered on multiples of their width, so most lookups (including
+ * the axial normals and whole distances most planes have) only visit one
+ * cell; a lookup near the edge of a cell also visits the neighbours the
+ * epsilon box overlaps.
+ *
+ * The cells are split into stripes with a lock each, so find and insert can
+ * be called from multiple threads. Nothing is ever removed, so the values can
+ * be indices into a vector that only grows.
+ */
+template<size_t N, typename T>
+class epsilon_hash_t
+{
+    using cell_t = std::array<int64_t, N>;
+
+    struct entry_t
+    {
+        qvec<vec_t, N> point;
+        T value;
+    };
+
+    static uint64_t hash_cell(const cell_t &cell)
+    {
+        uint64_t hash = 0;
+
+        for (int64_t c : cell) {
+            hash ^= static_cast<uint64_t>(c) + 0x9e3779b97f4a7c15ull + (hash << 6) + (hash >> 2);
+        }
+
+        return hash;
+    }
+
+    struct cell_hash_t
+    {
+        size_t operator()(const cell_t &cell) const { return static_cast<size_t>(hash_cell(cell)); }
+    };
+
+    struct stripe_t
+    {
+        std::shared_mutex mutex;
+        std::unordered_map<cell_t, std::vector<entry_t>, cell_hash_t> cells;
+    };
+
+    // width of a cell, in epsilons
+    static constexpr vec_t CELL_EPSILONS = 4;
+    static constexpr size_t NUM_STRIPES = 64;
+
+    qvec<vec_t, N> half_epsilon;
+    qvec<vec_t, N> inv_cell_size;
+    mutable std::array<stripe_t, NUM_STRIPES> stripes;
+    std::atomic_size_t count = 0;
+
+    int64_t cell_of(size_t axis, vec_t value) const
+    {
+        return static_cast<int64_t>(std::floor(value * inv_cell_size[axis] + 0.5));
+    }
+
+    stripe_t &stripe_of(const cell_t &cell) const
+    {
+        // the top bits of the 64-bit hash, since the low ones pick the bucket
+        // within the stripe (and are all size_t has on 32-bit targets)
+        return stripes[(hash_cell(cell) >> 32) % NUM_STRIPES];
+    }
+
+public:
+    explicit epsilon_hash_t(const qvec<vec_t, N> &epsilon)
+    {
+        for (size_t i = 0; i < N; i++) {
+            half_epsilon[i] = epsilon[i] * 0.5;
+            inv_cell_size[i] = 1.0 / (epsilon[i] * CELL_EPSILONS);
+        }
+    }
+
+    epsilon_hash_t(const epsilon_hash_t &) = delete;
+    epsilon_hash_t &operator=(const epsilon_hash_t &) = delete;
+
+    // returns the value of a matching point; if there's more than one, the
+    // smallest value, which for indices handed out in order is the first one
+    // added
+    std::optional<T> find(const qvec<vec_t, N> &point) const
+    {
+        cell_t first, last;
+
+        for (size_t i = 0; i < N; i++) {
+            first[i] = cell_of(i, point[i] - half_epsilon[i]);
+            last[i] = cell_of(i, point[i] + half_epsilon[i]);
+        }
+
+        std::optional<T> result;
+        cell_t cell = first;
+
+        while (true) {
+            stripe_t &stripe = stripe_of(cell);
+
+            {
+                std::shared_lock lock(stripe.mutex);
+
+                if (auto it = stripe.cells.find(cell); it != stripe.cells.end()) {
+                    for (const entry_t &entry : it->second) {
+                        bool match = true;
+
+                        for (size_t i = 0; i < N; i++) {
+                            if (std::abs(entry.point[i] - point[i]) > half_epsilon[i]) {
+                                match = false;
+                                break;
+                            }
+                        }
+
+                        if (match && (!result || entry.value < *result)) {
+                            result = entry.value;
+                        }
+                    }
+                }
+            }
+
+            // next cell overlapped by the epsilon box
+            size_t i = 0;
+
+            for (; i < N; i++) {
+                if (cell[i] < last[i]) {
+                    cell[i]++;
+                    break;
+                }
+
+                cell[i] = first[i];
+            }
+
+            if (i == N) {
+                return result;
+            }
+        }
+    }
+
+    void insert(const qvec<vec_t, N> &point, const T &value)
+    {
+        cell_t cell;
+
+        for (size_t i = 0; i < N; i++) {
+            cell[i] = cell_of(i, point[i]);
+        }
+
+        stripe_t &stripe = stripe_of(cell);
+        std::unique_lock lock(stripe.mutex);
+        stripe.cells[cell].push_back({point, value});
+        count++;
+    }
+
+    size_t size() const { return count; }
+};
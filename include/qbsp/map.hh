@@ -37,6 +37,8 @@
 #include <shared_mutex>
 #include <string_view>
 
+#include <tbb/concurrent_vector.h>
+
 struct mapface_t
 {
     size_t planenum;
@@ -68,9 +70,11 @@ struct mapface_t
     // with no transformations; this is for conversions only.
     std::optional<extended_texinfo_t> raw_info;
 
-    bool visible; // can any part of this side be seen from non-void parts of the level?
-                  // non-visible means we can discard the brush side
-                  // (avoiding generating a BSP spit, so expanding it outwards)
+    // can any part of this side be seen from non-void parts of the level?
+    // non-visible means we can discard the brush side
+    // (avoiding generating a BSP spit, so expanding it outwards).
+    // kept per hull, since the collision hulls are built concurrently
+    std::array<bool, MAX_MAP_HULLS_H2> visible{};
 
     // this face is a bevel added by AddBrushBevels, and shouldn't be used as a splitter
     // for the main hull.
@@ -180,6 +184,28 @@ struct hashedge_t
     const face_t *face;
 };
 
+// the edges emitted for the current model, by their vertices; an
+// open-addressing table, since every face edge is looked up in it
+class hashedge_table_t
+{
+    // empty slots have no face
+    std::vector<hashedge_t> slots;
+    size_t count = 0;
+
+    size_t slot_of(size_t v1, size_t v2) const;
+
+public:
+    // makes room for `edges` edges without growing
+    void reserve(size_t edges);
+    const hashedge_t *find(size_t v1, size_t v2) const;
+    // keeps the existing edge if v1 -> v2 was already added
+    void emplace(const hashedge_t &edge);
+    void clear();
+
+    bool empty() const { return !count; }
+    size_t size() const { return count; }
+};
+
 struct mapdata_t
 {
     /* Arrays of actual items */
@@ -192,9 +218,13 @@ struct mapdata_t
     // output in the BSP, from the map's own sides. The positive planes
     // come first (are even-numbered, with 0 being even) and the negative
     // planes are odd-numbered.
-    std::vector<mapplane_t> planes;
+    //
+    // concurrent_vector, since the collision hulls add planes while other
+    // hulls are reading them.
+    tbb::concurrent_vector<mapplane_t> planes;
 
-    // planes indices (into the `planes` vector)
+    // planes indices (into the `planes` vector); add_plane and the
+    // find functions are safe to call from multiple threads
     std::unique_ptr<planehash_t> plane_hash;
 
     mapdata_t();
@@ -230,7 +260,7 @@ struct mapdata_t
     void add_hash_vector(const qvec3d &point, const size_t &num);
 
     // hashed edges; generated by EmitEdges
-    std::map<std::pair<size_t, size_t>, hashedge_t> hashedges;
+    hashedge_table_t hashedges;
 
     void add_hash_edge(size_t v1, size_t v2, int64_t edge_index, const face_t *face);
 
@@ -22,16 +22,32 @@
 #pragma once
 
 #include <fstream>
+#include <optional>
 #include <vector>
 #include <qbsp/brush.hh>
 #include <common/qvec.hh>
 
 struct node_t;
 struct tree_t;
+struct portal_t;
 
 void WriteLeakTrail(std::ofstream &leakfile, qvec3d point1, const qvec3d &point2);
 
-bool FillOutside(tree_t &tree, hull_index_t hullnum, bspbrush_t::container &brushes);
+// a leak found by FillOutside; `line` points into the tree's portals
+struct leak_t
+{
+    const mapentity_t *entity;
+    std::vector<portal_t *> line;
+};
+
+// if `deferred_leak` is given, a leak is stored there for WriteLeak instead of
+// being written right away; used by the concurrent collision hulls so that
+// the leak file comes from the first leaking hull, as when they run in order
+bool FillOutside(
+    tree_t &tree, hull_index_t hullnum, bspbrush_t::container &brushes, std::optional<leak_t> *deferred_leak = nullptr);
+
+// writes the .pts (and debug) files for the leak, unless one was already written
+void WriteLeak(const leak_t &leak);
 void MarkBrushSidesInvisible(bspbrush_t::container &brushes);
 
 void FillBrushEntity(tree_t &tree, hull_index_t hullnum, bspbrush_t::container &brushes);
@@ -30,6 +30,7 @@
 #include <vector>
 
 #include <tbb/concurrent_vector.h>
+#include <tbb/enumerable_thread_specific.h>
 
 struct portal_t;
 struct tree_t;
@@ -51,6 +52,16 @@ struct tree_t
     // promises not to move elements so we can omit the std::unique_ptr wrapper.
     tbb::concurrent_vector<node_t> nodes;
 
+    // the brush fragments BrushBSP splits off, for the same reasons. the
+    // handles create_brush_fragment hands out don't own them, so passing them
+    // around the build doesn't touch a reference count, and they're all freed
+    // at once by free_brush_fragments(), clear() or with the tree
+    tbb::concurrent_vector<bspbrush_t> brush_fragments;
+
+    // fragments that were split or thrown away, per thread, to be reused by
+    // create_brush_fragment before the vector grows
+    tbb::enumerable_thread_specific<std::vector<bspbrush_t *>> recycled_brush_fragments;
+
     // creates a new portal owned by `this` (stored in the `portals` vector) and
     // returns a raw pointer to it
     portal_t *create_portal();
@@ -59,6 +70,17 @@ struct tree_t
     // returns a raw pointer to it
     node_t *create_node();
 
+    // creates a new brush fragment owned by `this` (stored in the
+    // `brush_fragments` vector) and returns a non-owning handle to it
+    bspbrush_t::ptr create_brush_fragment();
+
+    // hands a fragment back for reuse; nothing else may still point to it.
+    // does nothing for brushes that aren't fragments
+    void recycle_brush_fragment(const bspbrush_t::ptr &brush);
+
+    // frees all of the brush fragments; nothing may still point to them
+    void free_brush_fragments();
+
     // reset the tree without clearing allocated vector space
     void clear();
 };
@@ -131,6 +131,70 @@ struct viswinding_t
 
 static_assert(std::is_trivially_default_constructible_v<viswinding_t>);
 
+/**
+ * Points of a winding transposed into x, y and z arrays, so that the
+ * distances of all of them to a plane are evaluated 4 (AVX) or 2 (SSE2)
+ * points at a time. The arithmetic is the same as qplane3d::distance_to,
+ * in the same order, so the distances (and the VIS_ON_EPSILON tests made
+ * on them) match the scalar ones exactly; only a build that lets the
+ * compiler contract distance_to into FMAs can differ, in the last bit.
+ */
+struct viswinding_soa_t
+{
+    // rounded up to whole vectors; the padding is zeroed
+    alignas(32) vec_t x[MAX_WINDING], y[MAX_WINDING], z[MAX_WINDING];
+    size_t numpoints;
+
+    inline void load(const viswinding_t &w)
+    {
+        numpoints = w.size();
+
+        for (size_t i = 0; i < numpoints; i++) {
+            x[i] = w[i][0];
+            y[i] = w[i][1];
+            z[i] = w[i][2];
+        }
+        for (size_t i = numpoints; i < ((numpoints + 3) & ~size_t(3)); i++) {
+            x[i] = y[i] = z[i] = 0;
+        }
+    }
+
+    // writes numpoints distances, rounded up to a multiple of 4
+    inline void distances(const qplane3d &plane, vec_t *out) const
+    {
+        size_t i = 0;
+
+#if defined(__AVX__)
+        const __m256d nx = _mm256_set1_pd(plane.normal[0]);
+        const __m256d ny = _mm256_set1_pd(plane.normal[1]);
+        const __m256d nz = _mm256_set1_pd(plane.normal[2]);
+        const __m256d dist = _mm256_set1_pd(plane.dist);
+
+        for (; i < numpoints; i += 4) {
+            const __m256d yz = _mm256_add_pd(
+                _mm256_mul_pd(_mm256_load_pd(y + i), ny), _mm256_mul_pd(_mm256_load_pd(z + i), nz));
+            const __m256d dot = _mm256_add_pd(_mm256_mul_pd(_mm256_load_pd(x + i), nx), yz);
+            _mm256_storeu_pd(out + i, _mm256_sub_pd(dot, dist));
+        }
+#elif defined(__SSE2__)
+        const __m128d nx = _mm_set1_pd(plane.normal[0]);
+        const __m128d ny = _mm_set1_pd(plane.normal[1]);
+        const __m128d nz = _mm_set1_pd(plane.normal[2]);
+        const __m128d dist = _mm_set1_pd(plane.dist);
+
+        for (; i < numpoints; i += 2) {
+            const __m128d yz = _mm_add_pd(_mm_mul_pd(_mm_load_pd(y + i), ny), _mm_mul_pd(_mm_load_pd(z + i), nz));
+            const __m128d dot = _mm_add_pd(_mm_mul_pd(_mm_load_pd(x + i), nx), yz);
+            _mm_storeu_pd(out + i, _mm_sub_pd(dot, dist));
+        }
+#else
+        for (; i < numpoints; i++) {
+            out[i] = (x[i] * plane.normal[0] + (y[i] * plane.normal[1] + z[i] * plane.normal[2])) - plane.dist;
+        }
+#endif
+    }
+};
+
 struct visportal_t
 {
     qplane3d plane; // normal pointing into neighbor
@@ -175,6 +239,7 @@ struct pstack_t
     int numseparators[2];
     char did_targetchecks;
     unsigned num_expected_targetchecks;
+    unsigned depth; // leafs from the source portal
 };
 
 // important for perf as a ton of these are stack allocated, needs to be be just a pointer bump
@@ -214,6 +279,8 @@ struct visstats_t
 viswinding_t *AllocStackWinding(pstack_t &stack);
 void FreeStackWinding(viswinding_t *&w, pstack_t &stack);
 viswinding_t *ClipStackWinding(visstats_t &stats, viswinding_t *in, pstack_t &stack, const qplane3d &split);
+viswinding_t *ClipStackWindingPlanes(
+    visstats_t &stats, viswinding_t *in, pstack_t &stack, const qplane3d *splits, size_t numsplits);
 
 struct threaddata_t
 {
@@ -223,6 +290,7 @@ struct threaddata_t
     visstats_t stats;
     unsigned numsteps;
     unsigned numtargetchecks;
+    unsigned maxdepth;
 };
 
 extern int numportals;
@@ -250,8 +318,18 @@ void CalcPHS(mbsp_t *bsp);
 extern time_point starttime, endtime, statetime;
 
 void SaveVisState(void);
+void StartVisCheckpoint(void);
+void AppendVisState(const visportal_t &p);
+void FlushVisState(void);
 bool LoadVisState(void);
 void CleanVisState(void);
+void ResetVisState(void);
+
+// hash of each portal's geometry, the same in every run on the same portal file
+const std::vector<uint64_t> &PortalHashes();
+
+fs::path VisWorkerStateFile(int32_t worker);
+std::vector<visportal_t *> MergeVisWorkers(void);
 
 #include <common/settings.hh>
 #include <common/fs.hh>
@@ -275,12 +353,24 @@ public:
     setting_scalar visdist{
         this, "visdist", 0.0, &vis_advanced_group, "control the distance required for a portal to be considered seen"};
     setting_bool nostate{this, "nostate", false, &vis_advanced_group, "ignore saved state files, for forced re-runs"};
+    setting_bool incremental{this, "incremental", false, &vis_advanced_group,
+        "keep the state file, and when the portal file changes reuse the results of portals that weren't affected"};
+    setting_bool noportalbvh{this, "noportalbvh", false, &vis_advanced_group,
+        "test every pair of portals in the base vis instead of finding candidates with a BVH"};
     setting_bool phsonly{
         this, "phsonly", false, &vis_advanced_group, "re-calculate the PHS of a Quake II BSP without touching the PVS"};
     setting_invertible_bool autoclean{
         this, "autoclean", true, &vis_output_group, "remove any extra files on successful completion"};
     setting_scalar targetratio{this, "targetchecks", 0.5, 0.0, 9999.0, &performance_group,
         "target ratio of target checks to regular checks (0.0 = no target checks, 1.0 = equal amounts of regular and target checks)"};
+    setting_int32 phsmemory{this, "phsmemory", 1024, 0, std::numeric_limits<int32_t>::max(), &performance_group,
+        "MiB of decompressed PVS rows to keep in memory while calculating the PHS; the rest are decompressed as needed"};
+    setting_bool profile{this, "profile", false, &performance_group,
+        "write the time and work of every portal and leaf, most expensive first, to mapname.visprofile.json"};
+    setting_int32 workers{this, "workers", 0, 0, 4096, &performance_group,
+        "split the full vis between this many vis processes; without -worker, merge their results and finish the vis"};
+    setting_int32 worker{this, "worker", -1, -1, 4095, &performance_group,
+        "with -workers, calculate this process's share of the portals (numbered from 0) and save it for merging"};
 
     fs::path sourceMap;
 
@@ -0,0 +1,68 @@
+/*  Copyright (C) 1996-1997  Id Software, Inc.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+
+    See file, 'COPYING', for details.
+*/
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include <common/cmdlib.hh>
+#include <common/fs.hh>
+
+struct visportal_t;
+struct visstats_t;
+
+/*
+ * Per-portal cost telemetry and the full vis time estimate (-profile).
+ *
+ * Each portal flowed records its wall time and the work it did, and the
+ * numbers are kept in the state file with its results. The time of a portal
+ * grows roughly as a power of the number of leafs it might see, so a least
+ * squares fit of log(seconds) against log(nummightsee) over the finished
+ * portals predicts the time of the others. The progress bar and the ETA are
+ * in predicted seconds rather than portals, since GetNextPortal hands out
+ * the cheap portals first.
+ */
+
+struct portalcost_t
+{
+    float seconds = 0;
+    uint32_t nummightsee = 0; // when the flow started
+    uint32_t numsteps = 0; // portals flowed through
+    uint32_t maxdepth = 0; // deepest recursion
+    uint32_t portalchecks = 0;
+    uint32_t portaltests = 0;
+    uint32_t targetchecks = 0;
+};
+
+// by portal number; written by the thread flowing the portal
+extern std::vector<portalcost_t> portal_costs;
+
+void VisCost_Setup();
+
+// call around the full vis, once the portals that are already done are known
+void VisCost_StartProgress();
+void VisCost_EndProgress();
+
+// records a flowed portal (PortalFlow fills in numsteps and maxdepth) and
+// updates the progress bar
+void VisCost_Record(const visportal_t *p, const visstats_t &stats, duration elapsed);
+
+// writes the portals and leafs, most expensive first
+void VisCost_WriteReport(const fs::path &path);
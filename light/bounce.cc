@@ -39,7 +39,7 @@
 #include <common/qvec.hh>
 #include <common/parallel.hh>
 
-static bool Face_ShouldBounce(const mbsp_t *bsp, const mface_t *face)
+bool Face_ShouldBounce(const mbsp_t *bsp, const mface_t *face)
 {
     // make bounce light, only if this face is shadow casting
     const modelinfo_t *mi = ModelInfoForFace(bsp, Face_GetNum(bsp, face));
@@ -174,7 +174,8 @@ static bool MakeBounceLightsThread(const settings::worldspawn_keys &cfg, const m
     // grab the average color across the whole set of lightmaps for this face.
     // this doesn't change regardless of the above settings.
     std::unordered_map<int, qvec3d> sum;
-    vec_t sample_divisor = surf.lightmapsByStyle.front().samples.size();
+    // not lightmapsByStyle's sample count, which -tilesize frees before this runs
+    vec_t sample_divisor = surf.width * surf.height;
 
     bool has_any_color = false;
 
@@ -24,6 +24,10 @@
 #include <fmt/chrono.h>
 
 #include <light/lightgrid.hh>
+#include <light/lightcache.hh>
+#include <light/lightprofile.hh>
+#include <light/lightindex.hh>
+#include <light/lighttree.hh>
 #include <light/phong.hh>
 #include <light/bounce.hh>
 #include <light/surflight.hh> //mxd
@@ -50,7 +54,6 @@
 #include <map>
 #include <set>
 #include <algorithm>
-#include <mutex>
 #include <string>
 
 #include <common/qvec.hh>
@@ -297,6 +300,11 @@ void light_settings::CheckNoDebugModeSet()
     }
 }
 
+bool light_settings::DebugModeLights() const
+{
+    return debugmode == debugmodes::none || debugmode == debugmodes::cost;
+}
+
 setting_group worldspawn_group{"Overridable worldspawn keys", 500, expected_source::worldspawn};
 setting_group output_group{"Output format options", 30, expected_source::commandline};
 setting_group debug_group{"Debug modes", 40, expected_source::commandline};
@@ -319,6 +327,8 @@ light_settings::light_settings()
       debugvert{this, "debugvert", std::numeric_limits<vec_t>::quiet_NaN(), std::numeric_limits<vec_t>::quiet_NaN(),
           std::numeric_limits<vec_t>::quiet_NaN(), &debug_group, ""},
       highlightseams{this, "highlightseams", false, &debug_group, ""},
+      verifylightindex{this, "verifylightindex", false, &debug_group,
+          "check every face's light index candidates against a loop over all lights"},
       soft{this, "soft", 0, -1, std::numeric_limits<int32_t>::max(), &postprocessing_group,
           "blurs the lightmap. specify n to blur radius in samples, otherwise auto"},
       radlights{this, "radlights", "\"filename.rad\"", &experimental_group,
@@ -327,10 +337,22 @@ light_settings::light_settings()
           this, "lightmap_scale", 0, &experimental_group, "force change lightmap scale; vanilla engines only allow 16"},
       extra{
           this, {"extra", "extra4"}, 1, &performance_group, "supersampling; 2x2 (extra) or 4x4 (extra4) respectively"},
+      adaptive{this, "adaptive", 0.0, 0.0, 1.0, &performance_group,
+          "with -extra/-extra4, only supersample luxels whose neighbours differ by more than n (e.g. 0.05), 0 supersamples every luxel"},
+      tilesize{this, "tilesize", 0, 0, std::numeric_limits<int32_t>::max(), &performance_group,
+          "light n faces at a time and write their lightmaps as each tile finishes, to bound memory use; 0 lights all faces at once"},
+      lightcache{this, "lightcache", false, &performance_group,
+          "reuse the lightmaps of faces that no changed light reaches from <mapname>.lightcache, and update it"},
+      profile{this, "profile", false, &performance_group,
+          "write the time and rays spent on each face and light to <mapname>.profile.json"},
       emissivequality{this, "emissivequality", emissivequality_t::LOW,
           {{"LOW", emissivequality_t::LOW}, {"MEDIUM", emissivequality_t::MEDIUM}, {"HIGH", emissivequality_t::HIGH}},
           &performance_group,
           "low = one point in the center of the face, med = center + all verts, high = spread points out for antialiasing"},
+      lightcuts{this, "lightcuts", 0.0, 0.0, 1.0, &performance_group,
+          "cluster surface and bounce lights in a light tree; n is the relative error bound (e.g. 0.02), 0 traces every point"},
+      wavefront{this, "wavefront", false, &performance_group,
+          "queue point light rays from many faces and trace them in large sorted batches"},
       visapprox{this, "visapprox", visapprox_t::AUTO,
           {{"auto", visapprox_t::AUTO}, {"none", visapprox_t::NONE}, {"vis", visapprox_t::VIS},
               {"rays", visapprox_t::RAYS}},
@@ -368,6 +390,8 @@ light_settings::light_settings()
           "generates a lightgrid and writes it to a bspx lump (LIGHTGRID_OCTREE)"},
       lightgrid_dist{this, "lightgrid_dist", 32.f, 32.f, 32.f, &experimental_group,
           "distance between lightgrid sample points, in world units. controls lightgrid size."},
+      lightgrid_threshold{this, "lightgrid_threshold", 0.0, 0.0, 255.0, &experimental_group,
+          "interpolate 4x4x4 blocks of lightgrid points whose corners differ by at most n (0-255); 0 lights every point"},
       lightgrid_format{this, "lightgrid_format", lightgrid_format_t::OCTREE, {{"octree", lightgrid_format_t::OCTREE}},
           &experimental_group, "lightgrid BSPX lump to use"},
 
@@ -425,7 +449,14 @@ light_settings::light_settings()
               CheckNoDebugModeSet();
               debugmode = debugmodes::mottle;
           },
-          &debug_group, "save mottle pattern to lightmap"}
+          &debug_group, "save mottle pattern to lightmap"},
+
+      debugcost{this, "debugcost",
+          [&](source) {
+              CheckNoDebugModeSet();
+              debugmode = debugmodes::cost;
+          },
+          &debug_group, "save the time spent lighting each face to the lightmap, from black (none) to white (most)"}
 {
 }
 
@@ -556,19 +587,16 @@ void FixupGlobalSettings()
     }
 }
 
-static std::mutex light_mutex;
-
 /*
- * Return space for the lightmap and colourmap at the same time so it can
- * be done in a thread-safe manner.
+ * Return space for the lightmap and colourmap at the same time.
+ * Not thread-safe; SaveLightmapSurfaces calls this serially in face order
+ * so the lightmap layout is the same on every run.
  *
  * size is the number of greyscale pixels = number of bytes to allocate
  * and return in *lightdata
  */
 void GetFileSpace(uint8_t **lightdata, uint8_t **colordata, uint8_t **deluxdata, int size)
 {
-    light_mutex.lock();
-
     *lightdata = *colordata = *deluxdata = nullptr;
 
     if (!filebase.empty()) {
@@ -598,8 +626,6 @@ void GetFileSpace(uint8_t **lightdata, uint8_t **colordata, uint8_t **deluxdata,
         lux_file_p += 3 * size;
     }
 
-    light_mutex.unlock();
-
     if (file_p > file_end)
         FError("overrun");
 
@@ -700,46 +726,92 @@ static void CacheTextures(const mbsp_t &bsp)
     }
 }
 
+static void ClearFaceLightmapInfo(mbsp_t *bsp, size_t i)
+{
+    auto facesup = faces_sup.empty() ? nullptr : &faces_sup[i];
+    auto facesup_decoupled = facesup_decoupled_global.empty() ? nullptr : &facesup_decoupled_global[i];
+    auto face = &bsp->dfaces[i];
+
+    /* One extra lightmap is allocated to simplify handling overflow */
+    if (!light_options.litonly.value()) {
+        // if litonly is set we need to preserve the existing lightofs
+
+        /* some surfaces don't need lightmaps */
+        if (facesup) {
+            facesup->lightofs = -1;
+            for (size_t i = 0; i < MAXLIGHTMAPSSUP; i++) {
+                facesup->styles[i] = INVALID_LIGHTSTYLE;
+            }
+        } else {
+            face->lightofs = -1;
+            for (size_t i = 0; i < MAXLIGHTMAPS; i++) {
+                face->styles[i] = INVALID_LIGHTSTYLE_OLD;
+            }
+
+            if (facesup_decoupled) {
+                facesup_decoupled->offset = -1;
+            }
+        }
+    }
+}
+
+static std::unique_ptr<lightsurf_t> CreateFaceLightmapSurface(const mbsp_t *bsp, size_t i)
+{
+    auto facesup = faces_sup.empty() ? nullptr : &faces_sup[i];
+    auto facesup_decoupled = facesup_decoupled_global.empty() ? nullptr : &facesup_decoupled_global[i];
+
+    return CreateLightmapSurface(bsp, &bsp->dfaces[i], facesup, facesup_decoupled, light_options);
+}
+
 static void CreateLightmapSurfaces(mbsp_t *bsp)
 {
     light_surfaces.resize(bsp->dfaces.size());
     logging::funcheader();
     logging::parallel_for(static_cast<size_t>(0), bsp->dfaces.size(), [&bsp](size_t i) {
-        auto facesup = faces_sup.empty() ? nullptr : &faces_sup[i];
-        auto facesup_decoupled = facesup_decoupled_global.empty() ? nullptr : &facesup_decoupled_global[i];
-        auto face = &bsp->dfaces[i];
-
-        /* One extra lightmap is allocated to simplify handling overflow */
-        if (!light_options.litonly.value()) {
-            // if litonly is set we need to preserve the existing lightofs
-
-            /* some surfaces don't need lightmaps */
-            if (facesup) {
-                facesup->lightofs = -1;
-                for (size_t i = 0; i < MAXLIGHTMAPSSUP; i++) {
-                    facesup->styles[i] = INVALID_LIGHTSTYLE;
-                }
-            } else {
-                face->lightofs = -1;
-                for (size_t i = 0; i < MAXLIGHTMAPS; i++) {
-                    face->styles[i] = INVALID_LIGHTSTYLE_OLD;
-                }
+        ClearFaceLightmapInfo(bsp, i);
+        light_surfaces[i] = CreateFaceLightmapSurface(bsp, i);
+    });
+}
 
-                if (facesup_decoupled) {
-                    facesup_decoupled->offset = -1;
-                }
-            }
-        }
+/*
+ * runs body(i) for i in [0, count); with a progress bar unless lighting in tiles,
+ * where one per tile would flood the log
+ */
+template<typename Body>
+static void LightSurfaces_ParallelFor(size_t count, bool progress, const Body &body)
+{
+    if (progress) {
+        logging::parallel_for(static_cast<size_t>(0), count, body);
+    } else {
+        tbb::parallel_for(static_cast<size_t>(0), count, body);
+    }
+}
 
-        light_surfaces[i] = CreateLightmapSurface(bsp, face, facesup, facesup_decoupled, light_options);
+/*
+ * runs fn(lightsurf) for the surfaces of lightmapped faces
+ */
+template<typename F>
+static void ForEachLightmappedSurface(
+    const mbsp_t &bsp, std::vector<std::unique_ptr<lightsurf_t>> &surfaces, bool progress, const F &fn)
+{
+    LightSurfaces_ParallelFor(surfaces.size(), progress, [&](size_t i) {
+        if (surfaces[i] && !surfaces[i]->cached && Face_IsLightmapped(&bsp, surfaces[i]->face)) {
+#if defined(HAVE_EMBREE) && defined(__SSE2__)
+            _MM_SET_FLUSH_ZERO_MODE(_MM_FLUSH_ZERO_ON);
+#endif
+
+            fn(*surfaces[i]);
+        }
     });
 }
 
-static void SaveLightmapSurfaces(mbsp_t *bsp)
+static void SaveLightmapSurfaces(
+    mbsp_t *bsp, size_t first_face, std::vector<std::unique_ptr<lightsurf_t>> &surfaces, bool progress)
 {
-    logging::funcheader();
-    logging::parallel_for(static_cast<size_t>(0), bsp->dfaces.size(), [&bsp](size_t i) {
-        auto &surf = light_surfaces[i];
+    std::vector<std::vector<lightmap_save_t>> saves(surfaces.size());
+
+    LightSurfaces_ParallelFor(surfaces.size(), progress, [&](size_t k) {
+        auto &surf = surfaces[k];
 
         if (!surf || surf->samples.empty()) {
             return;
@@ -747,28 +819,46 @@ static void SaveLightmapSurfaces(mbsp_t *bsp)
 
         FinishLightmapSurface(bsp, surf.get());
 
+        const size_t i = first_face + k;
         auto f = &bsp->dfaces[i];
         const modelinfo_t *face_modelinfo = ModelInfoForFace(bsp, i);
-
+        auto &face_saves = saves[k];
         if (!facesup_decoupled_global.empty()) {
-            SaveLightmapSurface(
-                bsp, f, nullptr, &facesup_decoupled_global[i], surf.get(), surf->extents, surf->extents);
+            face_saves.push_back(PlanLightmapSurface(
+                bsp, f, nullptr, &facesup_decoupled_global[i], surf.get(), surf->extents, surf->extents));
         } else if (faces_sup.empty()) {
-            SaveLightmapSurface(bsp, f, nullptr, nullptr, surf.get(), surf->extents, surf->extents);
+            face_saves.push_back(
+                PlanLightmapSurface(bsp, f, nullptr, nullptr, surf.get(), surf->extents, surf->extents));
         } else if (light_options.novanilla.value() || faces_sup[i].lmscale == face_modelinfo->lightmapscale) {
             if (faces_sup[i].lmscale == face_modelinfo->lightmapscale) {
                 f->lightofs = faces_sup[i].lightofs;
             } else {
                 f->lightofs = -1;
             }
-            SaveLightmapSurface(bsp, f, &faces_sup[i], nullptr, surf.get(), surf->extents, surf->extents);
+            face_saves.push_back(
+                PlanLightmapSurface(bsp, f, &faces_sup[i], nullptr, surf.get(), surf->extents, surf->extents));
             for (int j = 0; j < MAXLIGHTMAPS; j++) {
                 f->styles[j] =
                     faces_sup[i].styles[j] == INVALID_LIGHTSTYLE ? INVALID_LIGHTSTYLE_OLD : faces_sup[i].styles[j];
             }
         } else {
-            SaveLightmapSurface(bsp, f, nullptr, nullptr, surf.get(), surf->extents, surf->vanilla_extents);
-            SaveLightmapSurface(bsp, f, &faces_sup[i], nullptr, surf.get(), surf->extents, surf->extents);
+            face_saves.push_back(
+                PlanLightmapSurface(bsp, f, nullptr, nullptr, surf.get(), surf->extents, surf->vanilla_extents));
+            face_saves.push_back(
+                PlanLightmapSurface(bsp, f, &faces_sup[i], nullptr, surf.get(), surf->extents, surf->extents));
+        }
+    });
+
+    // hand out file space in face order; this is the only serial part
+    for (auto &face_saves : saves) {
+        for (auto &save : face_saves) {
+            AllocateLightmapSurface(bsp, save);
+        }
+    }
+
+    LightSurfaces_ParallelFor(surfaces.size(), progress, [&](size_t k) {
+        for (const auto &save : saves[k]) {
+            WriteLightmapSurface(bsp, save);
         }
     });
 }
@@ -864,6 +954,248 @@ static constexpr size_t MAX_MAP_LIGHTING = 0x8000000;
  *  LightWorld
  * =============
  */
+static void DirectLightSurfaces(const mbsp_t &bsp, std::vector<std::unique_ptr<lightsurf_t>> &surfaces, bool progress)
+{
+    if (light_options.wavefront.value()) {
+        for (int pass = 0; pass < DirectLightPasses(); pass++) {
+            ForEachLightmappedSurface(bsp, surfaces, progress,
+                [&bsp, pass](lightsurf_t &surf) { QueueDirectLightFace(&bsp, surf, light_options, pass); });
+
+            FlushDirectLightWavefronts();
+
+            ForEachLightmappedSurface(bsp, surfaces, progress,
+                [&bsp, pass](lightsurf_t &surf) { FinishDirectLightFace(&bsp, surf, light_options, pass); });
+        }
+    } else {
+        ForEachLightmappedSurface(bsp, surfaces, progress,
+            [&bsp](lightsurf_t &surf) { DirectLightFace(&bsp, surf, light_options); });
+    }
+}
+
+/*
+ * -lightcache: reuses the lightmaps of the faces no changed light reaches
+ */
+static void LookupLightCache(const mbsp_t &bsp, bool bouncerequired)
+{
+    logging::funcheader();
+    logging::parallel_for(static_cast<size_t>(0), light_surfaces.size(), [&bsp](size_t i) {
+        if (light_surfaces[i] && Face_IsLightmapped(&bsp, light_surfaces[i]->face)) {
+            LightCache_Lookup(&bsp, *light_surfaces[i]);
+        }
+    });
+
+    // bounce light carries a change to every face, so reuse all or nothing
+    if (bouncerequired && !light_options.nolighting.value() && total_lightcache_hits != total_lightcache_faces) {
+        for (auto &surf : light_surfaces) {
+            if (surf) {
+                LightCache_Release(&bsp, *surf);
+            }
+        }
+    }
+}
+
+/*
+ * -tilesize: the surface an emissive face keeps for the whole run, holding
+ * its surface light and, once its bounce tile is lit, its size and per-style
+ * bounce_color for MakeBounceLights. the surface lights only need the face,
+ * so no samples are made for it; same faces as CreateLightmapSurface.
+ */
+static std::unique_ptr<lightsurf_t> CreateEmitterSurface(const mbsp_t *bsp, size_t i)
+{
+    const mface_t *face = &bsp->dfaces[i];
+    const modelinfo_t *modelinfo = ModelInfoForFace(bsp, i);
+
+    if (modelinfo == nullptr || face->numedges < 3 || !Face_IsEmissive(bsp, face) ||
+        std::isnan(TexSpaceToWorld(bsp, face).at(0, 0))) {
+        return nullptr;
+    }
+
+    auto surf = std::make_unique<lightsurf_t>();
+    surf->cfg = &light_options;
+    surf->modelinfo = modelinfo;
+    surf->bsp = bsp;
+    surf->face = face;
+    return surf;
+}
+
+/*
+ * -tilesize: keeps what MakeBounceLights needs of a lit bounce tile surface
+ * (its size and per-style bounce_color) in the face's emitter surface
+ */
+static void KeepBounceColor(lightsurf_t &surf, lightsurf_t &emitter)
+{
+    emitter.width = surf.width;
+    emitter.height = surf.height;
+
+    for (auto &lightmap : surf.lightmapsByStyle) {
+        lightmap.samples = {};
+    }
+
+    emitter.lightmapsByStyle = std::move(surf.lightmapsByStyle);
+}
+
+/*
+ * -tilesize: lights the faces in tiles of `tilesize`, writing each tile's
+ * lightmaps as soon as it is done, so only one tile of luxel samples is
+ * in memory at a time.
+ *
+ * the surface lights are made from the emissive faces alone (see
+ * CreateEmitterSurface). bounce lights come from the bounce_color of every
+ * emissive face, so with -bounce each level first relights the emissive
+ * faces in tiles and keeps only their bounce_color; the final pass then
+ * lights every face with the surface lights of all levels. the output
+ * matches the untiled pipeline.
+ */
+static void LightWorld_Tiled(mbsp_t *bsp, bool bouncerequired)
+{
+    const size_t tilesize = light_options.tilesize.value();
+    const size_t numfaces = bsp->dfaces.size();
+    const bool lightcuts = light_options.lightcuts.value() > 0;
+
+    light_surfaces.resize(numfaces);
+
+    // surface lights and bounce lights live in light_surfaces, so the
+    // emissive faces keep a surface (without samples) for the whole run
+    logging::funcheader();
+    logging::parallel_for(static_cast<size_t>(0), numfaces, [bsp](size_t i) {
+        ClearFaceLightmapInfo(bsp, i);
+        light_surfaces[i] = CreateEmitterSurface(bsp, i);
+    });
+
+    MakeRadiositySurfaceLights(light_options, bsp);
+    UpdateEmissiveLightSurfacesList();
+
+    if (lightcuts) {
+        BuildLightTrees(std::nullopt);
+    }
+
+    std::vector<std::unique_ptr<lightsurf_t>> tile;
+    size_t bounce_levels = 0;
+
+    if (bouncerequired && !light_options.nolighting.value()) {
+        std::vector<size_t> bouncefaces;
+
+        for (size_t i = 0; i < numfaces; i++) {
+            if (light_surfaces[i] && Face_ShouldBounce(bsp, &bsp->dfaces[i])) {
+                bouncefaces.push_back(i);
+            }
+        }
+
+        for (size_t i = 0; i < light_options.bounce.value(); i++) {
+            // relight the emissive faces to get the bounce_color of level i
+            if (i == 0) {
+                logging::header("Direct Lighting (bounce faces)");
+            } else {
+                logging::header(fmt::format("Indirect Lighting (bounce faces, pass {0})", i - 1).c_str());
+            }
+            logging::percent_clock clock((bouncefaces.size() + tilesize - 1) / tilesize);
+
+            for (size_t start = 0; start < bouncefaces.size(); start += tilesize) {
+                const size_t count = std::min(tilesize, bouncefaces.size() - start);
+
+                tile.clear();
+                tile.resize(count);
+
+                tbb::parallel_for(static_cast<size_t>(0), count, [&](size_t k) {
+                    tile[k] = CreateFaceLightmapSurface(bsp, bouncefaces[start + k]);
+
+                    if (tile[k] && i > 0 && Face_IsLightmapped(bsp, tile[k]->face)) {
+                        DirtLightFace(bsp, *tile[k]);
+                    }
+                });
+
+                if (i == 0) {
+                    DirectLightSurfaces(*bsp, tile, false);
+                } else {
+                    ForEachLightmappedSurface(*bsp, tile, false,
+                        [bsp, i](lightsurf_t &surf) { IndirectLightFace(bsp, surf, light_options, i - 1); });
+                }
+
+                for (size_t k = 0; k < count; k++) {
+                    if (tile[k]) {
+                        KeepBounceColor(*tile[k], *light_surfaces[bouncefaces[start + k]]);
+                    }
+                }
+
+                clock();
+            }
+
+            clock.print();
+
+            if (!MakeBounceLights(light_options, bsp, i)) {
+                logging::header("No bounces; indirect lighting halted");
+                break;
+            }
+            UpdateEmissiveLightSurfacesList();
+
+            bounce_levels = i + 1;
+
+            if (lightcuts) {
+                BuildLightTrees(i);
+            }
+        }
+    }
+
+    // adding bounce lights moves the surface light styles the earlier
+    // trees point at
+    if (lightcuts && bounce_levels) {
+        BuildLightTrees(std::nullopt);
+
+        for (size_t i = 0; i < bounce_levels; i++) {
+            BuildLightTrees(i);
+        }
+    }
+
+    logging::header("Lighting and Saving Tiles");
+    logging::percent_clock clock((numfaces + tilesize - 1) / tilesize);
+
+    for (size_t start = 0; start < numfaces; start += tilesize) {
+        const size_t count = std::min(tilesize, numfaces - start);
+
+        tile.clear();
+        tile.resize(count);
+
+        tbb::parallel_for(static_cast<size_t>(0), count,
+            [&](size_t k) { tile[k] = CreateFaceLightmapSurface(bsp, start + k); });
+
+        DirectLightSurfaces(*bsp, tile, false);
+
+        for (size_t i = 0; i < bounce_levels; i++) {
+            ForEachLightmappedSurface(*bsp, tile, false,
+                [bsp, i](lightsurf_t &surf) { IndirectLightFace(bsp, surf, light_options, i); });
+        }
+
+        if (!light_options.nolighting.value()) {
+            // PostProcessLightFace checks for a vpl to apply surface light
+            // minlight; lend it the emitting surface's for the tile
+            for (size_t k = 0; k < count; k++) {
+                if (tile[k] && light_surfaces[start + k]) {
+                    tile[k]->vpl = std::move(light_surfaces[start + k]->vpl);
+                }
+            }
+
+            ForEachLightmappedSurface(*bsp, tile, false,
+                [bsp](lightsurf_t &surf) { PostProcessLightFace(bsp, surf, light_options); });
+
+            for (size_t k = 0; k < count; k++) {
+                if (tile[k] && light_surfaces[start + k]) {
+                    light_surfaces[start + k]->vpl = std::move(tile[k]->vpl);
+                }
+            }
+        }
+
+        SaveLightmapSurfaces(bsp, start, tile, false);
+
+        clock();
+    }
+
+    clock.print();
+
+    tile.clear();
+
+    ResetLightTree();
+}
+
 static void LightWorld(bspdata_t *bspdata, bool forcedscale)
 {
     logging::funcheader();
@@ -938,67 +1270,74 @@ static void LightWorld(bspdata_t *bspdata, bool forcedscale)
 
     CalculateVertexNormals(&bsp);
 
-    // create lightmap surfaces
-    CreateLightmapSurfaces(&bsp);
-
     const bool bouncerequired =
         light_options.bounce.value() &&
-        (light_options.debugmode == debugmodes::none || light_options.debugmode == debugmodes::bounce ||
+        (light_options.DebugModeLights() || light_options.debugmode == debugmodes::bounce ||
             light_options.debugmode == debugmodes::bouncelights); // mxd
 
-    MakeRadiositySurfaceLights(light_options, &bsp);
-    UpdateEmissiveLightSurfacesList();
+    if (light_options.tilesize.value() > 0) {
+        LightWorld_Tiled(&bsp, bouncerequired);
+    } else {
+        // create lightmap surfaces
+        CreateLightmapSurfaces(&bsp);
 
-    logging::header("Direct Lighting"); // mxd
-    logging::parallel_for(static_cast<size_t>(0), bsp.dfaces.size(), [&bsp](size_t i) {
-        if (light_surfaces[i] && Face_IsLightmapped(&bsp, &bsp.dfaces[i])) {
-#if defined(HAVE_EMBREE) && defined(__SSE2__)
-            _MM_SET_FLUSH_ZERO_MODE(_MM_FLUSH_ZERO_ON);
-#endif
+        if (light_options.lightcache.value()) {
+            LookupLightCache(bsp, bouncerequired);
+        }
 
-            DirectLightFace(&bsp, *light_surfaces[i].get(), light_options);
+        MakeRadiositySurfaceLights(light_options, &bsp);
+        UpdateEmissiveLightSurfacesList();
+
+        if (light_options.lightcuts.value() > 0) {
+            BuildLightTrees(std::nullopt);
         }
-    });
 
-    if (bouncerequired && !light_options.nolighting.value()) {
+        logging::header("Direct Lighting"); // mxd
+        DirectLightSurfaces(bsp, light_surfaces, true);
 
-        for (size_t i = 0; i < light_options.bounce.value(); i++) {
+        if (bouncerequired && !light_options.nolighting.value()) {
 
-            if (!MakeBounceLights(light_options, &bsp, i)) {
-                logging::header("No bounces; indirect lighting halted");
-                break;
+            for (size_t i = 0; i < light_options.bounce.value(); i++) {
+
+                if (!MakeBounceLights(light_options, &bsp, i)) {
+                    logging::header("No bounces; indirect lighting halted");
+                    break;
+                }
+                UpdateEmissiveLightSurfacesList();
+
+                if (light_options.lightcuts.value() > 0) {
+                    BuildLightTrees(i);
+                }
+
+                logging::header(fmt::format("Indirect Lighting (pass {0})", i).c_str()); // mxd
+                ForEachLightmappedSurface(bsp, light_surfaces, true,
+                    [&bsp, i](lightsurf_t &surf) { IndirectLightFace(&bsp, surf, light_options, i); });
             }
-            UpdateEmissiveLightSurfacesList();
+        }
 
-            logging::header(fmt::format("Indirect Lighting (pass {0})", i).c_str()); // mxd
+        ResetLightTree();
 
-            logging::parallel_for(static_cast<size_t>(0), bsp.dfaces.size(), [i, &bsp](size_t f) {
-                if (light_surfaces[f] && Face_IsLightmapped(&bsp, &bsp.dfaces[f])) {
-    #if defined(HAVE_EMBREE) && defined(__SSE2__)
-                    _MM_SET_FLUSH_ZERO_MODE(_MM_FLUSH_ZERO_ON);
-    #endif
+        if (!light_options.nolighting.value()) {
+            logging::header("Post-Processing"); // mxd
+            ForEachLightmappedSurface(bsp, light_surfaces, true,
+                [&bsp](lightsurf_t &surf) { PostProcessLightFace(&bsp, surf, light_options); });
+        }
 
-                    IndirectLightFace(&bsp, *light_surfaces[f].get(), light_options, i);
-                }
-            });
+        if (light_options.lightcache.value()) {
+            LightCache_Write(&bsp, light_surfaces);
         }
-    }
 
-    if (!light_options.nolighting.value()) {
-        logging::header("Post-Processing"); // mxd
-        logging::parallel_for(static_cast<size_t>(0), bsp.dfaces.size(), [&bsp](size_t i) {
-            if (light_surfaces[i] && Face_IsLightmapped(&bsp, &bsp.dfaces[i])) {
-#if defined(HAVE_EMBREE) && defined(__SSE2__)
-                _MM_SET_FLUSH_ZERO_MODE(_MM_FLUSH_ZERO_ON);
-#endif
+        if (light_options.debugmode == debugmodes::cost) {
+            const double max_seconds = Profile_MaxFaceSeconds();
+            ForEachLightmappedSurface(bsp, light_surfaces, false, [&bsp, max_seconds](lightsurf_t &surf) {
+                const double seconds = Profile_FaceSeconds(Face_GetNum(&bsp, surf.face));
+                CostDebugLightFace(&bsp, surf, max_seconds > 0 ? seconds / max_seconds : 0.0);
+            });
+        }
 
-                PostProcessLightFace(&bsp, *light_surfaces[i].get(), light_options);
-            }
-        });
+        SaveLightmapSurfaces(&bsp, 0, light_surfaces, true);
     }
 
-    SaveLightmapSurfaces(&bsp);
-
     logging::print("Lighting Completed.\n\n");
 
     // Transfer greyscale lightmap (or color lightmap for Q2/HL) to the bsp and update lightdatasize
@@ -1509,6 +1848,10 @@ void light_reset()
     ResetLtFace();
     ResetPhong();
     ResetSurflight();
+    ResetLightIndex();
+    ResetLightCache();
+    ResetProfile();
+    ResetLightTree();
     ResetEmbree();
 
     light_options.reset();
@@ -1668,6 +2011,27 @@ int light_main(int argc, const char **argv)
     }
 
     SetupLights(light_options, &bsp);
+    SetupLightIndex(&bsp);
+
+    if (light_options.lightcache.value() && !light_options.onlyents.value()) {
+        if (light_options.tilesize.value() > 0) {
+            logging::print("WARNING: -lightcache is ignored with -tilesize\n");
+            light_options.lightcache.set_value(false, settings::source::COMMANDLINE);
+        } else {
+            LightCache_Load(&bsp, fs::path(source).replace_extension("lightcache"));
+        }
+    }
+
+    if (light_options.debugmode == debugmodes::cost && light_options.tilesize.value() > 0) {
+        // the faces are colored relative to the most expensive one, which isn't known until all are lit
+        logging::print("WARNING: -tilesize is ignored with -debugcost\n");
+        light_options.tilesize.set_value(0, settings::source::COMMANDLINE);
+    }
+
+    if ((light_options.profile.value() || light_options.debugmode == debugmodes::cost) &&
+        !light_options.onlyents.value()) {
+        Profile_Setup(&bsp);
+    }
 
     // PrintLights();
 
@@ -1680,6 +2044,10 @@ int light_main(int argc, const char **argv)
 
         LightWorld(&bspdata, light_options.lightmap_scale.is_changed());
 
+        if (light_options.profile.value()) {
+            Profile_Write(&bsp, fs::path(source).replace_extension("profile.json"));
+        }
+
         LightGrid(&bspdata);
 
         ClearLightmapSurfaces(&std::get<mbsp_t>(bspdata.bsp));
@@ -1759,7 +2127,28 @@ int light_main(int argc, const char **argv)
     logging::print("{} bounce lights tested, {} hits per sample point\n",
         static_cast<double>(total_bounce_rays) / static_cast<double>(total_samplepoints),
         static_cast<double>(total_bounce_ray_hits) / static_cast<double>(total_samplepoints));
+    if (total_lightcuts) {
+        logging::print("{} nodes per light cut\n",
+            static_cast<double>(total_lightcut_nodes) / static_cast<double>(total_lightcuts));
+    }
+    if (total_adaptive_luxels) {
+        logging::print("{} of {} luxels supersampled by -adaptive\n", static_cast<uint64_t>(total_adaptive_refined),
+            static_cast<uint64_t>(total_adaptive_luxels));
+    }
+    if (total_lightcache_faces) {
+        logging::print("{} of {} faces reused from the light cache\n", static_cast<uint64_t>(total_lightcache_hits),
+            static_cast<uint64_t>(total_lightcache_faces));
+    }
+    if (total_lightindex_faces) {
+        logging::print("{} of {} lights culled per face by the light index\n",
+            static_cast<double>(total_lightindex_culled) / static_cast<double>(total_lightindex_faces),
+            static_cast<double>(total_lightindex_lights) / static_cast<double>(total_lightindex_faces));
+    }
+    if (light_options.verifylightindex.value()) {
+        logging::print("{} lights missed by the light index\n", static_cast<uint64_t>(total_lightindex_missed));
+    }
     logging::print("{} empty lightmaps\n", static_cast<int>(fully_transparent_lightmaps));
+    logging::print("{:.1f} MiB peak memory usage\n", I_PeakMemoryUsage() / (1024.0 * 1024.0));
     logging::close();
 
     return 0;
@@ -0,0 +1,431 @@
+/*  Copyright (C) 1996-1997  Id Software, Inc.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+
+    See file, 'COPYING', for details.
+*/
+
+#include <light/lightcache.hh>
+
+#include <light/light.hh>
+#include <light/entities.hh>
+#include <light/ltface.hh>
+
+#include <common/bsputils.hh>
+#include <common/cmdlib.hh>
+#include <common/log.hh>
+
+#include <algorithm>
+#include <array>
+#include <fstream>
+#include <iterator>
+#include <sstream>
+#include <string_view>
+
+std::atomic<uint64_t> total_lightcache_faces, total_lightcache_hits;
+
+namespace
+{
+constexpr std::array<char, 4> LIGHTCACHE_IDENT{'L', 'C', 'H', 'E'};
+constexpr uint32_t LIGHTCACHE_VERSION = 2;
+
+struct lightcache_face_t
+{
+    bool valid = false;
+    uint32_t numsamples = 0;
+    // sorted hashes of the lights that could reach the face
+    std::vector<uint64_t> lights;
+    lightmapdict_t lightmaps;
+    // samples.occluded after post-processing (LightFace_AutoMin clears it);
+    // once the face is reused, the one CalcPoints made, see LightCache_Release
+    std::vector<uint8_t> occluded;
+};
+
+struct lightcache_t
+{
+    fs::path path;
+
+    // hash of everything but the light entities
+    uint64_t world_hash = 0;
+
+    // hash of each light, in GetLights() order
+    std::vector<uint64_t> light_hashes;
+
+    // faces of the previous run, by face number
+    std::vector<lightcache_face_t> faces;
+
+    // lights that can reach each face in this run, by face number
+    std::vector<std::vector<uint64_t>> face_lights;
+};
+
+lightcache_t lightcache;
+} // namespace
+
+void ResetLightCache()
+{
+    lightcache = {};
+
+    total_lightcache_faces = 0;
+    total_lightcache_hits = 0;
+}
+
+// FNV-1a
+static uint64_t LightCache_Hash(const std::string &data)
+{
+    uint64_t hash = 0xcbf29ce484222325ull;
+
+    for (unsigned char c : data) {
+        hash ^= c;
+        hash *= 0x100000001b3ull;
+    }
+
+    return hash;
+}
+
+static void LightCache_HashString(std::ostream &s, const std::string &str)
+{
+    s <= static_cast<uint32_t>(str.size());
+    s.write(str.data(), str.size());
+}
+
+/*
+ * settings that only change how the lightmaps are made or what is logged,
+ * not the lightmaps themselves
+ */
+static bool LightCache_SettingAffectsOutput(const settings::setting_base *setting)
+{
+    if (setting->group() == &settings::logging_group) {
+        return false;
+    }
+
+    static constexpr std::array<std::string_view, 7> no_output{
+        "threads", "lowpriority", "tilesize", "lightcache", "profile", "wavefront", "verifylightindex"};
+
+    return std::find(no_output.begin(), no_output.end(), setting->primary_name()) == no_output.end();
+}
+
+/*
+ * settings are kept in a set of pointers, so sort them by name to get
+ * the same order every run
+ */
+static void LightCache_HashSettings(std::ostream &s, const settings::setting_container &container)
+{
+    std::vector<const settings::setting_base *> sorted;
+
+    std::copy_if(container.begin(), container.end(), std::back_inserter(sorted), LightCache_SettingAffectsOutput);
+
+    std::sort(sorted.begin(), sorted.end(),
+        [](const settings::setting_base *a, const settings::setting_base *b) {
+            return a->primary_name() < b->primary_name();
+        });
+
+    for (const settings::setting_base *setting : sorted) {
+        LightCache_HashString(s, setting->primary_name());
+        LightCache_HashString(s, setting->string_value());
+    }
+}
+
+static void LightCache_HashEntDict(std::ostream &s, const entdict_t &entdict)
+{
+    s <= static_cast<uint32_t>(std::distance(entdict.begin(), entdict.end()));
+
+    for (const auto &epair : entdict) {
+        LightCache_HashString(s, epair.first);
+        LightCache_HashString(s, epair.second);
+    }
+}
+
+/*
+ * everything the BSP contributes to lighting, minus the lighting itself
+ */
+static void LightCache_HashGeometry(std::ostream &s, const mbsp_t *bsp)
+{
+    for (const auto &model : bsp->dmodels) {
+        s <= model;
+    }
+
+    s <= static_cast<uint32_t>(bsp->dvis.bits.size());
+    s.write(reinterpret_cast<const char *>(bsp->dvis.bits.data()), bsp->dvis.bits.size());
+
+    bsp->dtex.stream_write(s);
+
+    for (const auto &leaf : bsp->dleafs) {
+        s <= std::tie(leaf.contents, leaf.cluster, leaf.mins, leaf.maxs, leaf.firstmarksurface, leaf.nummarksurfaces);
+    }
+    for (const auto &plane : bsp->dplanes) {
+        s <= plane;
+    }
+    for (const auto &vert : bsp->dvertexes) {
+        s <= vert;
+    }
+    for (const auto &node : bsp->dnodes) {
+        s <= node;
+    }
+    for (const auto &texinfo : bsp->texinfo) {
+        for (size_t i = 0; i < 2; i++) {
+            for (size_t j = 0; j < 4; j++) {
+                s <= texinfo.vecs.at(i, j);
+            }
+        }
+        s <= std::tie(texinfo.flags.native, texinfo.miptex, texinfo.value, texinfo.texture, texinfo.nexttexinfo);
+    }
+    // styles and lightofs are the output
+    for (const auto &face : bsp->dfaces) {
+        s <= std::tie(face.planenum, face.side, face.firstedge, face.numedges, face.texinfo, face.flags);
+    }
+    for (const auto &edge : bsp->dedges) {
+        s <= edge;
+    }
+    for (const auto &leafface : bsp->dleaffaces) {
+        s <= leafface;
+    }
+    for (const auto &surfedge : bsp->dsurfedges) {
+        s <= surfedge;
+    }
+}
+
+static uint64_t LightCache_HashWorld(const mbsp_t *bsp)
+{
+    std::ostringstream s(std::ios_base::out | std::ios_base::binary);
+    s << endianness<std::endian::little>;
+
+    LightCache_HashGeometry(s, bsp);
+    LightCache_HashSettings(s, light_options);
+
+    // worldspawn, brush entities and suns; the point lights are hashed
+    // one by one so only the faces they reach are relit
+    for (const auto &entdict : GetEntdicts()) {
+        if (entdict.get("classname").find("light") == 0 && !entdict.get_int("_sun")) {
+            continue;
+        }
+        LightCache_HashEntDict(s, entdict);
+    }
+    // surface light templates (which include the radlights) light whole
+    // textures, and their all_lights copies are zeroed so no face's reach
+    // set picks them up
+    for (const auto &surflight : GetSurfaceLightTemplates()) {
+        LightCache_HashEntDict(s, *surflight->epairs);
+    }
+
+    return LightCache_Hash(s.str());
+}
+
+static uint64_t LightCache_HashLight(const light_t &entity)
+{
+    std::ostringstream s(std::ios_base::out | std::ios_base::binary);
+    s << endianness<std::endian::little>;
+
+    // the parsed keys, plus what SetupLights derives from other entities
+    LightCache_HashSettings(s, entity);
+    s <= entity.origin.value();
+    s <= entity.spotvec;
+    s <= static_cast<uint8_t>(entity.spotlight);
+
+    return LightCache_Hash(s.str());
+}
+
+static bool LightCache_Read(const fs::path &path, size_t numfaces)
+{
+    std::ifstream f(path, std::ios_base::in | std::ios_base::binary);
+
+    if (!f) {
+        return false;
+    }
+
+    f >> endianness<std::endian::little>;
+
+    std::array<char, 4> ident;
+    uint32_t version;
+    uint64_t world_hash;
+    uint32_t cached_numfaces;
+
+    f >= std::tie(ident, version, world_hash, cached_numfaces);
+
+    if (!f || ident != LIGHTCACHE_IDENT || version != LIGHTCACHE_VERSION) {
+        logging::print("WARNING: {} is not a light cache, ignoring\n", path);
+        return false;
+    }
+
+    if (world_hash != lightcache.world_hash || cached_numfaces != numfaces) {
+        logging::print("Light cache {} is out of date (geometry, settings or entities changed)\n", path);
+        return false;
+    }
+
+    lightcache.faces.resize(numfaces);
+
+    for (auto &face : lightcache.faces) {
+        uint8_t present;
+        f >= present;
+
+        if (!present) {
+            continue;
+        }
+
+        uint32_t numlights, numstyles;
+
+        f >= std::tie(face.numsamples, numlights);
+        face.lights.resize(numlights);
+        for (auto &light : face.lights) {
+            f >= light;
+        }
+
+        face.occluded.resize(face.numsamples);
+        f.read(reinterpret_cast<char *>(face.occluded.data()), face.occluded.size());
+
+        f >= numstyles;
+        face.lightmaps.resize(numstyles);
+        for (auto &lightmap : face.lightmaps) {
+            f >= lightmap.style;
+            lightmap.samples.resize(face.numsamples);
+            for (auto &sample : lightmap.samples) {
+                f >= std::tie(sample.color, sample.direction);
+            }
+        }
+
+        if (!f) {
+            logging::print("WARNING: {} is truncated, ignoring\n", path);
+            lightcache.faces.clear();
+            return false;
+        }
+
+        face.valid = true;
+    }
+
+    return true;
+}
+
+void LightCache_Load(const mbsp_t *bsp, const fs::path &path)
+{
+    logging::funcheader();
+
+    ResetLightCache();
+
+    lightcache.path = path;
+    lightcache.world_hash = LightCache_HashWorld(bsp);
+
+    const auto &all_lights = GetLights();
+    lightcache.light_hashes.resize(all_lights.size());
+
+    for (size_t i = 0; i < all_lights.size(); i++) {
+        lightcache.light_hashes[i] = LightCache_HashLight(*all_lights[i]);
+    }
+
+    lightcache.face_lights.resize(bsp->dfaces.size());
+
+    if (LightCache_Read(path, bsp->dfaces.size())) {
+        logging::print("Loaded light cache {}\n", path);
+    }
+}
+
+void LightCache_Lookup(const mbsp_t *bsp, lightsurf_t &lightsurf)
+{
+    const auto &all_lights = GetLights();
+    const int facenum = Face_GetNum(bsp, lightsurf.face);
+    auto &lights = lightcache.face_lights[facenum];
+
+    lights.clear();
+    for (size_t i = 0; i < all_lights.size(); i++) {
+        if (Light_CanReachSurface(all_lights[i].get(), &lightsurf)) {
+            lights.push_back(lightcache.light_hashes[i]);
+        }
+    }
+    std::sort(lights.begin(), lights.end());
+
+    total_lightcache_faces++;
+
+    if (lightcache.faces.empty()) {
+        return;
+    }
+
+    auto &cached = lightcache.faces[facenum];
+
+    if (!cached.valid || cached.numsamples != lightsurf.samples.size() || cached.lights != lights) {
+        return;
+    }
+
+    // the lightmaps are post-processed already, and so is the mask that
+    // WriteSingleLightmap reads; keep CalcPoints' in case of a release
+    lightsurf.lightmapsByStyle = std::move(cached.lightmaps);
+    std::swap(lightsurf.samples.occluded, cached.occluded);
+    lightsurf.cached = true;
+    cached.valid = false;
+
+    total_lightcache_hits++;
+}
+
+void LightCache_Release(const mbsp_t *bsp, lightsurf_t &lightsurf)
+{
+    if (!lightsurf.cached) {
+        return;
+    }
+
+    auto &cached = lightcache.faces[Face_GetNum(bsp, lightsurf.face)];
+
+    std::swap(lightsurf.samples.occluded, cached.occluded);
+    lightsurf.lightmapsByStyle.clear();
+    lightsurf.cached = false;
+
+    total_lightcache_hits--;
+}
+
+void LightCache_Write(const mbsp_t *bsp, const std::vector<std::unique_ptr<lightsurf_t>> &surfaces)
+{
+    logging::funcheader();
+
+    const fs::path &path = lightcache.path;
+    std::ofstream f(path, std::ios_base::out | std::ios_base::binary);
+
+    if (!f) {
+        logging::print("WARNING: couldn't write light cache {}\n", path);
+        return;
+    }
+
+    f << endianness<std::endian::little>;
+
+    f <= LIGHTCACHE_IDENT;
+    f <= LIGHTCACHE_VERSION;
+    f <= lightcache.world_hash;
+    f <= static_cast<uint32_t>(bsp->dfaces.size());
+
+    for (size_t i = 0; i < bsp->dfaces.size(); i++) {
+        const auto &surf = surfaces[i];
+
+        if (!surf || !Face_IsLightmapped(bsp, &bsp->dfaces[i])) {
+            f <= static_cast<uint8_t>(0);
+            continue;
+        }
+
+        f <= static_cast<uint8_t>(1);
+
+        const auto &lights = lightcache.face_lights[i];
+        f <= static_cast<uint32_t>(surf->samples.size());
+        f <= static_cast<uint32_t>(lights.size());
+        for (uint64_t light : lights) {
+            f <= light;
+        }
+
+        f.write(reinterpret_cast<const char *>(surf->samples.occluded.data()), surf->samples.occluded.size());
+
+        f <= static_cast<uint32_t>(surf->lightmapsByStyle.size());
+        for (const auto &lightmap : surf->lightmapsByStyle) {
+            f <= static_cast<int32_t>(lightmap.style);
+            for (size_t j = 0; j < surf->samples.size(); j++) {
+                f <= std::tie(lightmap.samples[j].color, lightmap.samples[j].direction);
+            }
+        }
+    }
+
+    logging::print("Wrote light cache {}\n", path);
+}
@@ -364,7 +364,11 @@ static std::vector<uint8_t> MakeOctreeLump(const mbsp_t &bsp, const lightgrid_ra
     return vec;
 }
 
-std::tuple<lightgrid_samples_t, bool> FixPointAndCalcLightgrid(const mbsp_t *bsp, qvec3d world_point)
+/*
+ * returns the point to light the grid sample at, and whether the sample
+ * is occluded (in solid, and couldn't be nudged out)
+ */
+static std::tuple<qvec3d, bool> LightGrid_FixPoint(const mbsp_t *bsp, qvec3d world_point)
 {
     bool occluded = Light_PointInWorld(bsp, world_point);
     if (occluded) {
@@ -376,14 +380,282 @@ std::tuple<lightgrid_samples_t, bool> FixPointAndCalcLightgrid(const mbsp_t *bsp
         }
     }
 
+    return {world_point, occluded};
+}
+
+std::tuple<lightgrid_samples_t, bool> FixPointAndCalcLightgrid(const mbsp_t *bsp, qvec3d world_point)
+{
+    auto [fixed_point, occluded] = LightGrid_FixPoint(bsp, world_point);
+
     lightgrid_samples_t samples;
 
     if (!occluded)
-        samples = CalcLightgridAtPoint(bsp, world_point);
+        samples = CalcLightgridAtPoint(bsp, fixed_point);
 
     return {samples, occluded};
 }
 
+// a grid point is occluded if it and its 2 unit nudges are in solid, and
+// Light_PointInSolid looks 0.1 units to either side of planes
+constexpr vec_t LIGHTGRID_SOLID_MARGIN = 2.5;
+
+// blocks are classified by leaf contents down to this many points per axis
+constexpr int LIGHTGRID_MIN_BLOCK = 2;
+
+// -lightgrid_threshold: spacing of the points that are always lit
+constexpr int LIGHTGRID_CELL = 4;
+
+/*
+ * returns true if every leaf the box touches is solid, as Light_PointInSolid_r
+ * decides it
+ */
+static bool LightGrid_BoxInSolid_r(const mbsp_t *bsp, int nodenum, const aabb3d &box)
+{
+    if (nodenum < 0) {
+        const mleaf_t *leaf = BSP_GetLeafFromNodeNum(bsp, nodenum);
+
+        if (bsp->loadversion->game->id == GAME_QUAKE_II) {
+            return leaf->contents & Q2_CONTENTS_SOLID;
+        }
+
+        return (leaf->contents == CONTENTS_SOLID || leaf->contents == CONTENTS_SKY);
+    }
+
+    const bsp2_dnode_t *node = &bsp->dnodes[nodenum];
+    const dplane_t &plane = bsp->dplanes[node->planenum];
+
+    const qvec3d half_size = box.size() * 0.5;
+    const vec_t dist = plane.distance_to(box.centroid());
+    const vec_t radius = std::abs(plane.normal[0] * half_size[0]) + std::abs(plane.normal[1] * half_size[1]) +
+                         std::abs(plane.normal[2] * half_size[2]);
+
+    if (dist - radius > 0)
+        return LightGrid_BoxInSolid_r(bsp, node->children[0], box);
+    if (dist + radius < 0)
+        return LightGrid_BoxInSolid_r(bsp, node->children[1], box);
+
+    return LightGrid_BoxInSolid_r(bsp, node->children[0], box) &&
+           LightGrid_BoxInSolid_r(bsp, node->children[1], box);
+}
+
+/*
+ * marks blocks of grid points that are entirely in solid as occluded, and
+ * collects the rest of the points in `test_points`
+ */
+static void LightGrid_ClassifyBlock(const mbsp_t &bsp, lightgrid_raw_data &data, const qvec3i &mins,
+    const qvec3i &size, std::vector<int> &test_points)
+{
+    const aabb3d box = aabb3d(data.grid_index_to_world(mins), data.grid_index_to_world(mins + size - qvec3i(1, 1, 1)))
+                           .grow(qvec3d(LIGHTGRID_SOLID_MARGIN, LIGHTGRID_SOLID_MARGIN, LIGHTGRID_SOLID_MARGIN));
+
+    const bool solid = LightGrid_BoxInSolid_r(&bsp, bsp.dmodels[0].headnode[0], box);
+
+    if (solid || (size[0] <= LIGHTGRID_MIN_BLOCK && size[1] <= LIGHTGRID_MIN_BLOCK && size[2] <= LIGHTGRID_MIN_BLOCK)) {
+        for (int z = mins[2]; z < (mins[2] + size[2]); ++z) {
+            for (int y = mins[1]; y < (mins[1] + size[1]); ++y) {
+                for (int x = mins[0]; x < (mins[0] + size[0]); ++x) {
+                    const int sample_index = data.get_grid_index(x, y, z);
+
+                    if (solid) {
+                        data.occlusion[sample_index] = true;
+                    } else {
+                        test_points.push_back(sample_index);
+                    }
+                }
+            }
+        }
+        return;
+    }
+
+    // split every axis that can be split
+    const qvec3i half = size / 2;
+
+    for (int i = 0; i < 8; i++) {
+        qvec3i child_mins{}, child_size{};
+
+        for (int axis = 0; axis < 3; axis++) {
+            const bool upper = i & (4 >> axis);
+
+            if (!half[axis]) {
+                if (upper) {
+                    child_size[axis] = 0;
+                    break;
+                }
+                child_mins[axis] = mins[axis];
+                child_size[axis] = size[axis];
+            } else if (upper) {
+                child_mins[axis] = mins[axis] + half[axis];
+                child_size[axis] = size[axis] - half[axis];
+            } else {
+                child_mins[axis] = mins[axis];
+                child_size[axis] = half[axis];
+            }
+        }
+
+        if (child_size[0] > 0 && child_size[1] > 0 && child_size[2] > 0) {
+            LightGrid_ClassifyBlock(bsp, data, child_mins, child_size, test_points);
+        }
+    }
+}
+
+/*
+ * returns true if the corner samples have the same styles, in the same order,
+ * and no color channel differs by more than threshold between them
+ */
+static bool LightGrid_CornersSmooth(const std::array<const lightgrid_samples_t *, 8> &corners, float threshold)
+{
+    const lightgrid_samples_t &first = *corners[0];
+
+    for (size_t i = 0; i < first.samples_by_style.size(); i++) {
+        const lightgrid_sample_t &a = first.samples_by_style[i];
+        qvec3d mins = a.color, maxs = a.color;
+
+        for (size_t c = 1; c < corners.size(); c++) {
+            const lightgrid_sample_t &b = corners[c]->samples_by_style[i];
+
+            if (a.used != b.used || (a.used && a.style != b.style)) {
+                return false;
+            }
+
+            mins = qv::min(mins, b.color);
+            maxs = qv::max(maxs, b.color);
+        }
+
+        if (a.used && qv::max(maxs - mins) > threshold) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static lightgrid_samples_t LightGrid_Interpolate(
+    const std::array<const lightgrid_samples_t *, 8> &corners, const qvec3d &t)
+{
+    lightgrid_samples_t result = *corners[0];
+
+    for (size_t i = 0; i < result.samples_by_style.size(); i++) {
+        if (!result.samples_by_style[i].used) {
+            continue;
+        }
+
+        qvec3d color{};
+
+        for (int c = 0; c < 8; c++) {
+            const vec_t w = ((c & 4) ? t[0] : 1 - t[0]) * ((c & 2) ? t[1] : 1 - t[1]) * ((c & 1) ? t[2] : 1 - t[2]);
+            color += corners[c]->samples_by_style[i].color * w;
+        }
+
+        result.samples_by_style[i].color = color;
+    }
+
+    return result;
+}
+
+/*
+ * -lightgrid_threshold: lights every LIGHTGRID_CELL'th point on each axis, then
+ * fills in each cell by trilinear interpolation if its 8 corners are lit and
+ * agree within the threshold, or lights the cell's points otherwise.
+ * each cell owns the points from its lower corner up to, but not including,
+ * its upper corner, so cells are filled in independently.
+ */
+static void LightGrid_CalcInterpolated(const mbsp_t &bsp, lightgrid_raw_data &data,
+    const std::vector<qvec3d> &points, float threshold, std::atomic<size_t> &lit_points)
+{
+    auto is_cell_corner = [&](int x, int y, int z) {
+        const qvec3i p{x, y, z};
+        for (int axis = 0; axis < 3; axis++) {
+            if (p[axis] % LIGHTGRID_CELL && p[axis] != data.grid_size[axis] - 1) {
+                return false;
+            }
+        }
+        return true;
+    };
+
+    auto light_point = [&](int sample_index) {
+        if (!data.occlusion[sample_index]) {
+            data.grid_result[sample_index] = CalcLightgridAtPoint(&bsp, points[sample_index]);
+            lit_points++;
+        }
+    };
+
+    const int num_points = data.grid_size[0] * data.grid_size[1] * data.grid_size[2];
+
+    logging::parallel_for(0, num_points, [&](int sample_index) {
+        const int z = (sample_index / (data.grid_size[0] * data.grid_size[1]));
+        const int y = (sample_index / data.grid_size[0]) % data.grid_size[1];
+        const int x = sample_index % data.grid_size[0];
+
+        if (is_cell_corner(x, y, z)) {
+            light_point(sample_index);
+        }
+    });
+
+    qvec3i num_cells;
+    for (int axis = 0; axis < 3; axis++) {
+        num_cells[axis] = std::max(1, (data.grid_size[axis] - 1 + LIGHTGRID_CELL - 1) / LIGHTGRID_CELL);
+    }
+
+    std::atomic<size_t> smooth_cells = 0;
+
+    logging::parallel_for(0, num_cells[0] * num_cells[1] * num_cells[2], [&](int cell_index) {
+        const qvec3i cell{cell_index % num_cells[0], (cell_index / num_cells[0]) % num_cells[1],
+            cell_index / (num_cells[0] * num_cells[1])};
+
+        qvec3i lo, hi, owned_end;
+        for (int axis = 0; axis < 3; axis++) {
+            lo[axis] = cell[axis] * LIGHTGRID_CELL;
+            hi[axis] = std::min(lo[axis] + LIGHTGRID_CELL, data.grid_size[axis] - 1);
+            // the last cell on an axis also owns its upper corner
+            owned_end[axis] = (cell[axis] == num_cells[axis] - 1) ? hi[axis] + 1 : hi[axis];
+        }
+
+        std::array<const lightgrid_samples_t *, 8> corners;
+        bool smooth = true;
+
+        for (int c = 0; c < 8; c++) {
+            const int sample_index = data.get_grid_index(
+                (c & 4) ? hi[0] : lo[0], (c & 2) ? hi[1] : lo[1], (c & 1) ? hi[2] : lo[2]);
+
+            smooth = smooth && !data.occlusion[sample_index];
+            corners[c] = &data.grid_result[sample_index];
+        }
+
+        smooth = smooth && LightGrid_CornersSmooth(corners, threshold);
+
+        if (smooth) {
+            smooth_cells++;
+        }
+
+        for (int z = lo[2]; z < owned_end[2]; ++z) {
+            for (int y = lo[1]; y < owned_end[1]; ++y) {
+                for (int x = lo[0]; x < owned_end[0]; ++x) {
+                    const int sample_index = data.get_grid_index(x, y, z);
+
+                    if (is_cell_corner(x, y, z) || data.occlusion[sample_index]) {
+                        continue;
+                    }
+
+                    if (!smooth) {
+                        light_point(sample_index);
+                        continue;
+                    }
+
+                    qvec3d t;
+                    for (int axis = 0; axis < 3; axis++) {
+                        const int p = (axis == 0) ? x : (axis == 1) ? y : z;
+                        t[axis] = (hi[axis] == lo[axis]) ? 0.0 : (p - lo[axis]) / static_cast<vec_t>(hi[axis] - lo[axis]);
+                    }
+
+                    data.grid_result[sample_index] = LightGrid_Interpolate(corners, t);
+                }
+            }
+        }
+    });
+
+    logging::print("     {} of {} cells interpolated\n", smooth_cells.load(), num_cells[0] * num_cells[1] * num_cells[2]);
+}
+
 void LightGrid(bspdata_t *bspdata)
 {
     if (!light_options.lightgrid.value())
@@ -406,11 +678,22 @@ void LightGrid(bspdata_t *bspdata)
     data.grid_size = {ceil(world_size[0] / data.grid_dist[0]), ceil(world_size[1] / data.grid_dist[1]),
         ceil(world_size[2] / data.grid_dist[2])};
 
-    data.grid_result.resize(data.grid_size[0] * data.grid_size[1] * data.grid_size[2]);
+    const int num_points = data.grid_size[0] * data.grid_size[1] * data.grid_size[2];
+
+    data.grid_result.resize(num_points);
+
+    data.occlusion.resize(num_points);
+
+    // skip blocks of points that are deep in solid without testing them one by one
+    std::vector<int> test_points;
+    if (num_points) {
+        LightGrid_ClassifyBlock(bsp, data, qvec3i{0, 0, 0}, data.grid_size, test_points);
+    }
 
-    data.occlusion.resize(data.grid_size[0] * data.grid_size[1] * data.grid_size[2]);
+    std::vector<qvec3d> points(num_points);
 
-    logging::parallel_for(0, data.grid_size[0] * data.grid_size[1] * data.grid_size[2], [&](int sample_index) {
+    logging::parallel_for(static_cast<size_t>(0), test_points.size(), [&](size_t i) {
+        const int sample_index = test_points[i];
         const int z = (sample_index / (data.grid_size[0] * data.grid_size[1]));
         const int y = (sample_index / data.grid_size[0]) % data.grid_size[1];
         const int x = sample_index % data.grid_size[0];
@@ -418,14 +701,26 @@ void LightGrid(bspdata_t *bspdata)
         qvec3d world_point = data.grid_mins + (qvec3d{x, y, z} * data.grid_dist);
 
         bool occluded;
-        lightgrid_samples_t samples;
-
-        std::tie(samples, occluded) = FixPointAndCalcLightgrid(&bsp, world_point);
-
-        data.grid_result[sample_index] = samples;
+        std::tie(points[sample_index], occluded) = LightGrid_FixPoint(&bsp, world_point);
         data.occlusion[sample_index] = occluded;
     });
 
+    std::atomic<size_t> lit_points = 0;
+    const float threshold = light_options.lightgrid_threshold.value();
+
+    if (threshold > 0) {
+        LightGrid_CalcInterpolated(bsp, data, points, threshold, lit_points);
+    } else {
+        logging::parallel_for(static_cast<size_t>(0), test_points.size(), [&](size_t i) {
+            const int sample_index = test_points[i];
+
+            if (!data.occlusion[sample_index]) {
+                data.grid_result[sample_index] = CalcLightgridAtPoint(&bsp, points[sample_index]);
+                lit_points++;
+            }
+        });
+    }
+
     // the maximum used styles across the map.
     data.num_styles = [&]() {
         int result = 0;
@@ -440,6 +735,8 @@ void LightGrid(bspdata_t *bspdata)
     logging::print("     {} grid_mins\n", data.grid_mins);
     logging::print("     {} grid_maxs\n", grid_maxs);
     logging::print("     {} num_styles\n", data.num_styles);
+    logging::print("     {} of {} grid points tested for solid, {} lit\n", test_points.size(), num_points,
+        lit_points.load());
 
     // octree lump
     if (light_options.lightgrid_format.value() == lightgrid_format_t::OCTREE) {
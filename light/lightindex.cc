@@ -0,0 +1,362 @@
+/*  Copyright (C) 1996-1997  Id Software, Inc.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+
+    See file, 'COPYING', for details.
+*/
+
+#include <light/lightindex.hh>
+
+#include <light/light.hh>
+#include <light/entities.hh>
+#include <light/ltface.hh>
+
+#include <common/bsputils.hh>
+#include <common/log.hh>
+
+#include <algorithm>
+#include <numeric>
+
+std::atomic<uint64_t> total_lightindex_faces, total_lightindex_lights, total_lightindex_culled,
+    total_lightindex_missed;
+
+namespace
+{
+struct lightindex_node_t
+{
+    aabb3d bounds;
+    // leaf if count != 0, in which case first indexes bvh_lights;
+    // otherwise first is the left child and first + 1 the right child
+    uint32_t first = 0;
+    uint32_t count = 0;
+};
+
+constexpr uint32_t BVH_LEAF_SIZE = 4;
+
+struct lightindex_t
+{
+    bool built = false;
+    visapprox_t mode = visapprox_t::NONE;
+
+    // number of lights DirectLightFace would cast at all
+    uint32_t num_eligible = 0;
+
+    // lights that can't be culled by the index; always candidates
+    std::vector<uint32_t> always;
+
+    // -visapprox vis: lights bucketed by vis cell, CSR layout
+    std::vector<uint32_t> cell_offsets;
+    std::vector<uint32_t> cell_lights;
+
+    // -visapprox rays: BVH over estimated light bounds
+    std::vector<lightindex_node_t> nodes;
+    std::vector<uint32_t> bvh_lights;
+};
+
+lightindex_t lightindex;
+} // namespace
+
+void ResetLightIndex()
+{
+    lightindex = {};
+
+    total_lightindex_faces = 0;
+    total_lightindex_lights = 0;
+    total_lightindex_culled = 0;
+    total_lightindex_missed = 0;
+}
+
+/*
+ * returns true if DirectLightFace never calls LightFace_Entity for this light
+ */
+static bool LightIndex_SkipLight(const light_t *entity)
+{
+    return entity->getFormula() == LF_LOCALMIN || entity->nostaticlight.value() || !(entity->light.value() > 0);
+}
+
+static bool LightIndex_DefaultChannels(const light_t *entity)
+{
+    return entity->light_channel_mask.value() == CHANNEL_MASK_DEFAULT &&
+           entity->shadow_channel_mask.value() == CHANNEL_MASK_DEFAULT;
+}
+
+/*
+ * returns the pvs bit index of the leaf the light is in, or -1 if
+ * VisCullEntity won't cull the light by vis (or reports bad vis data)
+ */
+static int LightIndex_VisCell(const mbsp_t *bsp, const mleaf_t *leaf)
+{
+    if (leaf == nullptr) {
+        return -1;
+    }
+
+    const auto *game = bsp->loadversion->game;
+
+    if (game->contents_are_solid({leaf->contents}) || game->contents_are_sky({leaf->contents}) ||
+        game->contents_are_liquid({leaf->contents})) {
+        return -1;
+    }
+
+    if (game->id == GAME_QUAKE_II) {
+        if (leaf->cluster < 0 || leaf->cluster >= bsp->dvis.bit_offsets.size() ||
+            bsp->dvis.get_bit_offset(VIS_PVS, leaf->cluster) >= bsp->dvis.bits.size()) {
+            return -1;
+        }
+        return leaf->cluster;
+    }
+
+    const int leafnum = leaf - bsp->dleafs.data();
+    const int visleaf = LeafnumToVisleaf(leafnum);
+
+    if (leafnum == 0 || visleaf < 0 || visleaf >= bsp->dmodels[0].visleafs) {
+        return -1;
+    }
+
+    return visleaf;
+}
+
+static void LightIndex_BuildCells(const mbsp_t *bsp, const std::vector<uint32_t> &lights)
+{
+    const auto &all_lights = GetLights();
+    const size_t num_cells = DecompressedVisSize(bsp) * 8;
+
+    std::vector<int> cells(lights.size(), -1);
+    lightindex.cell_offsets.assign(num_cells + 1, 0);
+
+    for (size_t i = 0; i < lights.size(); i++) {
+        const light_t *entity = all_lights[lights[i]].get();
+
+        if (LightIndex_DefaultChannels(entity)) {
+            cells[i] = LightIndex_VisCell(bsp, entity->leaf);
+        }
+
+        if (cells[i] < 0 || cells[i] >= num_cells) {
+            cells[i] = -1;
+            lightindex.always.push_back(lights[i]);
+        } else {
+            lightindex.cell_offsets[cells[i] + 1]++;
+        }
+    }
+
+    std::partial_sum(lightindex.cell_offsets.begin(), lightindex.cell_offsets.end(), lightindex.cell_offsets.begin());
+
+    std::vector<uint32_t> cursor(lightindex.cell_offsets.begin(), lightindex.cell_offsets.end() - 1);
+    lightindex.cell_lights.resize(lightindex.cell_offsets.back());
+
+    for (size_t i = 0; i < lights.size(); i++) {
+        if (cells[i] >= 0) {
+            lightindex.cell_lights[cursor[cells[i]]++] = lights[i];
+        }
+    }
+}
+
+static void LightIndex_BuildNode(
+    uint32_t nodenum, std::vector<uint32_t>::iterator begin, std::vector<uint32_t>::iterator end)
+{
+    const auto &all_lights = GetLights();
+    aabb3d bounds, centroids;
+
+    for (auto it = begin; it != end; it++) {
+        const aabb3d &lightbounds = all_lights[*it]->bounds;
+        bounds += lightbounds;
+        centroids += lightbounds.centroid();
+    }
+
+    lightindex.nodes[nodenum].bounds = bounds;
+
+    const size_t count = end - begin;
+
+    if (count <= BVH_LEAF_SIZE) {
+        lightindex.nodes[nodenum].first = begin - lightindex.bvh_lights.begin();
+        lightindex.nodes[nodenum].count = count;
+        return;
+    }
+
+    // median split along the longest centroid axis
+    const qvec3d size = centroids.size();
+    const int axis = (size[0] >= size[1] && size[0] >= size[2]) ? 0 : (size[1] >= size[2]) ? 1 : 2;
+    auto mid = begin + (count / 2);
+
+    std::nth_element(begin, mid, end, [&all_lights, axis](uint32_t a, uint32_t b) {
+        const vec_t ca = all_lights[a]->bounds.centroid()[axis];
+        const vec_t cb = all_lights[b]->bounds.centroid()[axis];
+        return ca < cb || (ca == cb && a < b);
+    });
+
+    // children are allocated as a consecutive pair
+    const uint32_t left = lightindex.nodes.size();
+    lightindex.nodes.emplace_back();
+    lightindex.nodes.emplace_back();
+
+    lightindex.nodes[nodenum].first = left;
+    lightindex.nodes[nodenum].count = 0;
+
+    LightIndex_BuildNode(left, begin, mid);
+    LightIndex_BuildNode(left + 1, mid, end);
+}
+
+static void LightIndex_BuildBVH(const std::vector<uint32_t> &lights)
+{
+    const auto &all_lights = GetLights();
+
+    for (uint32_t lightnum : lights) {
+        if (LightIndex_DefaultChannels(all_lights[lightnum].get())) {
+            lightindex.bvh_lights.push_back(lightnum);
+        } else {
+            // CullLight only skips the bounds test for these
+            lightindex.always.push_back(lightnum);
+        }
+    }
+
+    if (!lightindex.bvh_lights.empty()) {
+        lightindex.nodes.emplace_back();
+        LightIndex_BuildNode(0, lightindex.bvh_lights.begin(), lightindex.bvh_lights.end());
+    }
+}
+
+void SetupLightIndex(const mbsp_t *bsp)
+{
+    logging::funcheader();
+
+    ResetLightIndex();
+
+    const auto &all_lights = GetLights();
+    std::vector<uint32_t> lights;
+
+    for (uint32_t i = 0; i < all_lights.size(); i++) {
+        if (!LightIndex_SkipLight(all_lights[i].get())) {
+            lights.push_back(i);
+        }
+    }
+
+    lightindex.num_eligible = lights.size();
+    lightindex.mode = light_options.visapprox.value();
+
+    if (lightindex.mode == visapprox_t::VIS && !bsp->dvis.bits.empty()) {
+        LightIndex_BuildCells(bsp, lights);
+    } else if (lightindex.mode == visapprox_t::RAYS) {
+        LightIndex_BuildBVH(lights);
+    } else {
+        lightindex.mode = visapprox_t::NONE;
+        lightindex.always = std::move(lights);
+    }
+
+    lightindex.built = true;
+
+    logging::print(logging::flag::STAT, "     {:8} lights indexed\n", lightindex.num_eligible);
+    logging::print(logging::flag::STAT, "     {:8} lights not cullable by index\n", lightindex.always.size());
+    if (!lightindex.nodes.empty()) {
+        logging::print(logging::flag::STAT, "     {:8} bvh nodes\n", lightindex.nodes.size());
+    }
+}
+
+void LightIndex_CandidateLights(const lightsurf_t &lightsurf, std::vector<uint32_t> &out)
+{
+    Q_assert(lightindex.built);
+
+    out.clear();
+    out.insert(out.end(), lightindex.always.begin(), lightindex.always.end());
+
+    if (lightindex.mode == visapprox_t::VIS) {
+        if (lightsurf.pvs.empty()) {
+            // VisCullEntity doesn't cull without a pvs
+            out.insert(out.end(), lightindex.cell_lights.begin(), lightindex.cell_lights.end());
+        } else {
+            const size_t num_cells = lightindex.cell_offsets.size() - 1;
+            const size_t num_bytes = std::min(lightsurf.pvs.size(), (num_cells + 7) / 8);
+
+            for (size_t i = 0; i < num_bytes; i++) {
+                if (!lightsurf.pvs[i]) {
+                    continue;
+                }
+                for (size_t bit = 0; bit < 8; bit++) {
+                    const size_t cell = (i << 3) + bit;
+                    if (!(lightsurf.pvs[i] & (1 << bit)) || cell >= num_cells) {
+                        continue;
+                    }
+                    out.insert(out.end(), lightindex.cell_lights.begin() + lightindex.cell_offsets[cell],
+                        lightindex.cell_lights.begin() + lightindex.cell_offsets[cell + 1]);
+                }
+            }
+        }
+    } else if (lightindex.mode == visapprox_t::RAYS && !lightindex.nodes.empty()) {
+        const auto &all_lights = GetLights();
+        const aabb3d &facebounds = lightsurf.extents.bounds;
+
+        // same epsilon as CullLight; a node that is disjoint from the face
+        // can't contain a light bounds that isn't
+        uint32_t stack[64];
+        int stack_size = 0;
+        stack[stack_size++] = 0;
+
+        while (stack_size) {
+            const lightindex_node_t &node = lightindex.nodes[stack[--stack_size]];
+
+            if (node.bounds.disjoint(facebounds, 0.001)) {
+                continue;
+            }
+
+            if (node.count) {
+                for (uint32_t i = node.first; i < node.first + node.count; i++) {
+                    const uint32_t lightnum = lightindex.bvh_lights[i];
+                    if (!all_lights[lightnum]->bounds.disjoint(facebounds, 0.001)) {
+                        out.push_back(lightnum);
+                    }
+                }
+            } else {
+                Q_assert(stack_size + 2 <= 64);
+                stack[stack_size++] = node.first + 1;
+                stack[stack_size++] = node.first;
+            }
+        }
+    }
+
+    // DirectLightFace accumulates in GetLights() order
+    std::sort(out.begin(), out.end());
+
+    total_lightindex_faces++;
+    total_lightindex_lights += lightindex.num_eligible;
+    total_lightindex_culled += lightindex.num_eligible - out.size();
+}
+
+uint32_t LightIndex_MissedLights(
+    const mbsp_t *bsp, const lightsurf_t &lightsurf, const std::vector<uint32_t> &candidates)
+{
+    const auto &all_lights = GetLights();
+    uint32_t missed = 0;
+
+    for (uint32_t i = 0; i < all_lights.size(); i++) {
+        const light_t *entity = all_lights[i].get();
+
+        if (LightIndex_SkipLight(entity)) {
+            continue;
+        }
+        // same vis cull as LightFace_Entity
+        if (light_options.visapprox.value() == visapprox_t::VIS && LightIndex_DefaultChannels(entity) &&
+            VisCullEntity(bsp, lightsurf.pvs, entity->leaf)) {
+            continue;
+        }
+        if (!Light_CanReachSurface(entity, &lightsurf)) {
+            continue;
+        }
+        if (!std::binary_search(candidates.begin(), candidates.end(), i)) {
+            missed++;
+        }
+    }
+
+    total_lightindex_missed += missed;
+
+    return missed;
+}
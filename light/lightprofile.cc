@@ -0,0 +1,216 @@
+/*  Copyright (C) 1996-1997  Id Software, Inc.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+
+    See file, 'COPYING', for details.
+*/
+
+#include <light/lightprofile.hh>
+
+#include <light/light.hh>
+#include <light/entities.hh>
+
+#include <common/bsputils.hh>
+#include <common/json.hh>
+#include <common/log.hh>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <fstream>
+#include <iomanip>
+#include <numeric>
+
+thread_local profile_scope_t *profile_current_scope = nullptr;
+
+namespace
+{
+constexpr size_t PROFILE_STAGES = static_cast<size_t>(profile_stage_t::TOTAL);
+
+constexpr std::array<const char *, PROFILE_STAGES> profile_stage_names{
+    "dirt", "entity", "sky", "surface", "bounce", "postprocess"};
+
+// only touched by the thread lighting the face
+struct face_profile_t
+{
+    std::array<std::chrono::steady_clock::duration, PROFILE_STAGES> time{};
+    std::array<uint64_t, PROFILE_STAGES> rays{};
+};
+
+struct light_profile_t
+{
+    std::atomic<int64_t> nanoseconds = 0;
+    std::atomic<uint64_t> rays = 0;
+    std::atomic<uint64_t> faces = 0;
+};
+
+struct profile_t
+{
+    bool enabled = false;
+    std::vector<face_profile_t> faces;
+    std::vector<light_profile_t> lights;
+};
+
+profile_t profile;
+} // namespace
+
+void ResetProfile()
+{
+    profile = {};
+}
+
+void Profile_Setup(const mbsp_t *bsp)
+{
+    ResetProfile();
+
+    profile.enabled = true;
+    profile.faces.resize(bsp->dfaces.size());
+    profile.lights = std::vector<light_profile_t>(GetLights().size());
+}
+
+bool Profile_Enabled()
+{
+    return profile.enabled;
+}
+
+profile_scope_t::profile_scope_t(
+    const mbsp_t *bsp, const lightsurf_t *lightsurf, profile_stage_t stage, int lightnum)
+    : stage(stage),
+      lightnum(lightnum)
+{
+    if (!profile.enabled) {
+        return;
+    }
+
+    facenum = Face_GetNum(bsp, lightsurf->face);
+    parent = profile_current_scope;
+    profile_current_scope = this;
+    start = std::chrono::steady_clock::now();
+}
+
+profile_scope_t::~profile_scope_t()
+{
+    if (facenum < 0) {
+        return;
+    }
+
+    const auto elapsed = std::chrono::steady_clock::now() - start;
+    const auto own = elapsed - nested;
+
+    face_profile_t &face = profile.faces[facenum];
+    face.time[static_cast<size_t>(stage)] += own;
+    face.rays[static_cast<size_t>(stage)] += rays;
+
+    if (lightnum >= 0) {
+        light_profile_t &light = profile.lights[lightnum];
+        light.nanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(own).count();
+        light.rays += rays;
+        light.faces++;
+    }
+
+    if (parent) {
+        parent->nested += elapsed;
+    }
+    profile_current_scope = parent;
+}
+
+static std::chrono::steady_clock::duration Profile_FaceTime(const face_profile_t &face)
+{
+    return std::accumulate(face.time.begin(), face.time.end(), std::chrono::steady_clock::duration{});
+}
+
+static double Profile_Seconds(std::chrono::steady_clock::duration duration)
+{
+    return std::chrono::duration<double>(duration).count();
+}
+
+double Profile_FaceSeconds(int facenum)
+{
+    return Profile_Seconds(Profile_FaceTime(profile.faces[facenum]));
+}
+
+double Profile_MaxFaceSeconds()
+{
+    std::chrono::steady_clock::duration max{};
+
+    for (const auto &face : profile.faces) {
+        max = std::max(max, Profile_FaceTime(face));
+    }
+
+    return Profile_Seconds(max);
+}
+
+void Profile_Write(const mbsp_t *bsp, const fs::path &path)
+{
+    logging::funcheader();
+
+    std::vector<size_t> faces;
+    for (size_t i = 0; i < profile.faces.size(); i++) {
+        if (Profile_FaceTime(profile.faces[i]).count() > 0) {
+            faces.push_back(i);
+        }
+    }
+    std::stable_sort(faces.begin(), faces.end(),
+        [](size_t a, size_t b) { return Profile_FaceTime(profile.faces[a]) > Profile_FaceTime(profile.faces[b]); });
+
+    std::vector<size_t> lights;
+    for (size_t i = 0; i < profile.lights.size(); i++) {
+        if (profile.lights[i].faces) {
+            lights.push_back(i);
+        }
+    }
+    std::stable_sort(lights.begin(), lights.end(),
+        [](size_t a, size_t b) { return profile.lights[a].nanoseconds > profile.lights[b].nanoseconds; });
+
+    json j = json::object();
+
+    json &faces_json = (j["faces"] = json::array());
+    for (size_t i : faces) {
+        const face_profile_t &face = profile.faces[i];
+        json &face_json = faces_json.insert(faces_json.end(), json::object()).value();
+
+        face_json["face"] = i;
+        face_json["texture"] = Face_TextureName(bsp, &bsp->dfaces[i]);
+        face_json["seconds"] = Profile_Seconds(Profile_FaceTime(face));
+        face_json["rays"] = std::accumulate(face.rays.begin(), face.rays.end(), uint64_t{0});
+
+        json &stages_json = (face_json["stages"] = json::object());
+        for (size_t stage = 0; stage < PROFILE_STAGES; stage++) {
+            if (face.time[stage].count() == 0 && face.rays[stage] == 0) {
+                continue;
+            }
+            stages_json[profile_stage_names[stage]] = {
+                {"seconds", Profile_Seconds(face.time[stage])}, {"rays", face.rays[stage]}};
+        }
+    }
+
+    const auto &all_lights = GetLights();
+    json &lights_json = (j["lights"] = json::array());
+    for (size_t i : lights) {
+        const light_profile_t &light = profile.lights[i];
+        json &light_json = lights_json.insert(lights_json.end(), json::object()).value();
+
+        light_json["light"] = i;
+        light_json["classname"] = all_lights[i]->classname();
+        light_json["origin"] = all_lights[i]->origin.value();
+        light_json["seconds"] = static_cast<double>(light.nanoseconds) / 1e9;
+        light_json["rays"] = static_cast<uint64_t>(light.rays);
+        light_json["faces"] = static_cast<uint64_t>(light.faces);
+    }
+
+    std::ofstream(path, std::fstream::out | std::fstream::trunc) << std::setw(4) << j;
+
+    logging::print("Wrote profile {}\n", path);
+}
@@ -0,0 +1,393 @@
+/*  Copyright (C) 1996-1997  Id Software, Inc.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+
+    See file, 'COPYING', for details.
+*/
+
+#include <light/lighttree.hh>
+
+#include <light/light.hh>
+#include <light/ltface.hh> // for VisCullEntity
+
+#include <common/bsputils.hh>
+#include <common/log.hh>
+
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <tuple>
+
+// same as Walter et al.; bounds the cost of a single face
+constexpr size_t LIGHTCUT_MAX_SIZE = 1000;
+
+// trees per bounce level (std::nullopt for direct surface lights)
+static std::map<std::optional<size_t>, std::vector<lighttree_t>> light_trees;
+
+void ResetLightTree()
+{
+    light_trees.clear();
+}
+
+const std::vector<lighttree_t> &LightTrees(std::optional<size_t> bounce_depth)
+{
+    static const std::vector<lighttree_t> empty;
+
+    auto it = light_trees.find(bounce_depth);
+    return it == light_trees.end() ? empty : it->second;
+}
+
+/*
+ * normal cones, see Conty & Kulla, "Importance Sampling of Many Lights
+ * with Adaptive Tree Splitting"
+ */
+static float ConeAngle(float cos_half_angle)
+{
+    return std::acos(std::clamp(cos_half_angle, -1.0f, 1.0f));
+}
+
+static void LightTree_MergeCones(
+    const qvec3f &a_axis, float a_cos, const qvec3f &b_axis, float b_cos, qvec3f &axis, float &cos_half_angle)
+{
+    float theta_a = ConeAngle(a_cos), theta_b = ConeAngle(b_cos);
+    qvec3f a = a_axis, b = b_axis;
+
+    if (theta_a < theta_b) {
+        std::swap(a, b);
+        std::swap(theta_a, theta_b);
+    }
+
+    const float theta_d = ConeAngle(qv::dot(a, b));
+
+    if (std::min(theta_d + theta_b, static_cast<float>(Q_PI)) <= theta_a) {
+        axis = a;
+        cos_half_angle = std::cos(theta_a);
+        return;
+    }
+
+    const float theta_o = (theta_a + theta_d + theta_b) * 0.5f;
+
+    if (theta_o >= Q_PI) {
+        axis = a;
+        cos_half_angle = -1.0f;
+        return;
+    }
+
+    // rotate a towards b by theta_o - theta_a
+    const float theta_r = theta_o - theta_a;
+    const qvec3f ortho = b - a * qv::dot(a, b);
+    const float ortho_len = qv::length(ortho);
+
+    if (ortho_len < 1e-6f) {
+        axis = a;
+    } else {
+        axis = qv::normalize(a * std::cos(theta_r) + (ortho / ortho_len) * std::sin(theta_r));
+    }
+    cos_half_angle = std::cos(theta_o);
+}
+
+// deterministic replacement for the random representative choice of lightcuts
+static float LightTree_Hash(uint32_t x)
+{
+    x ^= x >> 16;
+    x *= 0x7feb352dU;
+    x ^= x >> 15;
+    x *= 0x846ca68bU;
+    x ^= x >> 16;
+    return (x & 0xffffff) / static_cast<float>(0x1000000);
+}
+
+static void LightTree_BuildNode(lighttree_t &tree, uint32_t nodenum, size_t begin, size_t end)
+{
+    const size_t count = end - begin;
+
+    if (count == 1) {
+        const lighttree_emitter_t &emitter = tree.emitters[begin];
+        lighttree_node_t &node = tree.nodes[nodenum];
+
+        node.bounds = aabb3f(emitter.pos);
+        node.cullbounds = emitter.vpl->bounds;
+        node.axis = emitter.vpl->surfnormal;
+        node.cos_half_angle = 1.0f;
+        node.power = emitter.setting->color * emitter.setting->intensity;
+        node.rep = begin;
+        node.first = begin;
+        node.count = 1;
+        return;
+    }
+
+    aabb3f centroids;
+    for (size_t i = begin; i < end; i++) {
+        centroids += tree.emitters[i].pos;
+    }
+
+    // median split along the longest axis
+    const qvec3f size = centroids.size();
+    const int axis = (size[0] >= size[1] && size[0] >= size[2]) ? 0 : (size[1] >= size[2]) ? 1 : 2;
+    const size_t mid = begin + (count / 2);
+
+    std::nth_element(tree.emitters.begin() + begin, tree.emitters.begin() + mid, tree.emitters.begin() + end,
+        [axis](const lighttree_emitter_t &a, const lighttree_emitter_t &b) { return a.pos[axis] < b.pos[axis]; });
+
+    // children are allocated as a consecutive pair
+    const uint32_t left = tree.nodes.size();
+    tree.nodes.emplace_back();
+    tree.nodes.emplace_back();
+
+    LightTree_BuildNode(tree, left, begin, mid);
+    LightTree_BuildNode(tree, left + 1, mid, end);
+
+    const lighttree_node_t &l = tree.nodes[left];
+    const lighttree_node_t &r = tree.nodes[left + 1];
+    lighttree_node_t &node = tree.nodes[nodenum];
+
+    node.bounds = l.bounds + r.bounds;
+    node.cullbounds = l.cullbounds + r.cullbounds;
+    LightTree_MergeCones(l.axis, l.cos_half_angle, r.axis, r.cos_half_angle, node.axis, node.cos_half_angle);
+    node.power = l.power + r.power;
+
+    const vec_t lw = qv::max(l.power), rw = qv::max(r.power);
+    node.rep = (lw + rw > 0 && LightTree_Hash(nodenum) * (lw + rw) >= lw) ? r.rep : l.rep;
+    node.first = left;
+    node.count = 0;
+}
+
+void BuildLightTrees(std::optional<size_t> bounce_depth)
+{
+    logging::funcheader();
+
+    auto &trees = light_trees[bounce_depth];
+    trees.clear();
+
+    std::map<std::tuple<int32_t, bool, bool>, size_t> tree_for_key;
+
+    for (const auto &surf_ptr : EmissiveLightSurfaces()) {
+        const surfacelight_t &vpl = *surf_ptr->vpl;
+
+        for (const auto &setting : vpl.styles) {
+            if (setting.bounce_level != bounce_depth) {
+                continue;
+            }
+
+            const auto key = std::make_tuple(setting.style, setting.omnidirectional, setting.rescale);
+            auto it = tree_for_key.find(key);
+
+            if (it == tree_for_key.end()) {
+                it = tree_for_key.emplace(key, trees.size()).first;
+                trees.push_back({setting.style, setting.omnidirectional, setting.rescale});
+            }
+
+            lighttree_t &tree = trees[it->second];
+
+            for (size_t c = 0; c < vpl.points.size(); c++) {
+                tree.emitters.push_back({vpl.points[c], &vpl, &setting, vpl.leaves[c]});
+            }
+        }
+    }
+
+    size_t total_emitters = 0, total_nodes = 0;
+
+    for (auto &tree : trees) {
+        if (tree.emitters.empty()) {
+            continue;
+        }
+        tree.nodes.reserve(tree.emitters.size() * 2 - 1);
+        tree.nodes.emplace_back();
+        LightTree_BuildNode(tree, 0, 0, tree.emitters.size());
+
+        total_emitters += tree.emitters.size();
+        total_nodes += tree.nodes.size();
+    }
+
+    logging::print(logging::flag::STAT, "     {:8} light trees\n", trees.size());
+    logging::print(logging::flag::STAT, "     {:8} emitters\n", total_emitters);
+    logging::print(logging::flag::STAT, "     {:8} nodes\n", total_nodes);
+}
+
+/*
+ * upper bound of max(dp1 * dp2) over all directions between the node and the lightsurf,
+ * using the node's normal cone for dp1. dp2 is bounded by 1.
+ */
+static float LightTree_CosBound(const lighttree_t &tree, const lighttree_node_t &node, const lightsurf_t *lightsurf)
+{
+    if (tree.omnidirectional) {
+        return 0.5f;
+    }
+
+    const qvec3f node_center = node.bounds.centroid();
+    const qvec3f node_extent = node.bounds.size() * 0.5f;
+    const qvec3f to_surf = qvec3f(lightsurf->extents.origin) - node_center;
+    const float dist = qv::length(to_surf);
+    const float radius = qv::length(node_extent) + lightsurf->extents.radius;
+
+    if (dist <= radius) {
+        return 1.0f;
+    }
+
+    const float theta_d = std::asin(std::min(1.0f, radius / dist));
+    const float theta_n = ConeAngle(node.cos_half_angle);
+    const float theta_c = ConeAngle(qv::dot(node.axis, to_surf / dist));
+    const float theta = std::max(0.0f, theta_c - theta_n - theta_d);
+
+    const float cos_theta = std::cos(theta);
+
+    // GetSurfaceLighting rejects dp1 < -LIGHT_ANGLE_EPSILON before rescaling
+    if (cos_theta < -LIGHT_ANGLE_EPSILON) {
+        return 0.0f;
+    }
+
+    const float dp1 = std::max(0.0f, cos_theta);
+
+    return tree.rescale ? (0.5f + dp1 * 0.5f) : dp1;
+}
+
+static float LightTree_MinDist(const aabb3f &a, const aabb3d &b)
+{
+    float dist2 = 0;
+
+    for (int i = 0; i < 3; i++) {
+        const float d = std::max({0.0f, static_cast<float>(b.mins()[i]) - a.maxs()[i],
+            a.mins()[i] - static_cast<float>(b.maxs()[i])});
+        dist2 += d * d;
+    }
+
+    return std::sqrt(dist2);
+}
+
+// upper bound of the unoccluded contribution of the node to any sample of the lightsurf
+static float LightTree_ErrorBound(const lighttree_t &tree, const lighttree_node_t &node,
+    const lightsurf_t *lightsurf, float scale, float hotspot_clamp)
+{
+    float dist = std::max(0.01f, LightTree_MinDist(node.bounds, lightsurf->extents.bounds));
+
+    if (tree.omnidirectional) {
+        dist += lightsurf->cfg->surflightskydist.value();
+    }
+
+    dist = std::max(dist, hotspot_clamp);
+
+    return qv::max(node.power) * scale * LightTree_CosBound(tree, node, lightsurf) / (dist * dist);
+}
+
+// unoccluded contribution of the representative at the center of the lightsurf
+static float LightTree_Estimate(const lighttree_t &tree, const lighttree_node_t &node, const lightsurf_t *lightsurf,
+    float scale, float hotspot_clamp)
+{
+    const lighttree_emitter_t &rep = tree.emitters[node.rep];
+    qvec3f dir = qvec3f(lightsurf->extents.origin) - rep.pos;
+    float dist = std::max(0.01f, qv::length(dir));
+    dir /= dist;
+
+    const float dp2 = lightsurf->twosided ? 1.0f : std::max(0.0f, -qv::dot(dir, qvec3f(lightsurf->plane.normal)));
+    float factor;
+
+    if (tree.omnidirectional) {
+        factor = dp2 * 0.5f;
+        dist += lightsurf->cfg->surflightskydist.value();
+    } else {
+        const float dp1 = std::max(0.0f, qv::dot(rep.vpl->surfnormal, dir));
+        factor = tree.rescale ? (0.5f + dp1 * 0.5f) * (0.5f + dp2 * 0.5f) : dp1 * dp2;
+    }
+
+    dist = std::max(dist, hotspot_clamp);
+
+    return qv::max(node.power) * scale * factor / (dist * dist);
+}
+
+void LightTree_SelectCut(const mbsp_t *bsp, const lighttree_t &tree, const lightsurf_t *lightsurf, float scale,
+    float hotspot_clamp, float gate, std::vector<uint32_t> &cut)
+{
+    struct cut_entry_t
+    {
+        float error;
+        float estimate;
+        uint32_t node;
+
+        bool operator<(const cut_entry_t &other) const
+        {
+            return error < other.error || (error == other.error && node > other.node);
+        }
+    };
+
+    cut.clear();
+
+    if (tree.nodes.empty()) {
+        return;
+    }
+
+    const float relative_error = light_options.lightcuts.value();
+    std::vector<cut_entry_t> heap;
+    float total = 0;
+
+    // returns false if the node can't reach the lightsurf
+    auto visit = [&](uint32_t nodenum) {
+        const lighttree_node_t &node = tree.nodes[nodenum];
+
+        if (light_options.visapprox.value() == visapprox_t::RAYS &&
+            node.cullbounds.disjoint(lightsurf->extents.bounds, 0.001)) {
+            return;
+        }
+
+        if (node.count && light_options.visapprox.value() == visapprox_t::VIS &&
+            VisCullEntity(bsp, lightsurf->pvs, tree.emitters[node.first].leaf)) {
+            return;
+        }
+
+        const float bound = LightTree_ErrorBound(tree, node, lightsurf, scale, hotspot_clamp);
+
+        // every point in the node would be gated by the per-point path
+        if (bound <= gate) {
+            return;
+        }
+
+        const float estimate = LightTree_Estimate(tree, node, lightsurf, scale, hotspot_clamp);
+        total += estimate;
+
+        if (node.count) {
+            // leaves are shaded exactly
+            cut.push_back(nodenum);
+            return;
+        }
+
+        heap.push_back({bound, estimate, nodenum});
+        std::push_heap(heap.begin(), heap.end());
+    };
+
+    visit(0);
+
+    while (!heap.empty() && cut.size() + heap.size() < LIGHTCUT_MAX_SIZE) {
+        const cut_entry_t &top = heap.front();
+
+        if (top.error <= relative_error * total) {
+            break;
+        }
+
+        const uint32_t nodenum = top.node;
+        total -= top.estimate;
+
+        std::pop_heap(heap.begin(), heap.end());
+        heap.pop_back();
+
+        visit(tree.nodes[nodenum].first);
+        visit(tree.nodes[nodenum].first + 1);
+    }
+
+    for (const auto &entry : heap) {
+        cut.push_back(entry.node);
+    }
+
+    // deterministic shading order
+    std::sort(cut.begin(), cut.end());
+}
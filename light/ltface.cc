@@ -25,6 +25,9 @@
 #include <light/surflight.hh> //mxd
 #include <light/entities.hh>
 #include <light/lightgrid.hh>
+#include <light/lightindex.hh>
+#include <light/lightprofile.hh>
+#include <light/lighttree.hh>
 #include <light/trace.hh>
 #include <light/litfile.hh> // for facesup_t
 
@@ -41,9 +44,18 @@
 #include <algorithm>
 #include <fstream>
 
+#include <tbb/enumerable_thread_specific.h>
+#include <tbb/parallel_for_each.h>
+
+#if defined(HAVE_EMBREE) && defined(__SSE2__)
+#include <xmmintrin.h>
+#endif
+
 std::atomic<uint32_t> total_light_rays, total_light_ray_hits, total_samplepoints;
 std::atomic<uint32_t> total_bounce_rays, total_bounce_ray_hits;
 std::atomic<uint32_t> total_surflight_rays, total_surflight_ray_hits; // mxd
+std::atomic<uint64_t> total_lightcuts, total_lightcut_nodes;
+std::atomic<uint64_t> total_adaptive_luxels, total_adaptive_refined;
 std::atomic<uint32_t> fully_transparent_lightmaps;
 static bool warned_about_light_map_overflow, warned_about_light_style_overflow;
 
@@ -268,16 +280,15 @@ static void CalcPoints_Debug(const lightsurf_t *surf, const mbsp_t *bsp)
     for (int t = 0; t < surf->height; t++) {
         for (int s = 0; s < surf->width; s++) {
             const int i = t * surf->width + s;
-            const auto &sample = surf->samples[i];
-            const qvec3d &point = sample.point;
-            const qvec3d mangle = qv::mangle_from_vec(sample.normal);
+            const qvec3d point = surf->samples.point[i];
+            const qvec3d mangle = qv::mangle_from_vec(qvec3d(surf->samples.normal[i]));
 
             f << "{\n";
             f << "\"classname\" \"light\"\n";
             ewt::print(f, "\"origin\" \"{}\"\n", point);
             ewt::print(f, "\"mangle\" \"{}\"\n", mangle);
-            ewt::print(f, "\"face\" \"{}\"\n", sample.realfacenum);
-            ewt::print(f, "\"occluded\" \"{}\"\n", sample.occluded);
+            ewt::print(f, "\"face\" \"{}\"\n", surf->samples.realfacenum[i]);
+            ewt::print(f, "\"occluded\" \"{}\"\n", static_cast<bool>(surf->samples.occluded[i]));
             ewt::print(f, "\"s\" \"{}\"\n", s);
             ewt::print(f, "\"t\" \"{}\"\n", t);
             f << "}\n";
@@ -434,22 +445,21 @@ static void CalcPoints(
     for (int t = 0; t < surf->height; t++) {
         for (int s = 0; s < surf->width; s++) {
             const int i = t * surf->width + s;
-            auto &sample = surf->samples[i];
 
             const vec_t us = starts + s * st_step;
             const vec_t ut = startt + t * st_step;
 
-            sample.point =
+            const qvec3d point =
                 surf->extents.LMCoordToWorld(qvec2f(us, ut)) + surf->plane.normal; // one unit in front of face
 
             // do this before correcting the point, so we can wrap around the inside of pipes
             const bool phongshaded = (surf->curved && cfg.phongallowed.value());
-            const auto res = CalcPointNormal(bsp, face, sample.point, phongshaded, surf->extents, 0, offset);
+            const auto res = CalcPointNormal(bsp, face, point, phongshaded, surf->extents, 0, offset);
 
-            sample.occluded = !res.m_unoccluded;
-            sample.realfacenum = res.m_actualFace != nullptr ? Face_GetNum(bsp, res.m_actualFace) : -1;
-            sample.point = res.m_position + offset;
-            sample.normal = res.m_interpolatedNormal;
+            surf->samples.occluded[i] = !res.m_unoccluded;
+            surf->samples.realfacenum[i] = res.m_actualFace != nullptr ? Face_GetNum(bsp, res.m_actualFace) : -1;
+            surf->samples.point[i] = res.m_position + offset;
+            surf->samples.normal[i] = res.m_interpolatedNormal;
         }
     }
 
@@ -516,8 +526,8 @@ static void CalcPvs(const mbsp_t *bsp, lightsurf_t *lightsurf)
     uint8_t *pointpvs = (uint8_t *)alloca(pvssize);
     lightsurf->pvs.resize(pvssize);
 
-    for (auto &sample : lightsurf->samples) {
-        const mleaf_t *leaf = Light_PointInLeaf(bsp, sample.point);
+    for (const qvec3f &point : lightsurf->samples.point) {
+        const mleaf_t *leaf = Light_PointInLeaf(bsp, point);
 
         /* most/all of the surface points are probably in the same leaf */
         if (leaf == lastleaf)
@@ -1128,7 +1138,12 @@ inline bool CullLight(const light_t *entity, const lightsurf_t *lightsurf)
     return fabs(GetLightValue(cfg, entity, dist)) <= light_options.gate.value();
 }
 
-static bool VisCullEntity(const mbsp_t *bsp, const std::vector<uint8_t> &pvs, const mleaf_t *entleaf)
+bool Light_CanReachSurface(const light_t *entity, const lightsurf_t *lightsurf)
+{
+    return !CullLight(entity, lightsurf);
+}
+
+bool VisCullEntity(const mbsp_t *bsp, const std::vector<uint8_t> &pvs, const mleaf_t *entleaf)
 {
     if (pvs.empty()) {
         return false;
@@ -1149,13 +1164,28 @@ static bool VisCullEntity(const mbsp_t *bsp, const std::vector<uint8_t> &pvs, co
     return !Pvs_LeafVisible(bsp, pvs, entleaf);
 }
 
+/*
+ * -wavefront: queued point light ray, see QueueDirectLightFace
+ */
+struct entity_ray_payload_t
+{
+    lightsurf_t *lightsurf;
+    const light_t *entity;
+    int point;
+    qvec3d normalcontrib;
+};
+
+using light_wavefront_t = raystream_wavefront_t<entity_ray_payload_t>;
+
 /*
  * ================
  * LightFace_Entity
+ *
+ * if wavefront is set, the rays are queued on it instead of being traced here
  * ================
  */
-static void LightFace_Entity(
-    const mbsp_t *bsp, const light_t *entity, lightsurf_t *lightsurf, lightmapdict_t *lightmaps)
+static void LightFace_Entity(const mbsp_t *bsp, const light_t *entity, lightsurf_t *lightsurf,
+    lightmapdict_t *lightmaps, light_wavefront_t *wavefront = nullptr)
 {
     const settings::worldspawn_keys &cfg = *lightsurf->cfg;
     const modelinfo_t *modelinfo = lightsurf->modelinfo;
@@ -1198,14 +1228,14 @@ static void LightFace_Entity(
     raystream_occlusion_t &rs = *lightsurf->occlusion_stream;
     rs.clearPushedRays();
 
-    for (int i = 0; i < lightsurf->samples.size(); i++) {
-        const auto &sample = lightsurf->samples[i];
+    const auto &samples = lightsurf->samples;
 
-        if (sample.occluded)
+    for (int i = 0; i < samples.size(); i++) {
+        if (samples.occluded[i])
             continue;
 
-        const qvec3d &surfpoint = sample.point;
-        const qvec3d &surfnorm = sample.normal;
+        const qvec3d surfpoint = samples.point[i];
+        const qvec3d surfnorm = samples.normal[i];
 
         qvec3d surfpointToLightDir;
         float surfpointToLightDist;
@@ -1215,7 +1245,7 @@ static void LightFace_Entity(
         GetLightContrib(cfg, entity, surfnorm, true, surfpoint, lightsurf->twosided, color, surfpointToLightDir,
             normalcontrib, &surfpointToLightDist);
 
-        const float occlusion = Dirt_GetScaleFactor(cfg, sample.occlusion, entity, surfpointToLightDist, lightsurf);
+        const float occlusion = Dirt_GetScaleFactor(cfg, samples.occlusion[i], entity, surfpointToLightDist, lightsurf);
         color *= occlusion;
 
         /* Quick distance check first */
@@ -1223,12 +1253,25 @@ static void LightFace_Entity(
             continue;
         }
 
+        if (wavefront) {
+            wavefront->pushRay(modelinfo, entity->shadow_channel_mask.value(), surfpoint, surfpointToLightDir,
+                surfpointToLightDist, color, {lightsurf, entity, i, normalcontrib});
+            total_light_rays++;
+            Profile_CountRays(1);
+            continue;
+        }
+
         rs.pushRay(i, surfpoint, surfpointToLightDir, surfpointToLightDist, &color, &normalcontrib);
     }
 
+    if (wavefront) {
+        return;
+    }
+
     // don't need closest hit, just checking for occlusion between light and surface point
     rs.tracePushedRaysOcclusion(modelinfo, entity->shadow_channel_mask.value());
     total_light_rays += rs.numPushedRays();
+    Profile_CountRays(rs.numPushedRays());
 
     int cached_style = entity->style.value();
     lightmap_t *cached_lightmap = Lightmap_ForStyle(lightmaps, cached_style, lightsurf);
@@ -1363,14 +1406,14 @@ static void LightFace_Sky(const mbsp_t *bsp, const sun_t *sun, lightsurf_t *ligh
     raystream_intersection_t &rs = *lightsurf->intersection_stream;
     rs.clearPushedRays();
 
-    for (int i = 0; i < lightsurf->samples.size(); i++) {
-        const auto &sample = lightsurf->samples[i];
+    const auto &samples = lightsurf->samples;
 
-        if (sample.occluded)
+    for (int i = 0; i < samples.size(); i++) {
+        if (samples.occluded[i])
             continue;
 
-        const qvec3d &surfpoint = sample.point;
-        const qvec3d &surfnorm = sample.normal;
+        const qvec3d surfpoint = samples.point[i];
+        const qvec3d surfnorm = samples.normal[i];
 
         vec_t angle = qv::dot(incoming, surfnorm);
         if (lightsurf->twosided) {
@@ -1385,7 +1428,7 @@ static void LightFace_Sky(const mbsp_t *bsp, const sun_t *sun, lightsurf_t *ligh
         vec_t value = angle * sun->sunlight;
 
         if (sun->dirt) {
-            value *= Dirt_GetScaleFactor(cfg, sample.occlusion, NULL, 0.0, lightsurf);
+            value *= Dirt_GetScaleFactor(cfg, samples.occlusion[i], NULL, 0.0, lightsurf);
         }
 
         qvec3f color = sun->sunlight_color * (value / 255.0);
@@ -1410,6 +1453,7 @@ static void LightFace_Sky(const mbsp_t *bsp, const sun_t *sun, lightsurf_t *ligh
 
     const int N = rs.numPushedRays();
     total_light_rays += N;
+    Profile_CountRays(N);
 
     for (int j = 0; j < N; j++) {
         if (rs.getPushedRayHitType(j) != hittype_t::SKY) {
@@ -1631,19 +1675,18 @@ static void LightFace_Min(const mbsp_t *bsp, const mface_t *face, const qvec3d &
 
     bool hit = false;
     for (int i = 0; i < lightsurf->samples.size(); i++) {
-        const auto &surf_sample = lightsurf->samples[i];
         lightsample_t &sample = lightmap->samples[i];
 
         vec_t value = light;
         if (cfg.minlight_dirt.value()) {
-            value *= Dirt_GetScaleFactor(cfg, surf_sample.occlusion, NULL, 0.0, lightsurf);
+            value *= Dirt_GetScaleFactor(cfg, lightsurf->samples.occlusion[i], NULL, 0.0, lightsurf);
         }
         if (cfg.addminlight.value()) {
             sample.color += color * (value / 255.0);
             hit = true;
         } else {
             if (lightsurf->minlightMottle) {
-                value += Mottle(surf_sample.point);
+                value += Mottle(lightsurf->samples.point[i]);
             }
             hit = Light_ClampMin(sample, value, color) || hit;
         }
@@ -1689,13 +1732,11 @@ static void LightFace_LocalMin(
 
         bool hit = false;
         for (int i = 0; i < lightsurf->samples.size(); i++) {
-            const auto &surf_sample = lightsurf->samples[i];
-
-            if (surf_sample.occluded)
+            if (lightsurf->samples.occluded[i])
                 continue;
 
             const lightsample_t &sample = lightmap->samples[i];
-            const qvec3d &surfpoint = surf_sample.point;
+            const qvec3d surfpoint = lightsurf->samples.point[i];
             if (cfg.addminlight.value() || LightSample_Brightness(sample.color) < entity->light.value()) {
                 qvec3d surfpointToLightDir;
                 const vec_t surfpointToLightDist = GetDir(surfpoint, entity->origin.value(), surfpointToLightDir);
@@ -1707,6 +1748,7 @@ static void LightFace_LocalMin(
         // local minlight just needs occlusion, not closest hit
         rs.tracePushedRaysOcclusion(modelinfo, CHANNEL_MASK_DEFAULT);
         total_light_rays += rs.numPushedRays();
+        Profile_CountRays(rs.numPushedRays());
 
         const int N = rs.numPushedRays();
         for (int j = 0; j < N; j++) {
@@ -1719,7 +1761,7 @@ static void LightFace_LocalMin(
             lightsample_t &sample = lightmap->samples[i];
 
             value *= Dirt_GetScaleFactor(
-                cfg, lightsurf->samples[i].occlusion, entity.get(), 0.0 /* TODO: pass distance */, lightsurf);
+                cfg, lightsurf->samples.occlusion[i], entity.get(), 0.0 /* TODO: pass distance */, lightsurf);
             if (cfg.addminlight.value()) {
                 sample.color += entity->color.value() * (value / 255.0);
                 hit = true;
@@ -1748,8 +1790,8 @@ static void LightFace_AutoMin(const mbsp_t *bsp, const mface_t *face, lightsurf_
      */
     bool apply_to_all = false;
 
-    const bool any_occluded = std::any_of(lightsurf->samples.begin(), lightsurf->samples.end(),
-        [](const lightsurf_t::sample_data_t &v) { return v.occluded; });
+    const bool any_occluded = std::any_of(
+        lightsurf->samples.occluded.begin(), lightsurf->samples.occluded.end(), [](uint8_t v) { return v; });
 
     if (!modelinfo->autominlight.is_changed()) {
         // default: apply autominlight to occluded luxels only
@@ -1790,7 +1832,7 @@ static void LightFace_AutoMin(const mbsp_t *bsp, const mface_t *face, lightsurf_
             // for each luxel (or only occluded luxels, depending on the setting),
             // apply the minlight
             for (int i = 0; i < lightsurf->samples.size(); i++) {
-                if (apply_to_all || lightsurf->samples[i].occluded) {
+                if (apply_to_all || lightsurf->samples.occluded[i]) {
                     lightmap->samples[i].color = qv::max(qvec3f{grid_sample.color}, lightmap->samples[i].color);
                 }
             }
@@ -1800,7 +1842,7 @@ static void LightFace_AutoMin(const mbsp_t *bsp, const mface_t *face, lightsurf_
 
         // clear occluded state, since we filled in all occluded samples with a color
         for (int i = 0; i < lightsurf->samples.size(); i++) {
-            lightsurf->samples[i].occluded = false;
+            lightsurf->samples.occluded[i] = false;
         }
     }
 }
@@ -1819,7 +1861,7 @@ static void LightFace_DirtDebug(const mbsp_t *bsp, const lightsurf_t *lightsurf,
     /* Overwrite each point with the dirt value for that sample... */
     for (int i = 0; i < lightsurf->samples.size(); i++) {
         lightsample_t &sample = lightmap->samples[i];
-        const float light = 255 * Dirt_GetScaleFactor(cfg, lightsurf->samples[i].occlusion, nullptr, 0.0, lightsurf);
+        const float light = 255 * Dirt_GetScaleFactor(cfg, lightsurf->samples.occlusion[i], nullptr, 0.0, lightsurf);
         sample.color = {light};
     }
 
@@ -1840,7 +1882,7 @@ static void LightFace_PhongDebug(const mbsp_t *bsp, const lightsurf_t *lightsurf
     for (int i = 0; i < lightsurf->samples.size(); i++) {
         lightsample_t &sample = lightmap->samples[i];
         // scale from [-1..1] to [0..1], then multiply by 255
-        sample.color = lightsurf->samples[i].normal;
+        sample.color = lightsurf->samples.normal[i];
 
         for (auto &v : sample.color) {
             v = std::abs(v) * 255;
@@ -1861,7 +1903,7 @@ static void LightFace_DebugMottle(const mbsp_t *bsp, const lightsurf_t *lightsur
         // mottle is meant to be applied on top of minlight, so add some here
         // for preview purposes.
         const float minlight = 20.0f;
-        sample.color = qvec3f(minlight + Mottle(lightsurf->samples[i].point));
+        sample.color = qvec3f(minlight + Mottle(lightsurf->samples.point[i]));
     }
 
     Lightmap_Save(bsp, lightmaps, lightsurf, lightmap, 0);
@@ -1953,105 +1995,155 @@ SurfaceLight_SphereCull(const surfacelight_t *vpl, const lightsurf_t *lightsurf,
     return qv::gate(color, (float)bouncelight_gate);
 }
 
-static void // mxd
-LightFace_SurfaceLight(const mbsp_t *bsp, lightsurf_t *lightsurf, lightmapdict_t *lightmaps, std::optional<size_t> bounce_depth,
-    const vec_t &standard_scale, const vec_t &sky_scale, const float &hotspot_clamp)
+// traces a single surface light point against all samples of the lightsurf
+static void LightFace_SurfaceLightPoint(const mbsp_t *bsp, lightsurf_t *lightsurf, lightmapdict_t *lightmaps,
+    const surfacelight_t &vpl, const surfacelight_t::per_style_t &vpl_setting, const qvec3f &pos,
+    const vec_t &standard_scale, const vec_t &sky_scale, const float &hotspot_clamp, const float &surflight_gate)
 {
     const settings::worldspawn_keys &cfg = *lightsurf->cfg;
-    const float surflight_gate = 0.01f;
+    raystream_occlusion_t &rs = *lightsurf->occlusion_stream;
 
-    // check lighting channels (currently surface lights are always on CHANNEL_MASK_DEFAULT)
-    if (!(lightsurf->object_channel_mask & CHANNEL_MASK_DEFAULT)) {
-        return;
+    rs.clearPushedRays();
+
+    for (int i = 0; i < lightsurf->samples.size(); i++) {
+        if (lightsurf->samples.occluded[i])
+            continue;
+
+        const qvec3d lightsurf_pos = lightsurf->samples.point[i];
+        const qvec3d lightsurf_normal = lightsurf->samples.normal[i];
+
+        qvec3f dir = lightsurf_pos - pos;
+        float dist = std::max(0.01f, qv::length(dir));
+        bool use_normal = true;
+
+        if (lightsurf->twosided) {
+            use_normal = false;
+            dir /= dist;
+        } else if (dist == 0.0f) {
+            dir = lightsurf_normal;
+            use_normal = false;
+        } else {
+            dir /= dist;
+        }
+
+        const qvec3f indirect = GetSurfaceLighting(
+            cfg, vpl, vpl_setting, dir, dist, lightsurf_normal, use_normal, standard_scale, sky_scale, hotspot_clamp);
+        if (!qv::gate(indirect, surflight_gate)) { // Each point contributes very little to the final result
+            rs.pushRay(i, pos, dir, dist, &indirect);
+        }
     }
 
-    for (const auto &surf_ptr : EmissiveLightSurfaces()) {
-        auto &vpl = *surf_ptr->vpl.get();
+    if (!rs.numPushedRays())
+        return;
 
-        for (const auto &vpl_setting : surf_ptr->vpl->styles) {
+    total_surflight_rays += rs.numPushedRays();
+    Profile_CountRays(rs.numPushedRays());
+    rs.tracePushedRaysOcclusion(lightsurf->modelinfo, CHANNEL_MASK_DEFAULT);
 
-            if (vpl_setting.bounce_level != bounce_depth)
-                continue;
-            else if (SurfaceLight_SphereCull(&vpl, lightsurf, vpl_setting, surflight_gate, hotspot_clamp))
-                continue;
+    const int lightmapstyle = vpl_setting.style;
+    lightmap_t *lightmap = Lightmap_ForStyle(lightmaps, lightmapstyle, lightsurf);
 
-            raystream_occlusion_t &rs = *lightsurf->occlusion_stream;
+    bool hit = false;
+    const int numrays = rs.numPushedRays();
+    for (int j = 0; j < numrays; j++) {
+        if (rs.getPushedRayOccluded(j))
+            continue;
 
-            for (int c = 0; c < vpl.points.size(); c++) {
-                if (light_options.visapprox.value() == visapprox_t::VIS &&
-                    VisCullEntity(bsp, lightsurf->pvs, vpl.leaves[c])) {
-                    continue;
-                }
+        const int i = rs.getPushedRayPointIndex(j);
+        qvec3f indirect = rs.getPushedRayColor(j);
 
-                rs.clearPushedRays();
+        //Q_assert(!std::isnan(indirect[0]));
 
-                for (int i = 0; i < lightsurf->samples.size(); i++) {
-                    const auto &sample = lightsurf->samples[i];
+        // Use dirt scaling on the surface lighting.
+        const vec_t dirtscale = Dirt_GetScaleFactor(cfg, lightsurf->samples.occlusion[i], nullptr, 0.0, lightsurf);
+        indirect *= dirtscale;
 
-                    if (sample.occluded)
-                        continue;
+        lightsample_t &sample = lightmap->samples[i];
+        sample.color += indirect;
+        lightmap->bounce_color += indirect;
 
-                    const qvec3d &lightsurf_pos = sample.point;
-                    const qvec3d &lightsurf_normal = sample.normal;
+        hit = true;
+        ++total_surflight_ray_hits;
+    }
 
-                    const qvec3f &pos = vpl.points[c];
-                    qvec3f dir = lightsurf_pos - pos;
-                    float dist = std::max(0.01f, qv::length(dir));
-                    bool use_normal = true;
+    // If surface light contributed anything, save.
+    if (hit)
+        Lightmap_Save(bsp, lightmaps, lightsurf, lightmap, lightmapstyle);
+}
 
-                    if (lightsurf->twosided) {
-                        use_normal = false;
-                        dir /= dist;
-                    } else if (dist == 0.0f) {
-                        dir = lightsurf_normal;
-                        use_normal = false;
-                    } else {
-                        dir /= dist;
-                    }
+/*
+ * -lightcuts path; shades a cut through the light trees built by BuildLightTrees
+ * for the current bounce level instead of every point.
+ */
+static void LightFace_SurfaceLightTree(const mbsp_t *bsp, lightsurf_t *lightsurf, lightmapdict_t *lightmaps,
+    std::optional<size_t> bounce_depth, const vec_t &standard_scale, const vec_t &sky_scale,
+    const float &hotspot_clamp, const float &surflight_gate)
+{
+    std::vector<uint32_t> cut;
 
-                    const qvec3f indirect = GetSurfaceLighting(cfg, vpl, vpl_setting, dir, dist, lightsurf_normal,
-                        use_normal, standard_scale, sky_scale, hotspot_clamp);
-                    if (!qv::gate(indirect, surflight_gate)) { // Each point contributes very little to the final result
-                        rs.pushRay(i, pos, dir, dist, &indirect);
-                    }
-                }
+    for (const lighttree_t &tree : LightTrees(bounce_depth)) {
+        const vec_t scale = tree.omnidirectional ? sky_scale : standard_scale;
+        LightTree_SelectCut(bsp, tree, lightsurf, scale, hotspot_clamp, surflight_gate, cut);
 
-                if (!rs.numPushedRays())
-                    continue;
+        total_lightcuts++;
+        total_lightcut_nodes += cut.size();
 
-                total_surflight_rays += rs.numPushedRays();
-                rs.tracePushedRaysOcclusion(lightsurf->modelinfo, CHANNEL_MASK_DEFAULT);
+        for (uint32_t nodenum : cut) {
+            const lighttree_node_t &node = tree.nodes[nodenum];
+            const lighttree_emitter_t &rep = tree.emitters[node.rep];
 
-                const int lightmapstyle = vpl_setting.style;
-                lightmap_t *lightmap = Lightmap_ForStyle(lightmaps, lightmapstyle, lightsurf);
+            if (node.count) {
+                LightFace_SurfaceLightPoint(bsp, lightsurf, lightmaps, *rep.vpl, *rep.setting, rep.pos,
+                    standard_scale, sky_scale, hotspot_clamp, surflight_gate);
+                continue;
+            }
 
-                bool hit = false;
-                const int numrays = rs.numPushedRays();
-                for (int j = 0; j < numrays; j++) {
-                    if (rs.getPushedRayOccluded(j))
-                        continue;
+            // the representative emits the power of the whole cluster
+            surfacelight_t::per_style_t cluster_setting = *rep.setting;
+            cluster_setting.color = node.power;
+            cluster_setting.intensity = 1.0f;
 
-                    const int i = rs.getPushedRayPointIndex(j);
-                    qvec3f indirect = rs.getPushedRayColor(j);
+            LightFace_SurfaceLightPoint(bsp, lightsurf, lightmaps, *rep.vpl, cluster_setting, rep.pos,
+                standard_scale, sky_scale, hotspot_clamp, surflight_gate);
+        }
+    }
+}
 
-                    //Q_assert(!std::isnan(indirect[0]));
+static void // mxd
+LightFace_SurfaceLight(const mbsp_t *bsp, lightsurf_t *lightsurf, lightmapdict_t *lightmaps, std::optional<size_t> bounce_depth,
+    const vec_t &standard_scale, const vec_t &sky_scale, const float &hotspot_clamp)
+{
+    const float surflight_gate = 0.01f;
+
+    // check lighting channels (currently surface lights are always on CHANNEL_MASK_DEFAULT)
+    if (!(lightsurf->object_channel_mask & CHANNEL_MASK_DEFAULT)) {
+        return;
+    }
+
+    if (light_options.lightcuts.value() > 0) {
+        LightFace_SurfaceLightTree(
+            bsp, lightsurf, lightmaps, bounce_depth, standard_scale, sky_scale, hotspot_clamp, surflight_gate);
+        return;
+    }
 
-                    // Use dirt scaling on the surface lighting.
-                    const vec_t dirtscale =
-                        Dirt_GetScaleFactor(cfg, lightsurf->samples[i].occlusion, nullptr, 0.0, lightsurf);
-                    indirect *= dirtscale;
+    for (const auto &surf_ptr : EmissiveLightSurfaces()) {
+        auto &vpl = *surf_ptr->vpl.get();
 
-                    lightsample_t &sample = lightmap->samples[i];
-                    sample.color += indirect;
-                    lightmap->bounce_color += indirect;
+        for (const auto &vpl_setting : surf_ptr->vpl->styles) {
 
-                    hit = true;
-                    ++total_surflight_ray_hits;
+            if (vpl_setting.bounce_level != bounce_depth)
+                continue;
+            else if (SurfaceLight_SphereCull(&vpl, lightsurf, vpl_setting, surflight_gate, hotspot_clamp))
+                continue;
+
+            for (int c = 0; c < vpl.points.size(); c++) {
+                if (light_options.visapprox.value() == visapprox_t::VIS &&
+                    VisCullEntity(bsp, lightsurf->pvs, vpl.leaves[c])) {
+                    continue;
                 }
 
-                // If surface light contributed anything, save.
-                if (hit)
-                    Lightmap_Save(bsp, lightmaps, lightsurf, lightmap, lightmapstyle);
+                LightFace_SurfaceLightPoint(bsp, lightsurf, lightmaps, vpl, vpl_setting, vpl.points[c],
+                    standard_scale, sky_scale, hotspot_clamp, surflight_gate);
             }
         }
     }
@@ -2146,15 +2238,14 @@ static void LightFace_OccludedDebug(const mbsp_t *bsp, lightsurf_t *lightsurf, l
 
     /* Overwrite each point, red=occluded, green=ok */
     for (int i = 0; i < lightsurf->samples.size(); i++) {
-        auto &surf_sample = lightsurf->samples[i];
         lightsample_t &sample = lightmap->samples[i];
-        if (surf_sample.occluded) {
+        if (lightsurf->samples.occluded[i]) {
             sample.color = {255, 0, 0};
         } else {
             sample.color = {0, 255, 0};
         }
         // N.B.: Mark it as un-occluded now, to disable special handling later in the -extra/-extra4 downscaling code
-        surf_sample.occluded = false;
+        lightsurf->samples.occluded[i] = false;
     }
 
     Lightmap_Save(bsp, lightmaps, lightsurf, lightmap, 0);
@@ -2175,7 +2266,7 @@ static void LightFace_DebugNeighbours(const mbsp_t *bsp, lightsurf_t *lightsurf,
 
     bool has_sample_on_dumpface = false;
     for (int i = 0; i < lightsurf->samples.size(); i++) {
-        if (lightsurf->samples[i].realfacenum == dump_facenum) {
+        if (lightsurf->samples.realfacenum[i] == dump_facenum) {
             has_sample_on_dumpface = true;
             break;
         }
@@ -2184,7 +2275,7 @@ static void LightFace_DebugNeighbours(const mbsp_t *bsp, lightsurf_t *lightsurf,
     /* Overwrite each point */
     for (int i = 0; i < lightsurf->samples.size(); i++) {
         lightsample_t &sample = lightmap->samples[i];
-        const int &sample_face = lightsurf->samples[i].realfacenum;
+        const int &sample_face = lightsurf->samples.realfacenum[i];
 
         if (sample_face == dump_facenum) {
             /* Red - the sample is on the selected face */
@@ -2196,7 +2287,7 @@ static void LightFace_DebugNeighbours(const mbsp_t *bsp, lightsurf_t *lightsurf,
             sample.color = {};
         }
         // N.B.: Mark it as un-occluded now, to disable special handling later in the -extra/-extra4 downscaling code
-        lightsurf->samples[i].occluded = false;
+        lightsurf->samples.occluded[i] = false;
     }
 
     Lightmap_Save(bsp, lightmaps, lightsurf, lightmap, 0);
@@ -2315,12 +2406,12 @@ static void LightFace_CalculateDirt(lightsurf_t *lightsurf)
 
     // init
     for (int i = 0; i < lightsurf->samples.size(); i++) {
-        lightsurf->samples[i].occlusion = 0;
+        lightsurf->samples.occlusion[i] = 0;
     }
 
     // this stuff is just per-point
     for (int i = 0; i < lightsurf->samples.size(); i++) {
-        const auto [tangent, bitangent] = qv::MakeTangentAndBitangentUnnormalized(lightsurf->samples[i].normal);
+        const auto [tangent, bitangent] = qv::MakeTangentAndBitangentUnnormalized(lightsurf->samples.normal[i]);
 
         myUps[i] = qv::normalize(tangent);
         myRts[i] = qv::normalize(bitangent);
@@ -2333,15 +2424,13 @@ static void LightFace_CalculateDirt(lightsurf_t *lightsurf)
         // fill in input buffers
 
         for (int i = 0; i < lightsurf->samples.size(); i++) {
-            const auto &sample = lightsurf->samples[i];
-
-            if (sample.occluded)
+            if (lightsurf->samples.occluded[i])
                 continue;
 
             qvec3d dirtvec = GetDirtVector(cfg, j);
-            qvec3d dir = TransformToTangentSpace(sample.normal, myUps[i], myRts[i], dirtvec);
+            qvec3d dir = TransformToTangentSpace(lightsurf->samples.normal[i], myUps[i], myRts[i], dirtvec);
 
-            rs.pushRay(i, sample.point, dir, cfg.dirtdepth.value());
+            rs.pushRay(i, lightsurf->samples.point[i], dir, cfg.dirtdepth.value());
         }
 
         // trace the batch. need closest hit for dirt, so intersection.
@@ -2349,23 +2438,24 @@ static void LightFace_CalculateDirt(lightsurf_t *lightsurf)
         // use the model's own channel mask as the shadow mask, e.g. so a model in channel 2's AO rays will only hit
         // other things in channel 2
         rs.tracePushedRaysIntersection(lightsurf->modelinfo, lightsurf->object_channel_mask);
+        Profile_CountRays(rs.numPushedRays());
 
         // accumulate hitdists
         for (int k = 0; k < rs.numPushedRays(); k++) {
             const int i = rs.getPushedRayPointIndex(k);
             if (rs.getPushedRayHitType(k) == hittype_t::SOLID) {
                 vec_t dist = rs.getPushedRayHitDist(k);
-                lightsurf->samples[i].occlusion += std::min(cfg.dirtdepth.value(), dist);
+                lightsurf->samples.occlusion[i] += std::min(cfg.dirtdepth.value(), dist);
             } else {
-                lightsurf->samples[i].occlusion += cfg.dirtdepth.value();
+                lightsurf->samples.occlusion[i] += cfg.dirtdepth.value();
             }
         }
     }
 
     // process the results.
     for (int i = 0; i < lightsurf->samples.size(); i++) {
-        vec_t avgHitdist = lightsurf->samples[i].occlusion / (float)numDirtVectors;
-        lightsurf->samples[i].occlusion = 1.0 - (avgHitdist / cfg.dirtdepth.value());
+        vec_t avgHitdist = lightsurf->samples.occlusion[i] / (float)numDirtVectors;
+        lightsurf->samples.occlusion[i] = 1.0 - (avgHitdist / cfg.dirtdepth.value());
     }
 }
 
@@ -2584,7 +2674,7 @@ static std::vector<qvec4f> LightmapColorsToGLMVector(const lightsurf_t *lightsur
     std::vector<qvec4f> res;
     for (int i = 0; i < lightsurf->samples.size(); i++) {
         const qvec3d &color = lm->samples[i].color;
-        const float alpha = lightsurf->samples[i].occluded ? 0.0f : 1.0f;
+        const float alpha = lightsurf->samples.occluded[i] ? 0.0f : 1.0f;
         res.emplace_back(color[0], color[1], color[2], alpha);
     }
     return res;
@@ -2595,7 +2685,7 @@ static std::vector<qvec4f> LightmapNormalsToGLMVector(const lightsurf_t *lightsu
     std::vector<qvec4f> res;
     for (int i = 0; i < lightsurf->samples.size(); i++) {
         const qvec3d &color = lm->samples[i].direction;
-        const float alpha = lightsurf->samples[i].occluded ? 0.0f : 1.0f;
+        const float alpha = lightsurf->samples.occluded[i] ? 0.0f : 1.0f;
         res.emplace_back(color[0], color[1], color[2], alpha);
     }
     return res;
@@ -3062,61 +3152,21 @@ static void WriteSingleLightmap_FromDecoupled(const mbsp_t *bsp, const mface_t *
     }
 }
 
-void SaveLightmapSurface(const mbsp_t *bsp, mface_t *face, facesup_t *facesup,
+lightmap_save_t PlanLightmapSurface(const mbsp_t *bsp, mface_t *face, facesup_t *facesup,
     bspx_decoupled_lm_perface *facesup_decoupled, lightsurf_t *lightsurf, const faceextents_t &extents,
     const faceextents_t &output_extents)
 {
-    lightmapdict_t &lightmaps = lightsurf->lightmapsByStyle;
-    const int actual_width = extents.width();
-    const int actual_height = extents.height();
-    const int output_width = output_extents.width();
-    const int output_height = output_extents.height();
-    const int size = output_extents.numsamples();
+    lightmap_save_t save{face, facesup, facesup_decoupled, lightsurf, &extents, &output_extents};
 
     if (light_options.litonly.value()) {
-        // special case for writing a .lit for a bsp without modifying the bsp.
-        // involves looking at which styles were written to the bsp in the previous lighting run, and then
-        // writing the same styles to the same offsets in the .lit file.
-
-        if (face->lightofs == -1) {
-            // nothing to write for this face
-            return;
-        }
-
-        uint8_t *out, *lit, *lux;
-        GetFileSpace_PreserveOffsetInBsp(&out, &lit, &lux, face->lightofs);
-
-        for (int mapnum = 0; mapnum < MAXLIGHTMAPS; mapnum++) {
-            const int style = face->styles[mapnum];
-
-            if (style == 255) {
-                break; // all done for this face
-            }
-
-            // see if we have computed lighting for this style
-            for (const lightmap_t &lm : lightmaps) {
-                if (lm.style == style) {
-                    WriteSingleLightmap(
-                        bsp, face, lightsurf, &lm, actual_width, actual_height, out, lit, lux, output_extents);
-                    break;
-                }
-            }
-            // if we didn't find a matching lightmap, just don't write anything
-
-            if (out) {
-                out += size;
-            }
-            if (lit) {
-                lit += (size * 4); // SlartHDR: Was (* 3)
-            }
-            if (lux) {
-                lux += (size * 3);
-            }
-        }
-
-        return;
+        // written by WriteLightmapSurface, to the offsets already in the bsp
+        return save;
     }
 
+    lightmapdict_t &lightmaps = lightsurf->lightmapsByStyle;
+    const int output_width = output_extents.width();
+    const int output_height = output_extents.height();
+
     size_t maxfstyles = std::min((size_t)light_options.facestyles.value(), facesup ? MAXLIGHTMAPSSUP : MAXLIGHTMAPS);
     int maxstyle = facesup ? INVALID_LIGHTSTYLE : INVALID_LIGHTSTYLE_OLD;
 
@@ -3132,16 +3182,16 @@ void SaveLightmapSurface(const mbsp_t *bsp, mface_t *face, facesup_t *facesup,
                 if (IsOutputtingSupplementaryData()) {
                     logging::print(
                         "INFO: a face has exceeded max light style id ({});\n LMSTYLE16 will be output to hold the non-truncated data.\n Use -verbose to find which faces.\n",
-                        maxstyle, lightsurf->samples[0].point);
+                        maxstyle, lightsurf->samples.point[0]);
                 } else {
                     logging::print(
                         "WARNING: a face has exceeded max light style id ({}). Use -verbose to find which faces.\n",
-                        maxstyle, lightsurf->samples[0].point);
+                        maxstyle, lightsurf->samples.point[0]);
                 }
                 warned_about_light_style_overflow = true;
             }
             logging::print(logging::flag::VERBOSE, "WARNING: Style {} too high on face near {}\n", lightmap.style,
-                lightsurf->samples[0].point);
+                lightsurf->samples.point[0]);
             continue;
         }
 
@@ -3163,9 +3213,7 @@ void SaveLightmapSurface(const mbsp_t *bsp, mface_t *face, facesup_t *facesup,
         if (!sortable.size()) {
             lightmap_t *lm = Lightmap_ForStyle(&lightmaps, 0, lightsurf);
             lm->style = 0;
-            for (auto &sample : lightsurf->samples) {
-                sample.occluded = false;
-            }
+            std::fill(lightsurf->samples.occluded.begin(), lightsurf->samples.occluded.end(), false);
             sortable.emplace_back(0, lm);
         }
     }
@@ -3181,17 +3229,17 @@ void SaveLightmapSurface(const mbsp_t *bsp, mface_t *face, facesup_t *facesup,
                 if (IsOutputtingSupplementaryData()) {
                     logging::print(
                         "INFO: a face has exceeded max light styles ({});\n LMSTYLE/LMSTYLE16 will be output to hold the non-truncated data.\n Use -verbose to find which faces.\n",
-                        maxfstyles, lightsurf->samples[0].point);
+                        maxfstyles, lightsurf->samples.point[0]);
                 } else {
                     logging::print(
                         "WARNING: a face has exceeded max light styles ({}). Use -verbose to find which faces.\n",
-                        maxfstyles, lightsurf->samples[0].point);
+                        maxfstyles, lightsurf->samples.point[0]);
                 }
                 warned_about_light_map_overflow = true;
             }
             logging::print(logging::flag::VERBOSE,
                 "WARNING: {} light styles (max {}) on face near {}; styles: ", sortable.size(), maxfstyles,
-                lightsurf->samples[0].point);
+                lightsurf->samples.point[0]);
             for (auto &p : sortable) {
                 logging::print(logging::flag::VERBOSE, "{} ", p.second->style);
             }
@@ -3240,37 +3288,124 @@ void SaveLightmapSurface(const mbsp_t *bsp, mface_t *face, facesup_t *facesup,
         }
     }
 
-    if (!numstyles)
+    save.sorted = std::move(sorted);
+    return save;
+}
+
+void AllocateLightmapSurface(const mbsp_t *bsp, lightmap_save_t &save)
+{
+    const int numstyles = static_cast<int>(save.sorted.size());
+
+    if (light_options.litonly.value() || !numstyles) {
         return;
+    }
 
-    uint8_t *out, *lit, *lux;
-    GetFileSpace(&out, &lit, &lux, size * numstyles);
+    mface_t *face = save.face;
+
+    GetFileSpace(&save.out, &save.lit, &save.lux, save.output_extents->numsamples() * numstyles);
 
     int lightofs;
 
     // Q2/HL native colored lightmaps
     if (bsp->loadversion->game->has_rgb_lightmap) {
-        lightofs = lit - lit_filebase.data();
+        lightofs = save.lit - lit_filebase.data();
     } else {
-        lightofs = out - filebase.data();
+        lightofs = save.out - filebase.data();
     }
 
-    if (facesup_decoupled) {
-        facesup_decoupled->offset = lightofs;
+    if (save.facesup_decoupled) {
+        save.facesup_decoupled->offset = lightofs;
         face->lightofs = -1;
-    } else if (facesup) {
-        facesup->lightofs = lightofs;
+    } else if (save.facesup) {
+        save.facesup->lightofs = lightofs;
     } else {
         face->lightofs = lightofs;
     }
 
+    // vanilla lightmap if -world_units_per_luxel is in use but not -novanilla
+    if (save.facesup_decoupled && !light_options.novanilla.value()) {
+        GetFileSpace(&save.vanilla_out, &save.vanilla_lit, &save.vanilla_lux,
+            save.lightsurf->vanilla_extents.numsamples() * numstyles);
+
+        // Q2/HL native colored lightmaps
+        if (bsp->loadversion->game->has_rgb_lightmap) {
+            lightofs = save.vanilla_lit - lit_filebase.data();
+        } else {
+            lightofs = save.vanilla_out - filebase.data();
+        }
+        face->lightofs = lightofs;
+    }
+}
+
+void WriteLightmapSurface(const mbsp_t *bsp, const lightmap_save_t &save)
+{
+    mface_t *face = save.face;
+    lightsurf_t *lightsurf = save.lightsurf;
+    const faceextents_t &output_extents = *save.output_extents;
+    const int actual_width = save.extents->width();
+    const int actual_height = save.extents->height();
+    const int size = output_extents.numsamples();
+
+    if (light_options.litonly.value()) {
+        // special case for writing a .lit for a bsp without modifying the bsp.
+        // involves looking at which styles were written to the bsp in the previous lighting run, and then
+        // writing the same styles to the same offsets in the .lit file.
+
+        if (face->lightofs == -1) {
+            // nothing to write for this face
+            return;
+        }
+
+        const lightmapdict_t &lightmaps = lightsurf->lightmapsByStyle;
+        uint8_t *out, *lit, *lux;
+        GetFileSpace_PreserveOffsetInBsp(&out, &lit, &lux, face->lightofs);
+
+        for (int mapnum = 0; mapnum < MAXLIGHTMAPS; mapnum++) {
+            const int style = face->styles[mapnum];
+
+            if (style == 255) {
+                break; // all done for this face
+            }
+
+            // see if we have computed lighting for this style
+            for (const lightmap_t &lm : lightmaps) {
+                if (lm.style == style) {
+                    WriteSingleLightmap(
+                        bsp, face, lightsurf, &lm, actual_width, actual_height, out, lit, lux, output_extents);
+                    break;
+                }
+            }
+            // if we didn't find a matching lightmap, just don't write anything
+
+            if (out) {
+                out += size;
+            }
+            if (lit) {
+                lit += (size * 4); // SlartHDR: Was (* 3)
+            }
+            if (lux) {
+                lux += (size * 3);
+            }
+        }
+
+        return;
+    }
+
+
+    const int numstyles = static_cast<int>(save.sorted.size());
+
+    if (!numstyles)
+        return;
+
     // sanity check that we don't save a lightmap for a non-lightmapped face
     {
         Q_assert(Face_IsLightmapped(bsp, face));
     }
 
+    uint8_t *out = save.out, *lit = save.lit, *lux = save.lux;
+
     for (int mapnum = 0; mapnum < numstyles; mapnum++) {
-        const lightmap_t *lm = sorted.at(mapnum);
+        const lightmap_t *lm = save.sorted.at(mapnum);
 
         WriteSingleLightmap(bsp, face, lightsurf, lm, actual_width, actual_height, out, lit, lux, output_extents);
 
@@ -3286,20 +3421,13 @@ void SaveLightmapSurface(const mbsp_t *bsp, mface_t *face, facesup_t *facesup,
     }
 
     // write vanilla lightmap if -world_units_per_luxel is in use but not -novanilla
-    if (facesup_decoupled && !light_options.novanilla.value()) {
-        // FIXME: duplicates some code from above
-        GetFileSpace(&out, &lit, &lux, lightsurf->vanilla_extents.numsamples() * numstyles);
-
-        // Q2/HL native colored lightmaps
-        if (bsp->loadversion->game->has_rgb_lightmap) {
-            lightofs = lit - lit_filebase.data();
-        } else {
-            lightofs = out - filebase.data();
-        }
-        face->lightofs = lightofs;
+    if (save.facesup_decoupled && !light_options.novanilla.value()) {
+        out = save.vanilla_out;
+        lit = save.vanilla_lit;
+        lux = save.vanilla_lux;
 
         for (int mapnum = 0; mapnum < numstyles; mapnum++) {
-            const lightmap_t *lm = sorted.at(mapnum);
+            const lightmap_t *lm = save.sorted.at(mapnum);
 
             WriteSingleLightmap_FromDecoupled(bsp, face, lightsurf, lm, lightsurf->vanilla_extents.width(),
                 lightsurf->vanilla_extents.height(), out, lit, lux);
@@ -3338,12 +3466,303 @@ std::unique_ptr<lightsurf_t> CreateLightmapSurface(const mbsp_t *bsp, const mfac
     return Lightsurf_Init(modelinfo, cfg, face, bsp, facesup, facesup_decoupled);
 }
 
+/*
+ * -wavefront: per-thread queues for the point light rays
+ */
+constexpr size_t WAVEFRONT_QUEUE_SIZE = 16384;
+
+static void LightFace_EntityScatter(entity_ray_payload_t &payload, const qvec3f &color, int dynamic_style)
+{
+    lightsurf_t *lightsurf = payload.lightsurf;
+    lightmapdict_t *lightmaps = &lightsurf->lightmapsByStyle;
+
+    total_light_ray_hits++;
+
+    // see LightFace_Entity
+    int desired_style = payload.entity->style.value();
+    if (desired_style == 0) {
+        desired_style = dynamic_style;
+    }
+
+    lightmap_t *lightmap = Lightmap_ForStyle(lightmaps, desired_style, lightsurf);
+    lightsample_t &sample = lightmap->samples[payload.point];
+
+    sample.color += color;
+    lightmap->bounce_color += color;
+    sample.direction += payload.normalcontrib;
+
+    Lightmap_Save(lightsurf->bsp, lightmaps, lightsurf, lightmap, desired_style);
+}
+
+static tbb::enumerable_thread_specific<light_wavefront_t> light_wavefronts(
+    [] { return light_wavefront_t(WAVEFRONT_QUEUE_SIZE, LightFace_EntityScatter); });
+
+/*
+ * ============
+ * -adaptive
+ *
+ * The direct lighting runs in two passes. The first lights one sample per
+ * luxel, the others being masked out by temporarily marking them occluded.
+ * The second lights the remaining samples of the luxels that need it; the
+ * other luxels get their one sample copied over, so the downsample in
+ * WriteSingleLightmap averages them back to that value.
+ * ============
+ */
+static bool Adaptive_UseForSurface(const lightsurf_t &lightsurf)
+{
+    return DirectLightPasses() > 1 && !lightsurf.samples.empty();
+}
+
+// calls fn(sample index) for each sample of the given output luxel
+template<typename F>
+static void Adaptive_ForEachLuxelSample(const lightsurf_t &lightsurf, int luxel, F &&fn)
+{
+    const int extra = light_options.extra.value();
+    const int luxels_wide = lightsurf.width / extra;
+    const int s0 = (luxel % luxels_wide) * extra;
+    const int t0 = (luxel / luxels_wide) * extra;
+
+    for (int t = t0; t < t0 + extra; t++) {
+        for (int s = s0; s < s0 + extra; s++) {
+            fn(t * lightsurf.width + s);
+        }
+    }
+}
+
+static void Adaptive_SetupFirstPass(lightsurf_t &lightsurf)
+{
+    const int extra = light_options.extra.value();
+    const int num_luxels = (lightsurf.width / extra) * (lightsurf.height / extra);
+
+    auto adaptive = std::make_unique<lightsurf_t::adaptive_t>();
+    adaptive->occluded = lightsurf.samples.occluded;
+    adaptive->rep.assign(num_luxels, -1);
+
+    std::fill(lightsurf.samples.occluded.begin(), lightsurf.samples.occluded.end(), true);
+
+    for (int luxel = 0; luxel < num_luxels; luxel++) {
+        int &rep = adaptive->rep[luxel];
+        int middle = -1;
+        int n = 0;
+
+        // prefer the sample in the middle of the luxel, otherwise the first unoccluded one
+        Adaptive_ForEachLuxelSample(lightsurf, luxel, [&](int i) {
+            if (n++ == (extra / 2) * extra + (extra / 2)) {
+                middle = i;
+            }
+            if (rep == -1 && !adaptive->occluded[i]) {
+                rep = i;
+            }
+        });
+
+        if (rep != -1 && !adaptive->occluded[middle]) {
+            rep = middle;
+        }
+        if (rep != -1) {
+            lightsurf.samples.occluded[rep] = false;
+        }
+    }
+
+    lightsurf.adaptive = std::move(adaptive);
+}
+
+static void Adaptive_SetupSecondPass(lightsurf_t &lightsurf)
+{
+    auto &adaptive = *lightsurf.adaptive;
+    auto &samples = lightsurf.samples;
+    const int extra = light_options.extra.value();
+    const int luxels_wide = lightsurf.width / extra;
+    const int luxels_tall = lightsurf.height / extra;
+    const float threshold = light_options.adaptive.value();
+
+    adaptive.occlusion = samples.occlusion;
+
+    // do the first pass results of the two samples differ enough to need supersampling?
+    auto differs = [&](int a, int b) {
+        for (const lightmap_t &lm : lightsurf.lightmapsByStyle) {
+            if (lm.style == INVALID_LIGHTSTYLE) {
+                continue;
+            }
+            const float ba = LightSample_Brightness(lm.samples[a].color);
+            const float bb = LightSample_Brightness(lm.samples[b].color);
+            if (fabs(ba - bb) > threshold * std::max({ba, bb, 1.0f})) {
+                return true;
+            }
+        }
+        return dirt_in_use && fabs(samples.occlusion[a] - samples.occlusion[b]) > threshold;
+    };
+
+    adaptive.refined.assign(adaptive.rep.size(), false);
+    adaptive.num_refined = 0;
+
+    size_t num_lit = 0;
+
+    for (int luxel = 0; luxel < adaptive.rep.size(); luxel++) {
+        const int rep = adaptive.rep[luxel];
+
+        if (rep == -1) {
+            continue;
+        }
+
+        num_lit++;
+
+        // straddles an occluded or phong/face boundary
+        bool refine = false;
+        Adaptive_ForEachLuxelSample(lightsurf, luxel, [&](int i) {
+            refine = refine || adaptive.occluded[i] || samples.realfacenum[i] != samples.realfacenum[rep];
+        });
+
+        // lighting or dirt edge between this luxel and one of its neighbours
+        const int s = luxel % luxels_wide;
+        const int t = luxel / luxels_wide;
+        auto check = [&](int other) {
+            refine = refine || (adaptive.rep[other] != -1 && differs(rep, adaptive.rep[other]));
+        };
+
+        if (s > 0)
+            check(luxel - 1);
+        if (s + 1 < luxels_wide)
+            check(luxel + 1);
+        if (t > 0)
+            check(luxel - luxels_wide);
+        if (t + 1 < luxels_tall)
+            check(luxel + luxels_wide);
+
+        if (refine) {
+            adaptive.refined[luxel] = true;
+            adaptive.num_refined++;
+        }
+    }
+
+    // unmask the samples of the refined luxels that haven't been lit yet
+    std::fill(samples.occluded.begin(), samples.occluded.end(), true);
+
+    for (int luxel = 0; luxel < adaptive.rep.size(); luxel++) {
+        if (!adaptive.refined[luxel]) {
+            continue;
+        }
+        Adaptive_ForEachLuxelSample(lightsurf, luxel, [&](int i) {
+            if (i != adaptive.rep[luxel] && !adaptive.occluded[i]) {
+                samples.occluded[i] = false;
+            }
+        });
+    }
+
+    total_adaptive_luxels += num_lit;
+    total_adaptive_refined += adaptive.num_refined;
+}
+
+// call before LightFace_LocalMin of the first pass, the one direct light
+// that doesn't add to bounce_color
+static void Adaptive_SaveBounceColors(lightsurf_t &lightsurf)
+{
+    if (!lightsurf.adaptive || !lightsurf.adaptive->refined.empty()) {
+        return;
+    }
+
+    auto &adaptive = *lightsurf.adaptive;
+
+    for (const lightmap_t &lm : lightsurf.lightmapsByStyle) {
+        if (lm.style == INVALID_LIGHTSTYLE) {
+            continue;
+        }
+
+        auto &colors = adaptive.bounce_colors[lm.style];
+        colors.resize(lightsurf.samples.size());
+
+        for (int rep : adaptive.rep) {
+            if (rep != -1) {
+                colors[rep] = lm.samples[rep].color;
+            }
+        }
+    }
+}
+
+static void Adaptive_Finish(lightsurf_t &lightsurf)
+{
+    auto &adaptive = *lightsurf.adaptive;
+    auto &samples = lightsurf.samples;
+
+    for (int luxel = 0; luxel < adaptive.rep.size(); luxel++) {
+        const int rep = adaptive.rep[luxel];
+        const bool refined = adaptive.refined[luxel];
+
+        Adaptive_ForEachLuxelSample(lightsurf, luxel, [&](int i) {
+            samples.occluded[i] = adaptive.occluded[i];
+
+            if (refined && i != rep && !adaptive.occluded[i]) {
+                // lit in the second pass
+                return;
+            }
+
+            // the second pass dirt calculation overwrites the rest
+            samples.occlusion[i] = adaptive.occlusion[i];
+
+            if (refined || rep == -1 || i == rep || adaptive.occluded[i]) {
+                return;
+            }
+
+            samples.occlusion[i] = samples.occlusion[rep];
+
+            for (lightmap_t &lm : lightsurf.lightmapsByStyle) {
+                if (lm.style == INVALID_LIGHTSTYLE) {
+                    continue;
+                }
+                lm.samples[i] = lm.samples[rep];
+
+                // as if lit: minlight doesn't bounce
+                if (auto it = adaptive.bounce_colors.find(lm.style); it != adaptive.bounce_colors.end()) {
+                    lm.bounce_color += it->second[rep];
+                }
+            }
+        });
+    }
+
+    lightsurf.adaptive.reset();
+}
+
+static void Adaptive_BeginPass(lightsurf_t &lightsurf, int pass)
+{
+    if (!Adaptive_UseForSurface(lightsurf)) {
+        return;
+    }
+
+    if (pass == 0) {
+        Adaptive_SetupFirstPass(lightsurf);
+    } else {
+        Adaptive_SetupSecondPass(lightsurf);
+    }
+}
+
+static bool Adaptive_PassActive(const lightsurf_t &lightsurf, int pass)
+{
+    return pass == 0 || (lightsurf.adaptive && lightsurf.adaptive->num_refined);
+}
+
+static void Adaptive_EndPass(lightsurf_t &lightsurf, int pass)
+{
+    if (lightsurf.adaptive && pass == DirectLightPasses() - 1) {
+        Adaptive_Finish(lightsurf);
+    }
+}
+
+int DirectLightPasses()
+{
+    return (light_options.adaptive.value() > 0 && light_options.extra.value() > 1 &&
+               light_options.DebugModeLights())
+               ? 2
+               : 1;
+}
+
 /*
  * ============
  * LightFace
+ *
+ * the point light pass is split out so -wavefront can queue it
  * ============
  */
-void DirectLightFace(const mbsp_t *bsp, lightsurf_t &lightsurf, const settings::worldspawn_keys &cfg)
+static void DirectLightFace_Begin(
+    const mbsp_t *bsp, lightsurf_t &lightsurf, const settings::worldspawn_keys &cfg, light_wavefront_t *wavefront)
 {
     auto face = lightsurf.face;
     const modelinfo_t *modelinfo = ModelInfoForFace(bsp, Face_GetNum(bsp, face));
@@ -3351,8 +3770,10 @@ void DirectLightFace(const mbsp_t *bsp, lightsurf_t &lightsurf, const settings::
     lightmapdict_t *lightmaps = &lightsurf.lightmapsByStyle;
 
     /* calculate dirt (ambient occlusion) but don't use it yet */
-    if (dirt_in_use && (light_options.debugmode != debugmodes::phong))
+    if (dirt_in_use && (light_options.debugmode != debugmodes::phong)) {
+        profile_scope_t scope(bsp, &lightsurf, profile_stage_t::dirt);
         LightFace_CalculateDirt(&lightsurf);
+    }
 
     /*
      * The lighting procedure is: cast all positive lights, fix
@@ -3360,7 +3781,7 @@ void DirectLightFace(const mbsp_t *bsp, lightsurf_t &lightsurf, const settings::
      * clamp any values that may have gone negative.
      */
 
-    if (light_options.debugmode == debugmodes::none) {
+    if (light_options.DebugModeLights()) {
 
         total_samplepoints += lightsurf.samples.size();
 
@@ -3368,24 +3789,59 @@ void DirectLightFace(const mbsp_t *bsp, lightsurf_t &lightsurf, const settings::
 
         /* positive lights */
         if (!(modelinfo->lightignore.value() || extended_flags.light_ignore)) {
-            for (const auto &entity : GetLights()) {
+            const auto &all_lights = GetLights();
+            std::vector<uint32_t> candidate_lights;
+            LightIndex_CandidateLights(lightsurf, candidate_lights);
+
+            if (light_options.verifylightindex.value()) {
+                LightIndex_MissedLights(bsp, lightsurf, candidate_lights);
+            }
+
+            for (uint32_t lightnum : candidate_lights) {
+                const auto &entity = all_lights[lightnum];
                 if (entity->getFormula() == LF_LOCALMIN)
                     continue;
                 if (entity->nostaticlight.value())
                     continue;
-                if (entity->light.value() > 0)
-                    LightFace_Entity(bsp, entity.get(), &lightsurf, lightmaps);
+                if (entity->light.value() > 0) {
+                    profile_scope_t scope(bsp, &lightsurf, profile_stage_t::entity, lightnum);
+                    LightFace_Entity(bsp, entity.get(), &lightsurf, lightmaps, wavefront);
+                }
+            }
+        }
+    }
+}
+
+static void DirectLightFace_End(const mbsp_t *bsp, lightsurf_t &lightsurf, const settings::worldspawn_keys &cfg)
+{
+    auto face = lightsurf.face;
+    const modelinfo_t *modelinfo = ModelInfoForFace(bsp, Face_GetNum(bsp, face));
+
+    lightmapdict_t *lightmaps = &lightsurf.lightmapsByStyle;
+
+    if (light_options.DebugModeLights()) {
+
+        const surfflags_t &extended_flags = extended_texinfo_flags[face->texinfo];
+
+        /* positive lights */
+        if (!(modelinfo->lightignore.value() || extended_flags.light_ignore)) {
+            {
+                profile_scope_t scope(bsp, &lightsurf, profile_stage_t::sky);
+                for (const sun_t &sun : GetSuns())
+                    if (sun.sunlight > 0)
+                        LightFace_Sky(bsp, &sun, &lightsurf, lightmaps);
             }
-            for (const sun_t &sun : GetSuns())
-                if (sun.sunlight > 0)
-                    LightFace_Sky(bsp, &sun, &lightsurf, lightmaps);
 
             // mxd. Add surface lights...
             // FIXME: negative surface lights
+            profile_scope_t scope(bsp, &lightsurf, profile_stage_t::surface);
             LightFace_SurfaceLight(
                 bsp, &lightsurf, lightmaps, std::nullopt, cfg.surflightscale.value(), cfg.surflightskyscale.value(), 16.0f);
         }
 
+        Adaptive_SaveBounceColors(lightsurf);
+
+        profile_scope_t scope(bsp, &lightsurf, profile_stage_t::postprocess);
         LightFace_LocalMin(bsp, face, &lightsurf, lightmaps);
     }
 
@@ -3403,6 +3859,50 @@ void DirectLightFace(const mbsp_t *bsp, lightsurf_t &lightsurf, const settings::
         LightFace_DebugNeighbours(bsp, &lightsurf, lightmaps);
 }
 
+void DirectLightFace(const mbsp_t *bsp, lightsurf_t &lightsurf, const settings::worldspawn_keys &cfg)
+{
+    for (int pass = 0; pass < DirectLightPasses(); pass++) {
+        Adaptive_BeginPass(lightsurf, pass);
+
+        if (Adaptive_PassActive(lightsurf, pass)) {
+            DirectLightFace_Begin(bsp, lightsurf, cfg, nullptr);
+            DirectLightFace_End(bsp, lightsurf, cfg);
+        }
+
+        Adaptive_EndPass(lightsurf, pass);
+    }
+}
+
+void QueueDirectLightFace(const mbsp_t *bsp, lightsurf_t &lightsurf, const settings::worldspawn_keys &cfg, int pass)
+{
+    Adaptive_BeginPass(lightsurf, pass);
+
+    if (Adaptive_PassActive(lightsurf, pass)) {
+        DirectLightFace_Begin(bsp, lightsurf, cfg, &light_wavefronts.local());
+    }
+}
+
+void FlushDirectLightWavefronts()
+{
+    // each queue only holds rays of faces queued by its own thread, so
+    // the queues can be flushed concurrently
+    tbb::parallel_for_each(light_wavefronts.begin(), light_wavefronts.end(), [](light_wavefront_t &wavefront) {
+#if defined(HAVE_EMBREE) && defined(__SSE2__)
+        _MM_SET_FLUSH_ZERO_MODE(_MM_FLUSH_ZERO_ON);
+#endif
+        wavefront.flush();
+    });
+}
+
+void FinishDirectLightFace(const mbsp_t *bsp, lightsurf_t &lightsurf, const settings::worldspawn_keys &cfg, int pass)
+{
+    if (Adaptive_PassActive(lightsurf, pass)) {
+        DirectLightFace_End(bsp, lightsurf, cfg);
+    }
+
+    Adaptive_EndPass(lightsurf, pass);
+}
+
 /*
  * ============
  * IndirectLightFace
@@ -3414,7 +3914,7 @@ void IndirectLightFace(const mbsp_t *bsp, lightsurf_t &lightsurf, const settings
     const modelinfo_t *modelinfo = ModelInfoForFace(bsp, Face_GetNum(bsp, face));
     lightmapdict_t *lightmaps = &lightsurf.lightmapsByStyle;
 
-    if (light_options.debugmode == debugmodes::none) {
+    if (light_options.DebugModeLights()) {
         const surfflags_t &extended_flags = extended_texinfo_flags[face->texinfo];
 
         /* positive lights */
@@ -3422,12 +3922,28 @@ void IndirectLightFace(const mbsp_t *bsp, lightsurf_t &lightsurf, const settings
 
             /* add bounce lighting */
             // note: scale here is just to keep it close-ish to the old code
+            profile_scope_t scope(bsp, &lightsurf, profile_stage_t::bounce);
             LightFace_SurfaceLight(
                 bsp, &lightsurf, lightmaps, bounce_depth, cfg.bouncescale.value() * 0.5, cfg.bouncescale.value(), 128.0f);
         }
     }
 }
 
+/*
+ * ============
+ * DirtLightFace
+ *
+ * -tilesize: dirt for a lightsurf that only gets indirect lighting
+ * ============
+ */
+void DirtLightFace(const mbsp_t *bsp, lightsurf_t &lightsurf)
+{
+    if (dirt_in_use && (light_options.debugmode != debugmodes::phong)) {
+        profile_scope_t scope(bsp, &lightsurf, profile_stage_t::dirt);
+        LightFace_CalculateDirt(&lightsurf);
+    }
+}
+
 /*
  * ============
  * PostProcessLightFace
@@ -3440,7 +3956,9 @@ void PostProcessLightFace(const mbsp_t *bsp, lightsurf_t &lightsurf, const setti
 
     lightmapdict_t *lightmaps = &lightsurf.lightmapsByStyle;
 
-    if (light_options.debugmode == debugmodes::none) {
+    profile_scope_t scope(bsp, &lightsurf, profile_stage_t::postprocess);
+
+    if (light_options.DebugModeLights()) {
 
         total_samplepoints += lightsurf.samples.size();
 
@@ -3483,14 +4001,19 @@ void PostProcessLightFace(const mbsp_t *bsp, lightsurf_t &lightsurf, const setti
 
         /* negative lights */
         if (!(modelinfo->lightignore.value() || extended_flags.light_ignore)) {
-            for (const auto &entity : GetLights()) {
+            const auto &all_lights = GetLights();
+            for (size_t lightnum = 0; lightnum < all_lights.size(); lightnum++) {
+                const auto &entity = all_lights[lightnum];
                 if (entity->getFormula() == LF_LOCALMIN)
                     continue;
                 if (entity->nostaticlight.value())
                     continue;
-                if (entity->light.value() < 0)
+                if (entity->light.value() < 0) {
+                    profile_scope_t entity_scope(bsp, &lightsurf, profile_stage_t::entity, lightnum);
                     LightFace_Entity(bsp, entity.get(), &lightsurf, lightmaps);
+                }
             }
+            profile_scope_t sky_scope(bsp, &lightsurf, profile_stage_t::sky);
             for (const sun_t &sun : GetSuns())
                 if (sun.sunlight < 0)
                     LightFace_Sky(bsp, &sun, &lightsurf, lightmaps);
@@ -3500,6 +4023,29 @@ void PostProcessLightFace(const mbsp_t *bsp, lightsurf_t &lightsurf, const setti
     if (light_options.debugmode == debugmodes::mottle)
         LightFace_DebugMottle(bsp, &lightsurf, lightmaps);
 }
+
+/*
+ * ============
+ * CostDebugLightFace
+ *
+ * -debugcost: replaces the lightmaps with the face's share of the most
+ * expensive face's lighting time
+ * ============
+ */
+void CostDebugLightFace(const mbsp_t *bsp, lightsurf_t &lightsurf, float cost)
+{
+    lightmapdict_t *lightmaps = &lightsurf.lightmapsByStyle;
+    lightmaps->clear();
+
+    /* use a style 0 light map */
+    lightmap_t *lightmap = Lightmap_ForStyle(lightmaps, 0, &lightsurf);
+
+    for (int i = 0; i < lightsurf.samples.size(); i++) {
+        lightmap->samples[i].color = qvec3f(255.0f * cost);
+    }
+
+    Lightmap_Save(bsp, lightmaps, &lightsurf, lightmap, 0);
+}
 // lightgrid
 
 lightgrid_samples_t &lightgrid_samples_t::operator+=(const lightgrid_samples_t &other) noexcept
@@ -3709,6 +4255,12 @@ void ResetLtFace()
     total_bounce_ray_hits = 0;
     total_surflight_rays = 0;
     total_surflight_ray_hits = 0;
+    total_lightcuts = 0;
+    total_lightcut_nodes = 0;
+    total_adaptive_luxels = 0;
+    total_adaptive_refined = 0;
+
+    light_wavefronts.clear();
 
     fully_transparent_lightmaps = 0;
 
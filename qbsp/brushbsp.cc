@@ -108,6 +108,40 @@ bspbrush_t::ptr BrushFromBounds(const aabb3d &bounds)
     return b;
 }
 
+/*
+==================
+AddBrushBSPPlanes
+
+Adds the planes of the volume BrushBSP puts around the brushes, so building
+the tree only needs to look planes up
+==================
+*/
+void AddBrushBSPPlanes(const bspbrush_t::container &brushlist)
+{
+    if (brushlist.empty()) {
+        return;
+    }
+
+    aabb3d bounds;
+
+    for (const auto &b : brushlist) {
+        bounds += b->bounds;
+    }
+
+    bounds = bounds.grow(SIDESPACE);
+
+    for (int i = 0; i < 3; i++) {
+        qplane3d plane{};
+        plane.normal[i] = 1;
+        plane.dist = bounds.maxs()[i];
+        map.add_or_find_plane(plane);
+
+        plane.normal[i] = -1;
+        plane.dist = -bounds.mins()[i];
+        map.add_or_find_plane(plane);
+    }
+}
+
 /*
 ==================
 BrushVolume
@@ -345,7 +379,7 @@ Creates a leaf node.
 Called in parallel.
 ==================
 */
-static void LeafNode(node_t *leafnode, bspbrush_t::container brushes, bspstats_t &stats)
+static void LeafNode(tree_t &tree, node_t *leafnode, bspbrush_t::container brushes, bspstats_t &stats)
 {
     leafnode->facelist.clear();
     leafnode->is_leaf = true;
@@ -363,7 +397,12 @@ static void LeafNode(node_t *leafnode, bspbrush_t::container brushes, bspstats_t
     if (qbsp_options.debugleak.value() || qbsp_options.debugbspbrushes.value()) {
         leafnode->bsp_brushes = brushes;
     } else {
+        tree.recycle_brush_fragment(leafnode->volume);
         leafnode->volume.reset();
+
+        for (auto &brush : brushes) {
+            tree.recycle_brush_fragment(brush);
+        }
     }
 }
 
@@ -402,11 +441,16 @@ SplitBrush
 Note, it's useful to take/return std::unique_ptr so it can quickly return the
 input.
 
+If `tree` is given, the new brushes are fragments owned by the tree (see
+tree_t::create_brush_fragment), and `brush` must be the only handle to it if
+it's a fragment itself, since it's recycled once it's split; otherwise they're
+standalone brushes.
+
 https://github.com/id-Software/Quake-2-Tools/blob/master/bsp/qbsp3/brushbsp.c#L935
 ================
 */
-static twosided<bspbrush_t::ptr> SplitBrush(
-    bspbrush_t::ptr brush, size_t planenum, std::optional<std::reference_wrapper<bspstats_t>> stats)
+static twosided<bspbrush_t::ptr> SplitBrush(bspbrush_t::ptr brush, size_t planenum,
+    std::optional<std::reference_wrapper<bspstats_t>> stats, tree_t *tree = nullptr)
 {
     const qplane3d &split = map.planes[planenum];
     twosided<bspbrush_t::ptr> result;
@@ -464,7 +508,7 @@ static twosided<bspbrush_t::ptr> SplitBrush(
     // start with 2 empty brushes
 
     for (int i = 0; i < 2; i++) {
-        result[i] = bspbrush_t::make_ptr();
+        result[i] = tree ? tree->create_brush_fragment() : bspbrush_t::make_ptr();
         result[i]->original_ptr = brush->original_ptr ? brush->original_ptr : brush;
         result[i]->mapbrush = brush->mapbrush;
         // fixme-brushbsp: add a bspbrush_t copy constructor to make sure we get all fields
@@ -515,6 +559,9 @@ static twosided<bspbrush_t::ptr> SplitBrush(
         }
 
         if (bogus) {
+            if (tree) {
+                tree->recycle_brush_fragment(result[i]);
+            }
             result[i] = nullptr;
         }
     }
@@ -524,6 +571,10 @@ static twosided<bspbrush_t::ptr> SplitBrush(
             stats->get().c_brushesremoved++;
         }
 
+        if (tree) {
+            tree->recycle_brush_fragment(brush);
+        }
+
         return result;
     } else if (!result[0] || !result[1]) {
         if (stats) {
@@ -531,8 +582,14 @@ static twosided<bspbrush_t::ptr> SplitBrush(
         }
 
         if (result[0]) {
+            if (tree) {
+                tree->recycle_brush_fragment(result.front);
+            }
             result.front = std::move(brush);
         } else {
+            if (tree) {
+                tree->recycle_brush_fragment(result.back);
+            }
             result.back = std::move(brush);
         }
 
@@ -563,6 +620,9 @@ static twosided<bspbrush_t::ptr> SplitBrush(
     for (int i = 0; i < 2; i++) {
         vec_t v1 = BrushVolume(*result[i]);
         if (v1 < qbsp_options.microvolume.value()) {
+            if (tree) {
+                tree->recycle_brush_fragment(result[i]);
+            }
             result[i] = nullptr;
             if (stats) {
                 stats->get().c_tinyvolumes++;
@@ -570,6 +630,10 @@ static twosided<bspbrush_t::ptr> SplitBrush(
         }
     }
 
+    if (tree) {
+        tree->recycle_brush_fragment(brush);
+    }
+
     return result;
 }
 
@@ -1090,7 +1154,7 @@ SplitBrushList
 ================
 */
 static std::array<bspbrush_t::container, 2> SplitBrushList(
-    bspbrush_t::container brushes, size_t planenum, bspstats_t &stats)
+    tree_t &tree, bspbrush_t::container brushes, size_t planenum, bspstats_t &stats)
 {
     std::array<bspbrush_t::container, 2> result;
 
@@ -1099,7 +1163,7 @@ static std::array<bspbrush_t::container, 2> SplitBrushList(
 
         if (sides == PSIDE_BOTH) {
             // split into two brushes (destructively)
-            auto [front, back] = SplitBrush(std::move(brush), planenum, stats);
+            auto [front, back] = SplitBrush(std::move(brush), planenum, stats, &tree);
 
             if (front) {
                 result[0].push_back(std::move(front));
@@ -1155,7 +1219,7 @@ static void BuildTree_r(tree_t &tree, int level, node_t *node, bspbrush_t::conta
         node->is_leaf = true;
 
         stats.c_leafs++;
-        LeafNode(node, std::move(brushes), stats);
+        LeafNode(tree, node, std::move(brushes), stats);
 
         return;
     }
@@ -1172,7 +1236,7 @@ static void BuildTree_r(tree_t &tree, int level, node_t *node, bspbrush_t::conta
     node->planenum = bestplane;
 
     auto &plane = map.get_plane(bestplane);
-    auto children = SplitBrushList(std::move(brushes), bestplane, stats);
+    auto children = SplitBrushList(tree, std::move(brushes), bestplane, stats);
 
     // allocate children before recursing
     for (int i = 0; i < 2; i++) {
@@ -1191,7 +1255,7 @@ static void BuildTree_r(tree_t &tree, int level, node_t *node, bspbrush_t::conta
 
     // to save time/memory we can destroy node's volume at this point
     if (node->volume) {
-        auto children_volumes = SplitBrush(std::move(node->volume), bestplane, stats);
+        auto children_volumes = SplitBrush(std::move(node->volume), bestplane, stats, &tree);
         node->volume = nullptr;
         node->children[0]->volume = std::move(children_volumes[0]);
         node->children[1]->volume = std::move(children_volumes[1]);
@@ -1217,7 +1281,7 @@ struct brushbsp_input_stats_t : logging::stat_tracker_t
 BrushBSP
 ==================
 */
-void BrushBSP(tree_t &tree, mapentity_t &entity, const bspbrush_t::container &brushlist, tree_split_t split_type)
+void BrushBSP(tree_t &tree, const aabb3d &entity_bounds, const bspbrush_t::container &brushlist, tree_split_t split_type)
 {
     logging::header(__func__);
 
@@ -1229,7 +1293,7 @@ void BrushBSP(tree_t &tree, mapentity_t &entity, const bspbrush_t::container &br
          * smarter, but this works.
          */
         auto headnode = tree.create_node();
-        headnode->bounds = entity.bounds;
+        headnode->bounds = entity_bounds;
         // The choice of plane is mostly unimportant, but having it at (0, 0, 0) affects
         // the node bounds calculation.
         headnode->planenum = 0;
@@ -1303,6 +1367,12 @@ void BrushBSP(tree_t &tree, mapentity_t &entity, const bspbrush_t::container &br
 
     stats.print_stats();
 
+    // the split fragments are only still used by the leafs that keep their
+    // brushes and volumes for these (see LeafNode)
+    if (!qbsp_options.debugleak.value() && !qbsp_options.debugbspbrushes.value()) {
+        tree.free_brush_fragments();
+    }
+
     CountLeafs(tree.headnode);
 }
 
@@ -144,12 +144,11 @@ inline int64_t GetEdge(const size_t &v1, const size_t &v2, const face_t *face, e
 
     if (!qbsp_options.noedgereuse.value()) {
         // search for existing edges
-        if (auto it = map.hashedges.find(std::make_pair(v2, v1)); it != map.hashedges.end()) {
-            const hashedge_t &existing = it->second;
+        if (const hashedge_t *existing = map.hashedges.find(v2, v1)) {
             // this content check is required for software renderers
             // (see q1_liquid_software test case)
-            if (existing.face->contents.front.equals(qbsp_options.target_game, face->contents.front)) {
-                return -existing.edge_index;
+            if (existing->face->contents.front.equals(qbsp_options.target_game, face->contents.front)) {
+                return -existing->edge_index;
             }
         }
     }
@@ -254,6 +253,24 @@ static void EmitFaces_R(node_t *node, emit_faces_stats_t &stats)
     EmitFaces_R(node->children[1], stats);
 }
 
+// upper bound on the number of edges EmitFaces_R will emit
+static size_t CountFaceEdges_R(node_t *node)
+{
+    if (node->is_leaf) {
+        return 0;
+    }
+
+    size_t count = 0;
+
+    for (auto &face : node->facelist) {
+        for (auto &fragment : face->fragments) {
+            count += fragment.output_vertices.size();
+        }
+    }
+
+    return count + CountFaceEdges_R(node->children[0]) + CountFaceEdges_R(node->children[1]);
+}
+
 /*
 ================
 MakeFaceEdges
@@ -265,6 +282,8 @@ size_t EmitFaces(node_t *headnode)
 
     Q_assert(map.hashedges.empty());
 
+    map.hashedges.reserve(CountFaceEdges_R(headnode));
+
     emit_faces_stats_t stats;
 
     size_t firstface = map.bsp.dfaces.size();
@@ -20,6 +20,8 @@
     See file, 'COPYING', for details.
 */
 
+#include <algorithm>
+#include <bit>
 #include <cassert>
 #include <cctype>
 #include <cstring>
@@ -42,7 +44,7 @@
 #include <common/qvec.hh>
 #include <common/ostream.hh>
 
-#include <pareto/spatial_map.h>
+#include <qbsp/epsilonhash.hh>
 
 mapdata_t map;
 
@@ -53,14 +55,20 @@ mapplane_t::mapplane_t(const qbsp_plane_t &copy)
 
 struct planehash_t
 {
-    // planes indices (into the `planes` vector)
-    pareto::spatial_map<vec_t, 4, size_t> hash;
+    // planes indices (into the `planes` vector), by normal and distance
+    epsilon_hash_t<4, size_t> hash{{NORMAL_EPSILON, NORMAL_EPSILON, NORMAL_EPSILON, DIST_EPSILON}};
+
+    // held while adding planes, so a plane is only added once and the two
+    // sides of a plane stay next to each other. `planes` is a
+    // concurrent_vector and the hash has its own locks, so finding a plane
+    // doesn't need it.
+    std::mutex add_mutex;
 };
 
 struct vertexhash_t
 {
     // hashed vertices; generated by EmitVertices
-    pareto::spatial_map<vec_t, 3, size_t> hash;
+    epsilon_hash_t<3, size_t> hash{{POINT_EQUAL_EPSILON, POINT_EQUAL_EPSILON, POINT_EQUAL_EPSILON}};
 };
 
 mapdata_t::mapdata_t()
@@ -69,9 +77,12 @@ mapdata_t::mapdata_t()
 {
 }
 
-// add the specified plane to the list
-size_t mapdata_t::add_plane(const qplane3d &plane)
+// add the specified plane to the list; the caller holds the add lock
+static size_t AddPlaneLocked(mapdata_t &mapdata, const qplane3d &plane)
 {
+    auto &planes = mapdata.planes;
+    auto &plane_hash = mapdata.plane_hash;
+
     planes.emplace_back(plane);
     planes.emplace_back(-plane);
 
@@ -90,31 +101,28 @@ size_t mapdata_t::add_plane(const qplane3d &plane)
         result = positive_index;
     }
 
-    plane_hash->hash.emplace(pareto::point<vec_t, 4>{positive.get_normal()[0], positive.get_normal()[1],
-                                 positive.get_normal()[2], positive.get_dist()},
+    // hashed only once they're final, so other threads finding them never
+    // see them change
+    plane_hash->hash.insert(
+        {positive.get_normal()[0], positive.get_normal()[1], positive.get_normal()[2], positive.get_dist()},
         positive_index);
-    plane_hash->hash.emplace(pareto::point<vec_t, 4>{negative.get_normal()[0], negative.get_normal()[1],
-                                 negative.get_normal()[2], negative.get_dist()},
+    plane_hash->hash.insert(
+        {negative.get_normal()[0], negative.get_normal()[1], negative.get_normal()[2], negative.get_dist()},
         negative_index);
 
     return result;
 }
 
-std::optional<size_t> mapdata_t::find_plane_nonfatal(const qplane3d &plane)
+// add the specified plane to the list
+size_t mapdata_t::add_plane(const qplane3d &plane)
 {
-    constexpr vec_t HALF_NORMAL_EPSILON = NORMAL_EPSILON * 0.5;
-    constexpr vec_t HALF_DIST_EPSILON = DIST_EPSILON * 0.5;
-
-    if (auto it = plane_hash->hash.find_intersection(
-            {plane.normal[0] - HALF_NORMAL_EPSILON, plane.normal[1] - HALF_NORMAL_EPSILON,
-                plane.normal[2] - HALF_NORMAL_EPSILON, plane.dist - HALF_DIST_EPSILON},
-            {plane.normal[0] + HALF_NORMAL_EPSILON, plane.normal[1] + HALF_NORMAL_EPSILON,
-                plane.normal[2] + HALF_NORMAL_EPSILON, plane.dist + HALF_DIST_EPSILON});
-        it != plane_hash->hash.end()) {
-        return it->second;
-    }
+    std::unique_lock lock(plane_hash->add_mutex);
+    return AddPlaneLocked(*this, plane);
+}
 
-    return std::nullopt;
+std::optional<size_t> mapdata_t::find_plane_nonfatal(const qplane3d &plane)
+{
+    return plane_hash->hash.find({plane.normal[0], plane.normal[1], plane.normal[2], plane.dist});
 }
 
 // find the specified plane in the list if it exists. throws
@@ -136,7 +144,14 @@ size_t mapdata_t::add_or_find_plane(const qplane3d &plane)
         return *index;
     }
 
-    return add_plane(plane);
+    std::unique_lock lock(plane_hash->add_mutex);
+
+    // another thread may have added it since we looked
+    if (auto index = find_plane_nonfatal(plane)) {
+        return *index;
+    }
+
+    return AddPlaneLocked(*this, plane);
 }
 
 const qbsp_plane_t &mapdata_t::get_plane(size_t pnum)
@@ -147,27 +162,94 @@ const qbsp_plane_t &mapdata_t::get_plane(size_t pnum)
 // find output index for specified already-output vector.
 std::optional<size_t> mapdata_t::find_emitted_hash_vector(const qvec3d &vert)
 {
-    constexpr vec_t HALF_EPSILON = POINT_EQUAL_EPSILON * 0.5;
+    return hashverts->hash.find(vert);
+}
 
-    if (auto it =
-            hashverts->hash.find_intersection({vert[0] - HALF_EPSILON, vert[1] - HALF_EPSILON, vert[2] - HALF_EPSILON},
-                {vert[0] + HALF_EPSILON, vert[1] + HALF_EPSILON, vert[2] + HALF_EPSILON});
-        it != hashverts->hash.end()) {
-        return it->second;
+// add vector to hash
+void mapdata_t::add_hash_vector(const qvec3d &point, const size_t &num)
+{
+    hashverts->hash.insert(point, num);
+}
+
+size_t hashedge_table_t::slot_of(size_t v1, size_t v2) const
+{
+    uint64_t hash = (static_cast<uint64_t>(v1) * 0x9e3779b97f4a7c15ull) ^ (static_cast<uint64_t>(v2) * 0xc2b2ae3d27d4eb4full);
+    hash ^= hash >> 32;
+
+    return static_cast<size_t>(hash) & (slots.size() - 1);
+}
+
+void hashedge_table_t::reserve(size_t edges)
+{
+    // keep it at most half full, so the probes stay short
+    size_t capacity = std::bit_ceil(std::max(edges * 2, size_t(16)));
+
+    if (capacity <= slots.size()) {
+        return;
+    }
+
+    if (!count) {
+        // reuses the memory of a cleared table
+        slots.assign(capacity, hashedge_t{});
+        return;
     }
 
-    return std::nullopt;
+    std::vector<hashedge_t> old = std::exchange(slots, std::vector<hashedge_t>(capacity));
+    count = 0;
+
+    for (const hashedge_t &edge : old) {
+        if (edge.face) {
+            emplace(edge);
+        }
+    }
 }
 
-// add vector to hash
-void mapdata_t::add_hash_vector(const qvec3d &point, const size_t &num)
+const hashedge_t *hashedge_table_t::find(size_t v1, size_t v2) const
+{
+    if (slots.empty()) {
+        return nullptr;
+    }
+
+    for (size_t i = slot_of(v1, v2);; i = (i + 1) & (slots.size() - 1)) {
+        const hashedge_t &slot = slots[i];
+
+        if (!slot.face) {
+            return nullptr;
+        } else if (slot.v1 == v1 && slot.v2 == v2) {
+            return &slot;
+        }
+    }
+}
+
+void hashedge_table_t::emplace(const hashedge_t &edge)
+{
+    if ((count + 1) * 2 > slots.size()) {
+        reserve(count + 1);
+    }
+
+    for (size_t i = slot_of(edge.v1, edge.v2);; i = (i + 1) & (slots.size() - 1)) {
+        hashedge_t &slot = slots[i];
+
+        if (!slot.face) {
+            slot = edge;
+            count++;
+            return;
+        } else if (slot.v1 == edge.v1 && slot.v2 == edge.v2) {
+            return;
+        }
+    }
+}
+
+void hashedge_table_t::clear()
 {
-    hashverts->hash.emplace(pareto::point<vec_t, 3>({point[0], point[1], point[2]}), num);
+    // keeps the memory for the next model
+    slots.clear();
+    count = 0;
 }
 
 void mapdata_t::add_hash_edge(size_t v1, size_t v2, int64_t edge_index, const face_t *face)
 {
-    hashedges.emplace(std::make_pair(v1, v2), hashedge_t{.v1 = v1, .v2 = v2, .edge_index = edge_index, .face = face});
+    hashedges.emplace(hashedge_t{.v1 = v1, .v2 = v2, .edge_index = edge_index, .face = face});
 }
 
 const std::optional<img::texture_meta> &mapdata_t::load_image_meta(const std::string_view &name)
@@ -318,6 +318,35 @@ static void WriteLeafVolumes(const std::vector<portal_t *> &leakline, std::strin
     WriteBspBrushMap(filename_suffix, volumes_to_write);
 }
 
+void WriteLeak(const leak_t &leak)
+{
+    if (map.leakfile)
+        return;
+
+    WriteLeakLine(*leak.entity, leak.line);
+    map.leakfile = true;
+
+    // also write the leak portals to `<bsp_path>.leak.prt`
+    WriteDebugPortals(leak.line, "leak");
+
+    // also write the leafs used in the leak line to <bsp_path>.leak-leaf-volumes.map`
+    if (qbsp_options.debugleak.value()) {
+        WriteLeafVolumes(leak.line, "leak-leaf-volumes");
+    }
+
+    /* Get rid of the .prt file since the map has a leak */
+    if (!qbsp_options.keepprt.value()) {
+        fs::path name = qbsp_options.bsp_path;
+        name.replace_extension("prt");
+        remove(name);
+    }
+
+    if (qbsp_options.leaktest.value()) {
+        logging::print("Aborting because -leaktest was used.\n");
+        exit(1);
+    }
+}
+
 /**
  * Is this entity allowed to be in the void without causing a leak?
  */
@@ -401,10 +430,10 @@ void MarkBrushSidesInvisible(bspbrush_t::container &brushes)
     for (auto &brush : brushes) {
         for (auto &face : brush->sides) {
             if (face.source) {
-                face.source->visible = false;
+                face.source->visible[face.hull] = false;
 
                 if (face.source->get_texinfo().flags.is_hint) {
-                    face.source->visible = true; // hints are always visible
+                    face.source->visible[face.hull] = true; // hints are always visible
                 }
             }
         }
@@ -453,7 +482,7 @@ static void MarkVisibleBrushSides_R(node_t *node)
                     if (side.source && qv::epsilonEqual(side.get_positive_plane(), portal->plane)) {
                         // we've found a brush side in an original brush in the neighbouring
                         // leaf, on a portal to this (non-opaque) leaf, so mark it as visible.
-                        side.source->visible = true;
+                        side.source->visible[side.hull] = true;
                     }
                 }
             }
@@ -667,7 +696,7 @@ get incorrectly marked as "invisible").
 Special cases: structural fully covered by detail still needs to be marked "visible".
 ===========
 */
-bool FillOutside(tree_t &tree, hull_index_t hullnum, bspbrush_t::container &brushes)
+bool FillOutside(tree_t &tree, hull_index_t hullnum, bspbrush_t::container &brushes, std::optional<leak_t> *deferred_leak)
 {
     node_t *node = tree.headnode;
 
@@ -742,30 +771,13 @@ bool FillOutside(tree_t &tree, hull_index_t hullnum, bspbrush_t::container &brus
     if (leakentity) {
         logging::print("WARNING: Reached occupant \"{}\" at ({}), no filling performed.\n",
             leakentity->epairs.get("classname"), leakentity->origin);
-        if (map.leakfile)
-            return false;
-
-        WriteLeakLine(*leakentity, leakline);
-        map.leakfile = true;
-
-        // also write the leak portals to `<bsp_path>.leak.prt`
-        WriteDebugPortals(leakline, "leak");
-
-        // also write the leafs used in the leak line to <bsp_path>.leak-leaf-volumes.map`
-        if (qbsp_options.debugleak.value()) {
-            WriteLeafVolumes(leakline, "leak-leaf-volumes");
-        }
-
-        /* Get rid of the .prt file since the map has a leak */
-        if (!qbsp_options.keepprt.value()) {
-            fs::path name = qbsp_options.bsp_path;
-            name.replace_extension("prt");
-            remove(name);
-        }
 
-        if (qbsp_options.leaktest.value()) {
-            logging::print("Aborting because -leaktest was used.\n");
-            exit(1);
+        if (deferred_leak) {
+            if (!deferred_leak->has_value()) {
+                *deferred_leak = leak_t{leakentity, std::move(leakline)};
+            }
+        } else {
+            WriteLeak({leakentity, std::move(leakline)});
         }
 
         // clear occupied state, so areas can be flooded in Q2
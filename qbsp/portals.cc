@@ -30,6 +30,7 @@
 #include <qbsp/tree.hh>
 #include <common/log.hh>
 #include <atomic>
+#include <mutex>
 #include <common/prtfile.hh>
 
 #include "tbb/task_group.h"
@@ -1127,7 +1128,7 @@ static void MarkVisibleSides_r(node_t *node, visible_faces_stats_t &stats)
         }
         for (int i = 0; i < 2; ++i) {
             if (p->sides[i] && p->sides[i]->source) {
-                p->sides[i]->source->visible = true;
+                p->sides[i]->source->visible[p->sides[i]->hull] = true;
                 stats.sides_visible++;
             }
         }
@@ -1152,6 +1153,10 @@ void MarkVisibleSides(tree_t &tree, bspbrush_t::container &brushes)
     MarkVisibleSides_r(tree.headnode, stats);
 
     if (!stats.missing_portal_sides.empty()) {
+        // brush models are marked concurrently, and they all write the same file
+        static std::mutex missing_portal_sides_mutex;
+        std::scoped_lock lock(missing_portal_sides_mutex);
+
         fs::path name = qbsp_options.bsp_path;
         name.replace_extension("missing_portal_sides.prt");
         WriteDebugPortals(stats.missing_portal_sides, name);
@@ -43,6 +43,12 @@
 
 #include <fmt/chrono.h>
 
+#include <list>
+
+#include <tbb/task_arena.h>
+#include <tbb/task_group.h>
+#include <tbb/task_scheduler_observer.h>
+
 namespace settings
 {
 bool wadpath::operator<(const wadpath &other) const
@@ -969,15 +975,15 @@ static void GatherLeafVolumes_r(node_t *node, bspbrush_t::container &container)
 
 /*
 ===============
-ProcessEntity
+EntityHasGeometry
 ===============
 */
-static void ProcessEntity(mapentity_t &entity, hull_index_t hullnum)
+static bool EntityHasGeometry(mapentity_t &entity)
 {
     /* No map brushes means non-bmodel entity.
        We need to handle worldspawn containing no brushes, though. */
     if (!entity.mapbrushes.size() && !map.is_world_entity(entity)) {
-        return;
+        return false;
     }
 
     /*
@@ -985,47 +991,83 @@ static void ProcessEntity(mapentity_t &entity, hull_index_t hullnum)
      * worldspawn
      */
     if (IsWorldBrushEntity(entity) || IsNonRemoveWorldBrushEntity(entity))
-        return;
+        return false;
 
-    // for notriggermodels: if we have at least one trigger-like texture, do special trigger stuff
-    bool discarded_trigger = !map.is_world_entity(entity) && qbsp_options.notriggermodels.value() && IsTrigger(entity);
+    return true;
+}
 
-    // Export a blank model struct, and reserve the index (only do this once, for all hulls)
-    if (!discarded_trigger) {
-        if (!entity.outputmodelnumber.has_value()) {
-            entity.outputmodelnumber = map.bsp.dmodels.size();
-            map.bsp.dmodels.emplace_back();
-        }
+// for notriggermodels: if we have at least one trigger-like texture, do special trigger stuff
+static bool IsDiscardedTrigger(mapentity_t &entity)
+{
+    return !map.is_world_entity(entity) && qbsp_options.notriggermodels.value() && IsTrigger(entity);
+}
 
-        if (!map.is_world_entity(entity)) {
-            if (&entity == &map.entities[1]) {
-                logging::header("Internal Entities");
-            }
+/*
+===============
+ReserveEntityModels
 
-            std::string mod = fmt::format("*{}", entity.outputmodelnumber.value());
+Export a blank model struct for each entity with geometry and reserve its
+index. Done once, before any hull is processed, so the entities aren't
+modified while the collision hulls are being built.
+===============
+*/
+static void ReserveEntityModels()
+{
+    for (auto &entity : map.entities) {
+        if (!EntityHasGeometry(entity)) {
+            continue;
+        }
 
-            if (qbsp_options.verbose.value()) {
-                PrintEntity(entity);
-            }
+        if (!IsDiscardedTrigger(entity)) {
+            entity.outputmodelnumber = map.bsp.dmodels.size();
+            map.bsp.dmodels.emplace_back();
 
-            if (!hullnum.value_or(0) || qbsp_options.loghulls.value()) {
-                logging::print(logging::flag::STAT, "     MODEL: {}\n", mod);
+            if (!map.is_world_entity(entity)) {
+                entity.epairs.set("model", fmt::format("*{}", entity.outputmodelnumber.value()));
             }
+        }
 
-            entity.epairs.set("model", mod);
+        if (qbsp_options.lmscale.is_changed() && !entity.epairs.has("_lmscale")) {
+            entity.epairs.set("_lmscale", std::to_string(qbsp_options.lmscale.value()));
         }
     }
+}
+
+/*
+===============
+SetDiscardedTriggerBounds
 
-    if (qbsp_options.lmscale.is_changed() && !entity.epairs.has("_lmscale")) {
-        entity.epairs.set("_lmscale", std::to_string(qbsp_options.lmscale.value()));
+Triggers discarded by -notriggermodels get the bounds of the last hull
+instead of a model
+===============
+*/
+static void SetDiscardedTriggerBounds()
+{
+    for (auto &entity : map.entities) {
+        if (!EntityHasGeometry(entity) || !IsDiscardedTrigger(entity)) {
+            continue;
+        }
+
+        entity.epairs.set("mins", fmt::to_string(entity.bounds.mins()));
+        entity.epairs.set("maxs", fmt::to_string(entity.bounds.maxs()));
     }
+}
+
+/*
+===============
+LoadEntityBrushes
 
+Converts the map brushes of the entity into BSP brushes for the given hull,
+setting entity.bounds
+===============
+*/
+static void LoadEntityBrushes(mapentity_t &entity, hull_index_t hullnum, bspbrush_t::container &brushes)
+{
     // Init the entity
     entity.bounds = {};
 
     // reserve enough brushes; we would only make less,
     // never more
-    bspbrush_t::container brushes;
     brushes.reserve(entity.mapbrushes.size());
 
     /*
@@ -1060,53 +1102,136 @@ static void ProcessEntity(mapentity_t &entity, hull_index_t hullnum)
 
         ChopBrushes(brushes, qbsp_options.chopfragment.value());
     }
+}
 
-    // we're discarding the brush
-    if (discarded_trigger) {
-        entity.epairs.set("mins", fmt::to_string(entity.bounds.mins()));
-        entity.epairs.set("maxs", fmt::to_string(entity.bounds.maxs()));
-        return;
+// the tree of one entity in one hull; loaded and output in entity order, but
+// built on its own so the trees can be built concurrently
+struct entity_tree_t
+{
+    mapentity_t *entity;
+    aabb3d bounds;
+    // false for the entities that are loaded but not output
+    bool build;
+    bspbrush_t::container brushes;
+    tree_t tree;
+    // a leak of a collision hull, written when the tree is output
+    std::optional<leak_t> leak;
+};
+
+/*
+===============
+LoadEntityTree
+
+Loads the brushes of an entity with geometry, along with the planes
+BrushBSP will need for them
+===============
+*/
+static void LoadEntityTree(entity_tree_t &job, mapentity_t &entity, hull_index_t hullnum)
+{
+    bool discarded_trigger = IsDiscardedTrigger(entity);
+
+    if (!discarded_trigger && !map.is_world_entity(entity)) {
+        if (&entity == &map.entities[1]) {
+            logging::header("Internal Entities");
+        }
+
+        if (qbsp_options.verbose.value()) {
+            PrintEntity(entity);
+        }
+
+        if (!hullnum.value_or(0) || qbsp_options.loghulls.value()) {
+            logging::print(logging::flag::STAT, "     MODEL: *{}\n", entity.outputmodelnumber.value());
+        }
     }
 
+    job.entity = &entity;
+    LoadEntityBrushes(entity, hullnum, job.brushes);
+    job.bounds = entity.bounds;
+
+    // we're discarding the brush; see SetDiscardedTriggerBounds.
     // corner case, -omitdetail with all detail in an bmodel
-    if (brushes.empty() && entity.bounds == aabb3d()) {
+    job.build = !discarded_trigger && !(job.brushes.empty() && job.bounds == aabb3d());
+
+    if (!job.build) {
+        job.brushes.clear();
         return;
     }
 
-    // simpler operation for hulls
-    if (hullnum.value_or(0)) {
-        tree_t tree;
-        BrushBSP(tree, entity, brushes, tree_split_t::FAST);
-        if (map.is_world_entity(entity) && !qbsp_options.nofill.value()) {
-            // assume non-world bmodels are simple
-            MakeTreePortals(tree);
-            if (FillOutside(tree, hullnum, brushes)) {
-                if (qbsp_options.filldetail.value())
-                    FillDetail(tree, hullnum, brushes);
+    // add them now rather than while building, so the plane numbers don't
+    // depend on which tree gets built first
+    AddBrushBSPPlanes(job.brushes);
+}
+
+/*
+===============
+BuildHullTree
+
+Simpler operation for the collision hulls. A leak found while filling the
+world is kept in job.leak (see FillOutside).
+===============
+*/
+static void BuildHullTree(entity_tree_t &job, hull_index_t hullnum)
+{
+    tree_t &tree = job.tree;
+    bspbrush_t::container &brushes = job.brushes;
+
+    BrushBSP(tree, job.bounds, brushes, tree_split_t::FAST);
+    if (map.is_world_entity(*job.entity) && !qbsp_options.nofill.value()) {
+        // assume non-world bmodels are simple
+        MakeTreePortals(tree);
+        if (FillOutside(tree, hullnum, brushes, &job.leak)) {
+            if (qbsp_options.filldetail.value())
+                FillDetail(tree, hullnum, brushes);
 
-                // make a really good tree
-                tree.clear();
-                BrushBSP(tree, entity, brushes, tree_split_t::PRECISE);
+            // make a really good tree
+            tree.clear();
+            BrushBSP(tree, job.bounds, brushes, tree_split_t::PRECISE);
 
-                // fill again so PruneNodes works
-                MakeTreePortals(tree);
-                FillOutside(tree, hullnum, brushes);
-                if (qbsp_options.filldetail.value())
-                    FillDetail(tree, hullnum, brushes);
+            // fill again so PruneNodes works
+            MakeTreePortals(tree);
+            FillOutside(tree, hullnum, brushes, &job.leak);
+            if (qbsp_options.filldetail.value())
+                FillDetail(tree, hullnum, brushes);
 
+            // the line of the leak goes through the portals
+            if (!job.leak) {
                 FreeTreePortals(tree);
-                PruneNodes(tree.headnode);
             }
-            CountLeafs(tree.headnode);
+            PruneNodes(tree.headnode);
         }
-        ExportClipNodes(entity, tree.headnode, hullnum.value());
+        CountLeafs(tree.headnode);
+    }
+}
+
+/*
+===============
+BuildEntityTree
+
+Everything up to the output of the tree. Only touches the tree, brushes and
+map faces of the entity (and the plane table, read-only), so the trees of
+different entities or hulls can be built at the same time. The world tree of
+the main hull also writes the leak and portal files as it goes.
+===============
+*/
+static void BuildEntityTree(entity_tree_t &job, hull_index_t hullnum)
+{
+    if (!job.build) {
+        return;
+    }
+
+    // simpler operation for hulls
+    if (hullnum.value_or(0)) {
+        BuildHullTree(job, hullnum);
         return;
     }
 
+    mapentity_t &entity = *job.entity;
+    bspbrush_t::container &brushes = job.brushes;
+
     // full operation for collision (or main hull)
-    tree_t tree;
+    tree_t &tree = job.tree;
 
-    BrushBSP(tree, entity, brushes,
+    BrushBSP(tree, job.bounds, brushes,
         qbsp_options.forcegoodtree.value() ? tree_split_t::PRECISE : // we asked for the slow method
             !map.is_world_entity(entity) ? tree_split_t::FAST
                                          : // brush models are assumed to be simple
@@ -1141,7 +1266,7 @@ static void ProcessEntity(mapentity_t &entity, hull_index_t hullnum)
 
             // make a really good tree
             tree.clear();
-            BrushBSP(tree, entity, brushes, tree_split_t::PRECISE);
+            BrushBSP(tree, job.bounds, brushes, tree_split_t::PRECISE);
 
             // debug output of bspbrushes
             if (!hullnum.value_or(0)) {
@@ -1176,7 +1301,7 @@ static void ProcessEntity(mapentity_t &entity, hull_index_t hullnum)
 
         // rebuild BSP now that we've marked invisible brush sides
         tree.clear();
-        BrushBSP(tree, entity, brushes, tree_split_t::PRECISE);
+        BrushBSP(tree, job.bounds, brushes, tree_split_t::PRECISE);
     }
 
     MakeTreePortals(tree);
@@ -1241,6 +1366,35 @@ static void ProcessEntity(mapentity_t &entity, hull_index_t hullnum)
     MakeMarkFaces(tree.headnode);
 
     CountLeafs(tree.headnode);
+}
+
+/*
+===============
+ExportEntityTree
+
+Outputs a built tree; called in entity order, since this is where the
+vertices, edges, faces, nodes and clipnodes of the entity are numbered.
+===============
+*/
+static void ExportEntityTree(entity_tree_t &job, hull_index_t hullnum)
+{
+    mapentity_t &entity = *job.entity;
+    tree_t &tree = job.tree;
+
+    entity.bounds = job.bounds;
+
+    if (job.leak) {
+        WriteLeak(*job.leak);
+    }
+
+    if (!job.build) {
+        return;
+    }
+
+    if (hullnum.value_or(0)) {
+        ExportClipNodes(entity, tree.headnode, hullnum.value());
+        return;
+    }
 
     // output vertices first, since TJunc needs it
     EmitVertices(tree.headnode);
@@ -1264,6 +1418,23 @@ static void ProcessEntity(mapentity_t &entity, hull_index_t hullnum)
     FreeTreePortals(tree);
 }
 
+/*
+===============
+ProcessEntity
+===============
+*/
+static void ProcessEntity(mapentity_t &entity, hull_index_t hullnum)
+{
+    if (!EntityHasGeometry(entity)) {
+        return;
+    }
+
+    entity_tree_t job;
+    LoadEntityTree(job, entity, hullnum);
+    BuildEntityTree(job, hullnum);
+    ExportEntityTree(job, hullnum);
+}
+
 /*
 =================
 UpdateEntLump
@@ -1453,6 +1624,156 @@ static void BSPX_CreateBrushList()
     map.exported_bspxbrushes = StringToVector(str.str());
 }
 
+/*
+=================
+WantsLogging
+
+Decides if we want to log this entity / hull combination
+=================
+*/
+static bool WantsLogging(const mapentity_t &entity, hull_index_t hullnum)
+{
+    bool wants_logging = true;
+
+    if (!map.is_world_entity(entity)) {
+        wants_logging = wants_logging && qbsp_options.logbmodels.value();
+    }
+    if (hullnum.value_or(0)) {
+        wants_logging = wants_logging && qbsp_options.loghulls.value();
+    }
+
+    return wants_logging;
+}
+
+// what's left of the log for the entities and hulls we don't want to log
+static bitflags<logging::flag> QuietLoggingMask()
+{
+    return logging::mask &
+           ~(bitflags<logging::flag>(logging::flag::STAT) | logging::flag::PROGRESS | logging::flag::CLOCK_ELAPSED);
+}
+
+// threads building trees in the quiet arena keep quiet, like the entities
+// and hulls we don't want to log; the progress bar is left to the caller
+class quiet_logging_observer_t : public tbb::task_scheduler_observer
+{
+public:
+    // set before any trees are built
+    bitflags<logging::flag> mask;
+
+    quiet_logging_observer_t(tbb::task_arena &arena)
+        : tbb::task_scheduler_observer(arena)
+    {
+        arena.initialize();
+        observe(true);
+    }
+
+    ~quiet_logging_observer_t() { observe(false); }
+
+    void on_scheduler_entry(bool) override { logging::thread_mask = mask; }
+    void on_scheduler_exit(bool) override { logging::thread_mask = std::nullopt; }
+};
+
+// kept for the lifetime of the process, so every thread leaving the arena
+// is seen by the observer and gets its mask back
+struct quiet_arena_t
+{
+    tbb::task_arena arena;
+    quiet_logging_observer_t observer{arena};
+};
+
+static quiet_arena_t &QuietArena()
+{
+    static quiet_arena_t quiet_arena;
+    return quiet_arena;
+}
+
+// starts building the trees in the quiet arena; wait on `group` from within
+// the arena
+static void BuildEntityTreesQuietly(tbb::task_group &group, std::list<entity_tree_t> &trees,
+    std::list<entity_tree_t>::iterator first, hull_index_t hullnum)
+{
+    QuietArena().arena.execute([&]() {
+        for (auto it = first; it != trees.end(); ++it) {
+            group.run([&job = *it, hullnum]() { BuildEntityTree(job, hullnum); });
+        }
+    });
+}
+
+/*
+=================
+LoadHullTrees
+
+Loads the trees of the entities with geometry in one hull, adding their
+planes
+=================
+*/
+static std::list<entity_tree_t> LoadHullTrees(hull_index_t hullnum)
+{
+    std::list<entity_tree_t> trees;
+
+    for (auto &entity : map.entities) {
+        if (!EntityHasGeometry(entity)) {
+            continue;
+        }
+
+        const auto prev_logging_mask = logging::mask;
+        if (!WantsLogging(entity, hullnum)) {
+            logging::mask = QuietLoggingMask();
+        }
+
+        LoadEntityTree(trees.emplace_back(), entity, hullnum);
+
+        logging::mask = prev_logging_mask;
+    }
+
+    return trees;
+}
+
+/*
+=================
+BuildHullTrees
+
+Unless -logbmodels asks for their output, the brush model trees are built
+in the quiet arena while the world is built on this thread. The trees are
+still loaded and output in entity order, which is all that numbers the
+planes, vertices, faces and nodes, so the .bsp comes out the same.
+=================
+*/
+static void BuildHullTrees(std::list<entity_tree_t> &trees, hull_index_t hullnum)
+{
+    // the world always has geometry, and comes first
+    entity_tree_t &world = trees.front();
+    Q_assert(map.is_world_entity(*world.entity));
+
+    tbb::task_group group;
+    BuildEntityTreesQuietly(group, trees, std::next(trees.begin()), hullnum);
+
+    {
+        const auto prev_logging_mask = logging::mask;
+        if (!WantsLogging(*world.entity, hullnum)) {
+            logging::mask = QuietLoggingMask();
+        }
+
+        BuildEntityTree(world, hullnum);
+
+        logging::mask = prev_logging_mask;
+    }
+
+    QuietArena().arena.execute([&]() { group.wait(); });
+
+    // free each tree once it's output
+    for (; !trees.empty(); trees.pop_front()) {
+        const auto prev_logging_mask = logging::mask;
+        if (!WantsLogging(*trees.front().entity, hullnum)) {
+            logging::mask = QuietLoggingMask();
+        }
+
+        ExportEntityTree(trees.front(), hullnum);
+
+        logging::mask = prev_logging_mask;
+    }
+}
+
 /*
 =================
 CreateSingleHull
@@ -1466,29 +1787,71 @@ static void CreateSingleHull(hull_index_t hullnum)
         logging::print("Processing map...\n");
     }
 
-    // for each entity in the map file that has geometry
-    for (auto &entity : map.entities) {
-        bool wants_logging = true;
+    // process the entities one after another, so their output isn't interleaved
+    if (qbsp_options.logbmodels.value() && (!hullnum.value_or(0) || qbsp_options.loghulls.value())) {
+        // for each entity in the map file that has geometry
+        for (auto &entity : map.entities) {
+            // update logging mask if requested
+            const auto prev_logging_mask = logging::mask;
+            if (!WantsLogging(entity, hullnum)) {
+                logging::mask = QuietLoggingMask();
+            }
 
-        // decide if we want to log this entity / hull combination
-        if (!map.is_world_entity(entity)) {
-            wants_logging = wants_logging && qbsp_options.logbmodels.value();
-        }
-        if (hullnum.value_or(0)) {
-            wants_logging = wants_logging && qbsp_options.loghulls.value();
-        }
+            ProcessEntity(entity, hullnum);
 
-        // update logging mask if requested
-        const auto prev_logging_mask = logging::mask;
-        if (!wants_logging) {
-            logging::mask &= ~(
-                bitflags<logging::flag>(logging::flag::STAT) | logging::flag::PROGRESS | logging::flag::CLOCK_ELAPSED);
+            // restore logging
+            logging::mask = prev_logging_mask;
         }
 
-        ProcessEntity(entity, hullnum);
+        return;
+    }
 
-        // restore logging
-        logging::mask = prev_logging_mask;
+    std::list<entity_tree_t> trees = LoadHullTrees(hullnum);
+    BuildHullTrees(trees, hullnum);
+}
+
+/*
+=================
+CreateHullsConcurrently
+
+Builds the collision hulls in the quiet arena while the main hull is
+created.
+
+All the hulls are loaded up front, main hull first, so the planes are added
+to the plane table in the same order as when the hulls are created one after
+another. That order matters: of two planes within epsilon of each other, the
+one added first is the one both use. Building the trees only looks planes
+up. The clipnodes (and any leak of a collision hull) are written in hull
+order once the main hull is done.
+=================
+*/
+static void CreateHullsConcurrently(size_t numhulls)
+{
+    logging::print("Processing hull 0...\n");
+
+    std::list<entity_tree_t> main_hull = LoadHullTrees(0);
+    std::vector<std::list<entity_tree_t>> collision_hulls(numhulls);
+
+    for (size_t i = 1; i < numhulls; i++) {
+        logging::print("Loading hull {}...\n", i);
+        collision_hulls[i] = LoadHullTrees(i);
+    }
+
+    logging::print("Processing hulls 1-{} on other threads...\n", numhulls - 1);
+
+    tbb::task_group group;
+    for (size_t i = 1; i < numhulls; i++) {
+        BuildEntityTreesQuietly(group, collision_hulls[i], collision_hulls[i].begin(), i);
+    }
+
+    BuildHullTrees(main_hull, 0);
+
+    QuietArena().arena.execute([&]() { group.wait(); });
+
+    for (size_t i = 1; i < numhulls; i++) {
+        for (; !collision_hulls[i].empty(); collision_hulls[i].pop_front()) {
+            ExportEntityTree(collision_hulls[i].front(), i);
+        }
     }
 }
 
@@ -1499,24 +1862,30 @@ CreateHulls
 */
 static void CreateHulls(void)
 {
-    /* create the hulls sequentially */
     auto &hulls = qbsp_options.target_game->get_hull_sizes();
 
+    ReserveEntityModels();
+
+    QuietArena().observer.mask = QuietLoggingMask() & ~bitflags<logging::flag>(logging::flag::PERCENT);
+
     // game has no hulls, so we have to export brush lists and stuff.
     if (!hulls.size()) {
         CreateSingleHull(std::nullopt);
-        return;
-    }
-
-    // all the hulls
-    for (size_t i = 0; i < hulls.size(); i++) {
-        CreateSingleHull(i);
-
+    } else if (qbsp_options.noclip.value()) {
         // only create hull 0 if fNoclip is set
-        if (qbsp_options.noclip.value()) {
-            break;
+        CreateSingleHull(0);
+    } else if (hulls.size() == 1 || qbsp_options.loghulls.value() || qbsp_options.logbmodels.value()) {
+        // create the hulls sequentially, so their output isn't interleaved;
+        // -logbmodels adds the main hull's planes entity by entity, which
+        // can't be done ahead of the collision hulls
+        for (size_t i = 0; i < hulls.size(); i++) {
+            CreateSingleHull(i);
         }
+    } else {
+        CreateHullsConcurrently(hulls.size());
     }
+
+    SetDiscardedTriggerBounds();
 }
 
 // Fill the BSP's `dtex` data
@@ -42,6 +42,47 @@ node_t *tree_t::create_node()
     return &(*it);
 }
 
+bspbrush_t::ptr tree_t::create_brush_fragment()
+{
+    auto &recycled = recycled_brush_fragments.local();
+    bspbrush_t *brush;
+
+    if (!recycled.empty()) {
+        brush = recycled.back();
+        recycled.pop_back();
+    } else {
+        brush = &(*brush_fragments.grow_by(1));
+    }
+
+    // aliasing constructor with an empty owner: no control block, so copies
+    // of the handle don't count references
+    return bspbrush_t::ptr(bspbrush_t::ptr(), brush);
+}
+
+void tree_t::recycle_brush_fragment(const bspbrush_t::ptr &brush)
+{
+    // an owning pointer is a brush from outside of the tree
+    if (!brush || brush.use_count()) {
+        return;
+    }
+
+    // keep the storage of the sides for the next fragment
+    auto sides = std::move(brush->sides);
+    sides.clear();
+    *brush = bspbrush_t{};
+    brush->sides = std::move(sides);
+
+    recycled_brush_fragments.local().push_back(brush.get());
+}
+
+void tree_t::free_brush_fragments()
+{
+    recycled_brush_fragments.clear();
+
+    // clear() would keep the storage
+    tbb::concurrent_vector<bspbrush_t>().swap(brush_fragments);
+}
+
 void tree_t::clear()
 {
     headnode = nullptr;
@@ -50,6 +91,7 @@ void tree_t::clear()
 
     FreeTreePortals(*this);
     nodes.clear();
+    free_brush_fragments();
 }
 
 /*
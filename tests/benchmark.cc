@@ -1,10 +1,21 @@
 #include <nanobench.h>
 #include <doctest/doctest.h>
 #include <vis/vis.hh>
+#include <light/light.hh>
+#include <light/ltface.hh>
+#include <qbsp/qbsp.hh>
+#include <qbsp/epsilonhash.hh>
+#include <qbsp/map.hh>
 #include <common/qvec.hh>
 #include <common/polylib.hh>
+#include <testmaps.hh>
+#include "test_qbsp.hh"
+
+#include <pareto/spatial_map.h>
 
 #include <array>
+#include <bit>
+#include <map>
 #include <vector>
 
 TEST_CASE("winding" * doctest::test_suite("benchmark") * doctest::skip())
@@ -141,6 +152,295 @@ TEST_CASE("vis windings")
         FreeStackWinding(w1, stack);
         ankerl::nanobench::doNotOptimizeAway(stack);
     });
+
+    // cached separators of a 12-point winding; most cut its bounding sphere
+    // but leave it whole, as most separators do
+    std::vector<qplane3d> separators;
+    for (int i = 0; i < 12; i++) {
+        const vec_t angle = i * (Q_PI / 6);
+        separators.emplace_back(qv::normalize(qvec3d(cos(angle), sin(angle), 1)), -50);
+    }
+    separators.emplace_back(qplane3d({-1, 0, 0}, -16));
+
+    auto setup_separators_winding = [](pstack_t &stack) {
+        for (int i = 0; i < 3; ++i)
+            stack.windings_used[i] = false;
+
+        auto *w = AllocStackWinding(stack);
+        w->numpoints = 12;
+        for (int i = 0; i < 12; i++) {
+            const vec_t angle = i * (Q_PI / 6);
+            w->points[i] = {64 * cos(angle), 64 * sin(angle), 0};
+        }
+        w->set_winding_sphere();
+        return w;
+    };
+
+    b.run("setup + ClipStackWinding x 13 separators", [&]() {
+        visstats_t stats;
+        pstack_t stack;
+        auto *w = setup_separators_winding(stack);
+
+        for (const auto &sep : separators) {
+            w = ClipStackWinding(stats, w, stack, sep);
+            if (!w)
+                break;
+        }
+        ankerl::nanobench::doNotOptimizeAway(w);
+    });
+
+    b.run("setup + ClipStackWindingPlanes, 13 separators", [&]() {
+        visstats_t stats;
+        pstack_t stack;
+        auto *w = setup_separators_winding(stack);
+
+        w = ClipStackWindingPlanes(stats, w, stack, separators.data(), separators.size());
+        ankerl::nanobench::doNotOptimizeAway(w);
+    });
+}
+
+TEST_CASE("vis flow throughput" * doctest::test_suite("benchmark") * doctest::skip())
+{
+    // qbsp once per map; only the full vis of the .prt is timed
+    LoadTestmapQ2("base1-test.map");
+    const fs::path q2_bsp = qbsp_options.bsp_path;
+    LoadTestmapQ1("E1M1-edited-ents.map");
+    const fs::path q1_bsp = qbsp_options.bsp_path;
+
+    ankerl::nanobench::Bench bench;
+    bench.unit("portal").epochs(3);
+
+    for (const fs::path &bsp_path : {q2_bsp, q1_bsp}) {
+        const std::vector<std::string> args{"", "-threads", "1", "-nostate", bsp_path.string()};
+
+        // warm up and count the portals
+        vis_main(args);
+
+        bench.batch(static_cast<uint32_t>(numportals * 2));
+        bench.run(fmt::format("vis (full, {})", fs::path(bsp_path).replace_extension(".prt").filename().string()),
+            [&]() { vis_main(args); });
+    }
+}
+
+TEST_CASE("leafbits kernels" * doctest::test_suite("benchmark"))
+{
+    // a large map's worth of clusters
+    constexpr size_t numleafs = 32768;
+    constexpr size_t numblocks = (numleafs + leafbits_t::mask) >> leafbits_t::shift;
+
+    leafbits_t a(numleafs), b(numleafs), dst(numleafs);
+    for (size_t i = 0; i < numleafs; i += 3)
+        a[i] = true;
+    for (size_t i = 0; i < numleafs; i += 5)
+        b[i] = true;
+
+    ankerl::nanobench::Bench bench;
+    bench.batch(numblocks).unit("block");
+
+    bench.run("or, scalar", [&]() {
+        for (size_t i = 0; i < numblocks; i++)
+            dst.data()[i] |= a.data()[i];
+        bench.doNotOptimizeAway(dst.data()[0]);
+    });
+    bench.run("or, LeafBits_Or", [&]() {
+        LeafBits_Or(dst.data(), a.data(), numblocks);
+        bench.doNotOptimizeAway(dst.data()[0]);
+    });
+
+    bench.run("and-not, scalar", [&]() {
+        uint32_t any = 0;
+        for (size_t i = 0; i < numblocks; i++) {
+            dst.data()[i] = a.data()[i] & ~b.data()[i];
+            any |= dst.data()[i];
+        }
+        bench.doNotOptimizeAway(any);
+    });
+    bench.run("and-not, LeafBits_AndNot", [&]() {
+        bench.doNotOptimizeAway(LeafBits_AndNot(dst.data(), a.data(), b.data(), numblocks));
+    });
+
+    bench.run("and + new bits, scalar", [&]() {
+        uint32_t more = 0;
+        for (size_t i = 0; i < numblocks; i++) {
+            dst.data()[i] = a.data()[i] & b.data()[i];
+            more |= dst.data()[i] & ~a.data()[i];
+        }
+        bench.doNotOptimizeAway(more);
+    });
+    bench.run("and + new bits, LeafBits_AndHasNew", [&]() {
+        bench.doNotOptimizeAway(LeafBits_AndHasNew(dst.data(), a.data(), b.data(), a.data(), numblocks));
+    });
+
+    bench.run("popcount, scalar", [&]() {
+        size_t count = 0;
+        for (size_t i = 0; i < numblocks; i++)
+            count += std::popcount(a.data()[i]);
+        bench.doNotOptimizeAway(count);
+    });
+    bench.run("popcount, LeafBits_Popcount", [&]() {
+        bench.doNotOptimizeAway(LeafBits_Popcount(a.data(), numblocks));
+    });
+
+    CHECK(LeafBits_Popcount(a.data(), numblocks) == (numleafs + 2) / 3);
+    CHECK(LeafBits_AndNot(dst.data(), a.data(), b.data(), numblocks));
+    CHECK(LeafBits_Popcount(dst.data(), numblocks) == (numleafs + 2) / 3 - (numleafs + 14) / 15);
+    CHECK(!LeafBits_AnyAndNot(dst.data(), a.data(), numblocks));
+}
+
+TEST_CASE("qbsp (full)" * doctest::test_suite("benchmark") * doctest::skip())
+{
+    // whole runs, since BrushBSP's splits are spread over every pass of it
+    const std::vector<std::vector<std::string>> runs{
+        {"-q2bsp", "base1-test.map"},
+        {"E1M1-edited-ents.map"},
+    };
+
+    ankerl::nanobench::Bench bench;
+    bench.epochs(3);
+
+    for (const auto &run : runs) {
+        const auto map_path = fs::path(testmaps_dir) / run.back();
+        auto bsp_path = map_path;
+        bsp_path.replace_extension(".bsp");
+
+        std::vector<std::string> args{"", "-noverbose"};
+        args.insert(args.end(), run.begin(), run.end() - 1);
+        args.push_back(map_path.string());
+        args.push_back(bsp_path.string());
+
+        bench.run("qbsp " + run.back(), [&]() {
+            InitQBSP(args);
+            ProcessFile();
+        });
+    }
+}
+
+// what mapdata_t did with spatial_map: a lookup of the epsilon box, then an
+// insert if it wasn't there. returns the number of duplicates
+template<size_t N>
+static size_t SpatialMapDedup(const std::vector<qvec<vec_t, N>> &points, const qvec<vec_t, N> &epsilon)
+{
+    pareto::spatial_map<vec_t, N, size_t> hash;
+    size_t found = 0;
+
+    for (size_t i = 0; i < points.size(); i++) {
+        pareto::point<vec_t, N> min, max, point;
+        for (size_t j = 0; j < N; j++) {
+            min[j] = points[i][j] - epsilon[j] * 0.5;
+            max[j] = points[i][j] + epsilon[j] * 0.5;
+            point[j] = points[i][j];
+        }
+
+        if (hash.find_intersection(min, max) != hash.end()) {
+            found++;
+        } else {
+            hash.emplace(point, i);
+        }
+    }
+
+    return found;
+}
+
+template<size_t N>
+static size_t EpsilonHashDedup(const std::vector<qvec<vec_t, N>> &points, const qvec<vec_t, N> &epsilon)
+{
+    epsilon_hash_t<N, size_t> hash(epsilon);
+    size_t found = 0;
+
+    for (size_t i = 0; i < points.size(); i++) {
+        if (hash.find(points[i])) {
+            found++;
+        } else {
+            hash.insert(points[i], i);
+        }
+    }
+
+    return found;
+}
+
+TEST_CASE("plane and vertex hash, spatial_map vs epsilon_hash_t" * doctest::test_suite("benchmark"))
+{
+    // the planes and vertices of a large map
+    const auto [bsp, bspx, prt] = LoadTestmapQ2("base1-test.map");
+
+    std::vector<qvec4d> planes;
+    for (const auto &plane : bsp.dplanes) {
+        planes.emplace_back(plane.normal[0], plane.normal[1], plane.normal[2], plane.dist);
+        planes.emplace_back(-plane.normal[0], -plane.normal[1], -plane.normal[2], -plane.dist);
+    }
+    std::vector<qvec3d> vertices;
+    for (const auto &vertex : bsp.dvertexes) {
+        vertices.emplace_back(vertex);
+    }
+
+    const qvec4d plane_epsilon{NORMAL_EPSILON, NORMAL_EPSILON, NORMAL_EPSILON, DIST_EPSILON};
+    const qvec3d vertex_epsilon{POINT_EQUAL_EPSILON, POINT_EQUAL_EPSILON, POINT_EQUAL_EPSILON};
+
+    // both find the same duplicates
+    CHECK(SpatialMapDedup(planes, plane_epsilon) == EpsilonHashDedup(planes, plane_epsilon));
+    CHECK(SpatialMapDedup(vertices, vertex_epsilon) == EpsilonHashDedup(vertices, vertex_epsilon));
+
+    ankerl::nanobench::Bench bench;
+    bench.unit("lookup").epochs(5);
+
+    bench.batch(planes.size());
+    bench.run("planes, spatial_map", [&]() { bench.doNotOptimizeAway(SpatialMapDedup(planes, plane_epsilon)); });
+    bench.run("planes, epsilon_hash_t", [&]() { bench.doNotOptimizeAway(EpsilonHashDedup(planes, plane_epsilon)); });
+
+    bench.batch(vertices.size());
+    bench.run(
+        "vertices, spatial_map", [&]() { bench.doNotOptimizeAway(SpatialMapDedup(vertices, vertex_epsilon)); });
+    bench.run("vertices, epsilon_hash_t",
+        [&]() { bench.doNotOptimizeAway(EpsilonHashDedup(vertices, vertex_epsilon)); });
+}
+
+TEST_CASE("edge emission, std::map vs hashedge_table_t" * doctest::test_suite("benchmark"))
+{
+    // the face edges of a large map, in emission order
+    const auto [bsp, bspx, prt] = LoadTestmapQ2("base1-test.map");
+
+    std::vector<std::pair<size_t, size_t>> face_edges;
+    for (int32_t surfedge : bsp.dsurfedges) {
+        const auto &edge = bsp.dedges[std::abs(surfedge)];
+        face_edges.emplace_back(surfedge < 0 ? edge[1] : edge[0], surfedge < 0 ? edge[0] : edge[1]);
+    }
+
+    // only the pointer is used
+    const face_t face{};
+
+    // what GetEdge does: reuse the edge going the other way, or add this one
+    auto emit_map = [&]() {
+        std::map<std::pair<size_t, size_t>, hashedge_t> hashedges;
+        int64_t numedges = 0;
+
+        for (auto [v1, v2] : face_edges) {
+            if (hashedges.find(std::make_pair(v2, v1)) == hashedges.end()) {
+                hashedges.emplace(std::make_pair(v1, v2), hashedge_t{v1, v2, numedges++, &face});
+            }
+        }
+
+        return numedges;
+    };
+    auto emit_table = [&]() {
+        hashedge_table_t hashedges;
+        hashedges.reserve(face_edges.size());
+        int64_t numedges = 0;
+
+        for (auto [v1, v2] : face_edges) {
+            if (!hashedges.find(v2, v1)) {
+                hashedges.emplace(hashedge_t{v1, v2, numedges++, &face});
+            }
+        }
+
+        return numedges;
+    };
+
+    CHECK(emit_map() == emit_table());
+
+    ankerl::nanobench::Bench bench;
+    bench.batch(face_edges.size()).unit("edge").epochs(5);
+    bench.run("edges, std::map", [&]() { bench.doNotOptimizeAway(emit_map()); });
+    bench.run("edges, hashedge_table_t", [&]() { bench.doNotOptimizeAway(emit_table()); });
 }
 
 TEST_CASE("vector math")
@@ -164,3 +464,30 @@ TEST_CASE("vector math")
     b.doNotOptimizeAway(vec0);
     b.doNotOptimizeAway(vec1);
 }
+
+TEST_CASE("light rays/sec, per-face raystreams vs -wavefront" * doctest::test_suite("benchmark") * doctest::skip())
+{
+    // compile once; only the relight is timed
+    QbspVisLight_Q2("base1-test.map", {});
+
+    const auto bsp_path = fs::path(qbsp_options.bsp_path);
+    const auto wal_metadata_path = std::filesystem::path(testmaps_dir) / "q2_wal_metadata";
+
+    ankerl::nanobench::Bench bench;
+    bench.unit("ray").epochs(3);
+
+    for (const bool wavefront : {false, true}) {
+        std::vector<std::string> args{"", "-nodefaultpaths", "-path", wal_metadata_path.string()};
+        if (wavefront) {
+            args.push_back("-wavefront");
+        }
+        args.push_back(bsp_path.string());
+
+        // warm up and count the point light rays
+        light_main(args);
+        bench.batch(static_cast<uint32_t>(total_light_rays));
+
+        bench.run(wavefront ? "light -wavefront" : "light (per-face raystreams)", [&]() { light_main(args); });
+    }
+}
+
@@ -1,6 +1,9 @@
 #include <doctest/doctest.h>
 
 #include <light/light.hh>
+#include <light/lightcache.hh>
+#include <light/lightindex.hh>
+#include <light/lightprofile.hh>
 #include <light/ltface.hh>
 #include <light/surflight.hh>
 #include <common/bspinfo.hh>
@@ -9,6 +12,9 @@
 #include <vis/vis.hh>
 #include "test_qbsp.hh"
 
+#include <fstream>
+#include <sstream>
+
 static testresults_t QbspVisLight_Common(const std::filesystem::path &name, std::vector<std::string> extra_qbsp_args,
     std::vector<std::string> extra_light_args, runvis_t run_vis)
 {
@@ -185,6 +191,26 @@ TEST_CASE("-world_units_per_luxel, -lightgrid")
     }
 }
 
+TEST_CASE("-lightgrid_threshold")
+{
+    auto [bsp, bspx] = QbspVisLight_Q2("q2_lightmap_custom_scale.map", {"-lightgrid"});
+    auto [sparse_bsp, sparse_bspx] =
+        QbspVisLight_Q2("q2_lightmap_custom_scale.map", {"-lightgrid", "-lightgrid_threshold", "4"});
+
+    REQUIRE(bspx.find("LIGHTGRID_OCTREE") != bspx.end());
+    REQUIRE(sparse_bspx.find("LIGHTGRID_OCTREE") != sparse_bspx.end());
+
+    // same grid, and solid classification doesn't depend on the threshold,
+    // so the octree has the same shape
+    const auto &dense = bspx.at("LIGHTGRID_OCTREE");
+    const auto &sparse = sparse_bspx.at("LIGHTGRID_OCTREE");
+    const size_t header_size = sizeof(qvec3f) + sizeof(qvec3i) + sizeof(qvec3f);
+
+    REQUIRE(dense.size() > header_size);
+    REQUIRE(sparse.size() > header_size);
+    CHECK(std::equal(dense.begin(), dense.begin() + header_size, sparse.begin()));
+}
+
 TEST_CASE("emissive cube artifacts")
 {
     // A cube with surface flags "light", value "100", placed in a hallway.
@@ -343,6 +369,190 @@ TEST_CASE("emissive lights")
     }
 }
 
+TEST_CASE("emissive lights, -lightcuts")
+{
+    auto [reference_bsp, reference_bspx] = QbspVisLight_Q2("q2_light_flush.map", {});
+    auto [bsp, bspx] = QbspVisLight_Q2("q2_light_flush.map", {"-lightcuts", "0.02"});
+    REQUIRE(bspx.empty());
+
+    {
+        INFO("close to tracing every emitter point");
+        REQUIRE(reference_bsp.dlightdata.size() == bsp.dlightdata.size());
+
+        // a cut only bounds the error of the unoccluded light, and a cluster
+        // is shadowed as a whole, so check the totals rather than each luxel:
+        // the total light within the 2% error bound, and the average luxel
+        // component within 1 of the reference
+        double reference_total = 0, total = 0, total_error = 0;
+        for (size_t i = 0; i < bsp.dlightdata.size(); i++) {
+            reference_total += reference_bsp.dlightdata[i];
+            total += bsp.dlightdata[i];
+            total_error += std::abs(static_cast<int>(reference_bsp.dlightdata[i]) - static_cast<int>(bsp.dlightdata[i]));
+        }
+        CHECK(std::abs(total - reference_total) <= 0.02 * reference_total);
+        CHECK(total_error / bsp.dlightdata.size() < 1.0);
+    }
+
+    {
+        INFO("clustered surface lights still light the angled face on the right");
+        auto *face = BSP_FindFaceAtPoint(&bsp, &bsp.dmodels[0], {244, -92, 92});
+        REQUIRE(face);
+        CheckFaceLuxelsNonBlack(bsp, *face);
+    }
+
+    {
+        INFO("clustered surface lights still light the angled face on the left");
+        auto *left_face = BSP_FindFaceAtPoint(&bsp, &bsp.dmodels[0], {470.4, 16, 112});
+        REQUIRE(left_face);
+        CheckFaceLuxelsNonBlack(bsp, *left_face);
+    }
+}
+
+TEST_CASE("-wavefront matches per-face raystreams")
+{
+    auto [bsp, bspx] = QbspVisLight_Q2("q2_light_group.map", {});
+    auto [wavefront_bsp, wavefront_bspx] = QbspVisLight_Q2("q2_light_group.map", {"-wavefront"});
+
+    CHECK(bsp.dlightdata == wavefront_bsp.dlightdata);
+}
+
+TEST_CASE("light index returns every light the full loop would")
+{
+    const std::vector<std::string> maps{
+        "q2_light_group.map",
+        "q2_light_visapprox.map" // light in liquid
+    };
+
+    for (const auto &map : maps) {
+        for (const std::string visapprox : {"vis", "rays"}) {
+            SUBCASE((map + " -visapprox " + visapprox).c_str())
+            {
+                QbspVisLight_Q2(map, {"-visapprox", visapprox, "-verifylightindex"}, runvis_t::yes);
+
+                CHECK(total_lightindex_faces > 0);
+                CHECK(total_lightindex_missed == 0);
+            }
+        }
+    }
+}
+
+TEST_CASE("-adaptive is close to -extra4")
+{
+    auto [bsp, bspx] = QbspVisLight_Q2("q2_light_group.map", {"-extra4"});
+    auto [adaptive_bsp, adaptive_bspx] = QbspVisLight_Q2("q2_light_group.map", {"-extra4", "-adaptive", "0.05"});
+
+    REQUIRE(bsp.dlightdata.size() == adaptive_bsp.dlightdata.size());
+
+    // luxels that weren't supersampled are lit from one sample instead of 16,
+    // so only check the average error
+    double total_error = 0;
+    for (size_t i = 0; i < bsp.dlightdata.size(); i++) {
+        total_error += std::abs(static_cast<int>(bsp.dlightdata[i]) - static_cast<int>(adaptive_bsp.dlightdata[i]));
+    }
+    CHECK(total_error / bsp.dlightdata.size() < 2.0);
+}
+
+TEST_CASE("lightmap allocation is deterministic")
+{
+    auto [bsp, bspx] = QbspVisLight_Q2("q2_light_group.map", {});
+    auto [bsp2, bspx2] = QbspVisLight_Q2("q2_light_group.map", {});
+
+    CHECK(bsp.dlightdata == bsp2.dlightdata);
+
+    // offsets are handed out in face order
+    int32_t last_lightofs = -1;
+    for (size_t i = 0; i < bsp.dfaces.size(); i++) {
+        CHECK(bsp.dfaces[i].lightofs == bsp2.dfaces[i].lightofs);
+
+        if (bsp.dfaces[i].lightofs != -1) {
+            CHECK(bsp.dfaces[i].lightofs > last_lightofs);
+            last_lightofs = bsp.dfaces[i].lightofs;
+        }
+    }
+}
+
+TEST_CASE("-tilesize matches")
+{
+    auto [bsp, bspx] = QbspVisLight_Q2("q2_light_group.map", {"-bounce"});
+    auto [tiled_bsp, tiled_bspx] = QbspVisLight_Q2("q2_light_group.map", {"-bounce", "-tilesize", "16"});
+
+    CHECK(bsp.dlightdata == tiled_bsp.dlightdata);
+
+    for (size_t i = 0; i < bsp.dfaces.size(); i++) {
+        CHECK(bsp.dfaces[i].lightofs == tiled_bsp.dfaces[i].lightofs);
+    }
+}
+
+TEST_CASE("-lightcache reuses unchanged faces")
+{
+    auto [bsp, bspx] = QbspVisLight_Q2("q2_light_group.map", {});
+
+    QbspVisLight_Q2("q2_light_group.map", {"-lightcache"});
+    auto [cached_bsp, cached_bspx] = QbspVisLight_Q2("q2_light_group.map", {"-lightcache"});
+
+    CHECK(total_lightcache_faces > 0);
+    CHECK(total_lightcache_hits == total_lightcache_faces);
+    CHECK(bsp.dlightdata == cached_bsp.dlightdata);
+}
+
+TEST_CASE("-lightcache matches a cold run on bmodels")
+{
+    // -extra downsamples with the occluded mask, which post-processing
+    // clears on bmodel faces; -nopercent only changes the log, so it
+    // doesn't invalidate the cache
+    auto [bsp, bspx] = QbspVisLight_Q2("q2_light_origin_brush_shadow.map", {"-extra"});
+
+    QbspVisLight_Q2("q2_light_origin_brush_shadow.map", {"-extra", "-lightcache"});
+    auto [cached_bsp, cached_bspx] =
+        QbspVisLight_Q2("q2_light_origin_brush_shadow.map", {"-extra", "-lightcache", "-nopercent"});
+
+    CHECK(total_lightcache_faces > 0);
+    CHECK(total_lightcache_hits == total_lightcache_faces);
+    CHECK(bsp.dlightdata == cached_bsp.dlightdata);
+}
+
+TEST_CASE("-lightcache misses after editing a _surface template")
+{
+    const fs::path name = "q2_lightcache_surface_template.map";
+
+    // same file name in another directory, so it writes the same .bsp and
+    // .lightcache as the original
+    const fs::path edited_dir = fs::temp_directory_path() / "ericw-tools-lightcache-test";
+    fs::create_directories(edited_dir);
+    {
+        std::ifstream in(fs::path(testmaps_dir) / name);
+        std::stringstream map;
+        map << in.rdbuf();
+
+        std::string text = map.str();
+        const std::string key = "\"light\" \"200\"";
+        const size_t pos = text.find(key);
+        REQUIRE(pos != std::string::npos);
+        text.replace(pos, key.size(), "\"light\" \"400\"");
+
+        std::ofstream out(edited_dir / name);
+        out << text;
+    }
+
+    QbspVisLight_Q2(name, {"-lightcache"});
+    auto [bsp, bspx] = QbspVisLight_Q2(edited_dir / name, {});
+    auto [cached_bsp, cached_bspx] = QbspVisLight_Q2(edited_dir / name, {"-lightcache"});
+
+    CHECK(total_lightcache_faces > 0);
+    CHECK(total_lightcache_hits == 0);
+    CHECK(bsp.dlightdata == cached_bsp.dlightdata);
+}
+
+TEST_CASE("-profile doesn't change lighting")
+{
+    auto [bsp, bspx] = QbspVisLight_Q2("q2_light_group.map", {});
+    auto [profiled_bsp, profiled_bspx] = QbspVisLight_Q2("q2_light_group.map", {"-profile"});
+
+    CHECK(Profile_Enabled());
+    CHECK(Profile_MaxFaceSeconds() > 0);
+    CHECK(bsp.dlightdata == profiled_bsp.dlightdata);
+}
+
 TEST_CASE("q2_phong_doesnt_cross_contents")
 {
     auto [bsp, bspx] = QbspVisLight_Q2("q2_phong_doesnt_cross_contents.map", {"-wrnormals"});
@@ -2,6 +2,7 @@
 
 #include <qbsp/brush.hh>
 #include <qbsp/brushbsp.hh>
+#include <qbsp/epsilonhash.hh>
 #include <qbsp/qbsp.hh>
 #include <qbsp/map.hh>
 #include <qbsp/csg.hh>
@@ -1743,6 +1744,171 @@ TEST_CASE("q1_hull1_content_types" * doctest::test_suite("testmaps_q1"))
     }
 }
 
+TEST_CASE("q1_concurrent_hulls_match_sequential" * doctest::test_suite("testmaps_q1"))
+{
+    // -loghulls creates the hulls one after another
+    const auto [sequential, sequential_bspx, sequential_prt] =
+        LoadTestmapQ1("q1_hull1_content_types.map", {"-loghulls"});
+    const auto [concurrent, concurrent_bspx, concurrent_prt] = LoadTestmapQ1("q1_hull1_content_types.map");
+
+    REQUIRE(sequential.dplanes.size() == concurrent.dplanes.size());
+    for (size_t i = 0; i < sequential.dplanes.size(); i++) {
+        CHECK(sequential.dplanes[i].normal == concurrent.dplanes[i].normal);
+        CHECK(sequential.dplanes[i].dist == concurrent.dplanes[i].dist);
+        CHECK(sequential.dplanes[i].type == concurrent.dplanes[i].type);
+    }
+
+    REQUIRE(sequential.dclipnodes.size() == concurrent.dclipnodes.size());
+    for (size_t i = 0; i < sequential.dclipnodes.size(); i++) {
+        CHECK(sequential.dclipnodes[i].planenum == concurrent.dclipnodes[i].planenum);
+        CHECK(sequential.dclipnodes[i].children == concurrent.dclipnodes[i].children);
+    }
+
+    REQUIRE(sequential.dmodels.size() == concurrent.dmodels.size());
+    for (size_t i = 0; i < sequential.dmodels.size(); i++) {
+        CHECK(sequential.dmodels[i].headnode == concurrent.dmodels[i].headnode);
+    }
+
+    CHECK(sequential.dentdata == concurrent.dentdata);
+}
+
+TEST_CASE("q1_concurrent_hulls_add_planes_in_sequential_order" * doctest::test_suite("testmaps_q1"))
+{
+    // of two planes within epsilon of each other, the one added first is the
+    // one both use. the hull 1 expansion of the bottom of the brush under
+    // the floor is within epsilon of the bottom of the world's headnode
+    // volume, so the main hull's planes have to go in first
+    const auto map_planes = []() {
+        std::vector<qplane3d> planes;
+        for (const auto &plane : map.planes) {
+            planes.emplace_back(plane.get_normal(), plane.get_dist());
+        }
+        return planes;
+    };
+
+    const auto [sequential, sequential_bspx, sequential_prt] =
+        LoadTestmapQ1("q1_concurrent_hull_planes.map", {"-loghulls"});
+    const std::vector<qplane3d> sequential_planes = map_planes();
+
+    const auto [concurrent, concurrent_bspx, concurrent_prt] = LoadTestmapQ1("q1_concurrent_hull_planes.map");
+    const std::vector<qplane3d> concurrent_planes = map_planes();
+
+    REQUIRE(sequential_planes.size() == concurrent_planes.size());
+    for (size_t i = 0; i < sequential_planes.size(); i++) {
+        INFO("plane ", i);
+        CHECK(sequential_planes[i].normal == concurrent_planes[i].normal);
+        CHECK(sequential_planes[i].dist == concurrent_planes[i].dist);
+    }
+
+    REQUIRE(sequential.dplanes.size() == concurrent.dplanes.size());
+    for (size_t i = 0; i < sequential.dplanes.size(); i++) {
+        CHECK(sequential.dplanes[i].normal == concurrent.dplanes[i].normal);
+        CHECK(sequential.dplanes[i].dist == concurrent.dplanes[i].dist);
+    }
+
+    REQUIRE(sequential.dclipnodes.size() == concurrent.dclipnodes.size());
+    for (size_t i = 0; i < sequential.dclipnodes.size(); i++) {
+        CHECK(sequential.dclipnodes[i].planenum == concurrent.dclipnodes[i].planenum);
+        CHECK(sequential.dclipnodes[i].children == concurrent.dclipnodes[i].children);
+    }
+}
+
+TEST_CASE("q1_concurrent_bmodels_match_sequential" * doctest::test_suite("testmaps_q1"))
+{
+    // -logbmodels processes the bmodels one after another
+    const auto [sequential, sequential_bspx, sequential_prt] =
+        LoadTestmapQ1("q1_hull1_content_types.map", {"-logbmodels"});
+    const auto [concurrent, concurrent_bspx, concurrent_prt] = LoadTestmapQ1("q1_hull1_content_types.map");
+
+    REQUIRE(sequential.dmodels.size() == concurrent.dmodels.size());
+    for (size_t i = 0; i < sequential.dmodels.size(); i++) {
+        CHECK(sequential.dmodels[i].headnode == concurrent.dmodels[i].headnode);
+        CHECK(sequential.dmodels[i].firstface == concurrent.dmodels[i].firstface);
+        CHECK(sequential.dmodels[i].numfaces == concurrent.dmodels[i].numfaces);
+    }
+
+    REQUIRE(sequential.dplanes.size() == concurrent.dplanes.size());
+    for (size_t i = 0; i < sequential.dplanes.size(); i++) {
+        CHECK(sequential.dplanes[i].normal == concurrent.dplanes[i].normal);
+        CHECK(sequential.dplanes[i].dist == concurrent.dplanes[i].dist);
+    }
+
+    CHECK(sequential.dvertexes == concurrent.dvertexes);
+    CHECK(sequential.dsurfedges == concurrent.dsurfedges);
+    CHECK(sequential.dleaffaces == concurrent.dleaffaces);
+
+    REQUIRE(sequential.dnodes.size() == concurrent.dnodes.size());
+    for (size_t i = 0; i < sequential.dnodes.size(); i++) {
+        CHECK(sequential.dnodes[i].planenum == concurrent.dnodes[i].planenum);
+        CHECK(sequential.dnodes[i].children == concurrent.dnodes[i].children);
+    }
+
+    REQUIRE(sequential.dfaces.size() == concurrent.dfaces.size());
+    for (size_t i = 0; i < sequential.dfaces.size(); i++) {
+        CHECK(sequential.dfaces[i].planenum == concurrent.dfaces[i].planenum);
+        CHECK(sequential.dfaces[i].firstedge == concurrent.dfaces[i].firstedge);
+        CHECK(sequential.dfaces[i].numedges == concurrent.dfaces[i].numedges);
+        CHECK(sequential.dfaces[i].texinfo == concurrent.dfaces[i].texinfo);
+    }
+}
+
+TEST_CASE("epsilon_hash_t")
+{
+    epsilon_hash_t<3, size_t> hash({0.1, 0.1, 0.1});
+
+    hash.insert({0, 0, 0}, 5);
+    hash.insert({10, 0, 0}, 6);
+    CHECK(hash.size() == 2);
+
+    CHECK(hash.find({0, 0, 0}) == 5);
+    CHECK(hash.find({0.04, -0.04, 0.04}) == 5);
+    CHECK(hash.find({0.06, 0, 0}) == std::nullopt);
+    CHECK(hash.find({9.96, 0, 0}) == 6);
+
+    // matches on both sides of a cell edge (cells are 0.4 wide, centered on 0)
+    hash.insert({0.21, 1, 1}, 7);
+    CHECK(hash.find({0.19, 1, 1}) == 7);
+    hash.insert({0.18, 2, 2}, 8);
+    CHECK(hash.find({0.22, 2, 2}) == 8);
+
+    // the smallest value wins if more than one point matches
+    hash.insert({0.03, 0, 0}, 3);
+    CHECK(hash.find({0.02, 0, 0}) == 3);
+    CHECK(hash.find({-0.04, 0, 0}) == 5);
+}
+
+TEST_CASE("hashedge_table_t")
+{
+    const face_t face1{}, face2{};
+
+    hashedge_table_t table;
+    CHECK(table.find(1, 2) == nullptr);
+
+    table.emplace(hashedge_t{1, 2, 0, &face1});
+    table.emplace(hashedge_t{2, 1, 1, &face1});
+    // the first edge added is kept
+    table.emplace(hashedge_t{1, 2, 2, &face2});
+    CHECK(table.size() == 2);
+
+    REQUIRE(table.find(1, 2) != nullptr);
+    CHECK(table.find(1, 2)->edge_index == 0);
+    CHECK(table.find(1, 2)->face == &face1);
+    CHECK(table.find(2, 1)->edge_index == 1);
+    CHECK(table.find(2, 3) == nullptr);
+
+    // grows past its reserved size
+    for (size_t i = 0; i < 1000; i++) {
+        table.emplace(hashedge_t{i + 10, i + 11, static_cast<int64_t>(i + 10), &face2});
+    }
+    CHECK(table.size() == 1002);
+    CHECK(table.find(1, 2)->edge_index == 0);
+    CHECK(table.find(500, 501)->edge_index == 500);
+
+    table.clear();
+    CHECK(table.empty());
+    CHECK(table.find(1, 2) == nullptr);
+}
+
 TEST_CASE("BrushFromBounds")
 {
     map.reset();
@@ -1,12 +1,69 @@
+#include <common/bspfile.hh>
 #include <common/bsputils.hh>
 #include <common/qvec.hh>
 
+#include <chrono>
 #include <stdexcept>
+#include <testmaps.hh>
 #include <vis/vis.hh>
+#include <vis/viscost.hh>
+
+#include <tbb/task_arena.h>
 
 #include "test_qbsp.hh"
 #include "testutils.hh"
 
+// the .bsp LoadTestmap writes for a test map
+static fs::path TestmapBsp(const fs::path &name)
+{
+    return (fs::path(testmaps_dir) / name).replace_extension(".bsp");
+}
+
+/*
+ * Runs vis on a .bsp and returns the vis data it wrote. With single_thread
+ * vis runs in a one-thread arena, which is -threads 1 without limiting the
+ * tests that run after it in the same process.
+ */
+static mvis_t RunVis(fs::path bsp_path, std::vector<std::string> extra_args, bool single_thread = false)
+{
+    std::vector<std::string> args{""}; // the exe path, which we're ignoring in this case
+    args.insert(args.end(), extra_args.begin(), extra_args.end());
+    args.push_back(bsp_path.string());
+
+    if (single_thread) {
+        tbb::task_arena arena(1);
+        arena.execute([&args]() { vis_main(args); });
+    } else {
+        vis_main(args);
+    }
+
+    bspdata_t bspdata;
+    LoadBSPFile(bsp_path, &bspdata);
+    ConvertBSPFormat(&bspdata, &bspver_generic);
+
+    return std::move(std::get<mbsp_t>(bspdata.bsp).dvis);
+}
+
+// decompressed rows of one of the Quake II vis types
+static std::vector<std::vector<uint8_t>> DecompressRows(const mvis_t &vis, vistype_t type)
+{
+    const size_t numclusters = vis.bit_offsets.size();
+    std::vector<std::vector<uint8_t>> rows(numclusters, std::vector<uint8_t>((numclusters + 7) / 8));
+
+    for (size_t i = 0; i < numclusters; i++) {
+        DecompressVis(vis.bits.data() + vis.get_bit_offset(type, i), vis.bits.data() + vis.bits.size(),
+            rows[i].data(), rows[i].data() + rows[i].size());
+    }
+
+    return rows;
+}
+
+static void CheckSameVis(const mvis_t &a, const mvis_t &b)
+{
+    CHECK(a.bit_offsets == b.bit_offsets);
+    CHECK(a.bits == b.bits);
+}
+
 TEST_CASE("q2_detail_leak_test.map")
 {
     auto [bsp, bspx] = QbspVisLight_Q2("q2_detail_leak_test.map", {}, runvis_t::yes);
@@ -69,3 +126,212 @@ TEST_CASE("ClipStackWinding") {
 
     FreeStackWinding(w1, stack);
 }
+
+TEST_CASE("ClipStackWindingPlanes")
+{
+    // an octagon, and planes that cut its bounding sphere without touching it,
+    // then one that clips it, then more that miss it again
+    std::vector<qplane3d> planes;
+    for (int i = 0; i < 8; i++) {
+        const vec_t angle = i * (Q_PI / 4);
+        planes.emplace_back(qv::normalize(qvec3d(cos(angle), sin(angle), 1)), -50);
+    }
+    planes.insert(planes.begin() + 4, qplane3d({-1, 0, 0}, -16));
+
+    auto make_octagon = [](pstack_t &stack) {
+        auto *w = AllocStackWinding(stack);
+        w->numpoints = 8;
+        for (int i = 0; i < 8; i++) {
+            const vec_t angle = i * (Q_PI / 4);
+            w->points[i] = {64 * cos(angle), 64 * sin(angle), 0};
+        }
+        w->set_winding_sphere();
+        return w;
+    };
+
+    pstack_t stack1{}, stack2{};
+    visstats_t stats{};
+
+    auto *w1 = make_octagon(stack1);
+    for (const auto &plane : planes) {
+        w1 = ClipStackWinding(stats, w1, stack1, plane);
+        REQUIRE(w1);
+    }
+
+    auto *w2 = make_octagon(stack2);
+    w2 = ClipStackWindingPlanes(stats, w2, stack2, planes.data(), planes.size());
+    REQUIRE(w2);
+
+    REQUIRE(w1->size() == w2->size());
+    for (size_t i = 0; i < w1->size(); i++) {
+        CHECK((*w1)[i] == (*w2)[i]);
+    }
+    CHECK(w2->size() == 7);
+
+    // clipped away entirely
+    const qplane3d away({0, 0, -1}, 8);
+    CHECK(!ClipStackWindingPlanes(stats, w2, stack2, &away, 1));
+}
+
+TEST_CASE("vis -threads 1 matches the default thread count")
+{
+    // on large maps the order portals complete in can change the PVS a
+    // little (with the old scheduler too), but not on a map this size
+    LoadTestmapQ2("q2_light_translucency.map");
+    const fs::path bsp_path = TestmapBsp("q2_light_translucency.map");
+
+    const mvis_t threaded = RunVis(bsp_path, {});
+    const mvis_t single = RunVis(bsp_path, {}, true);
+
+    REQUIRE(!threaded.bits.empty());
+    CheckSameVis(threaded, single);
+}
+
+TEST_CASE("vis with the portal BVH matches testing every portal")
+{
+    LoadTestmapQ2("q2_light_translucency.map");
+    const fs::path bsp_path = TestmapBsp("q2_light_translucency.map");
+
+    // single threaded, so only the base vis can make a difference
+    for (const std::vector<std::string> &args : {std::vector<std::string>{}, {"-visdist", "256"}}) {
+        std::vector<std::string> nobvh_args = args;
+        nobvh_args.push_back("-noportalbvh");
+
+        const mvis_t bvh = RunVis(bsp_path, args, true);
+        const mvis_t nobvh = RunVis(bsp_path, nobvh_args, true);
+
+        REQUIRE(!bvh.bits.empty());
+        CheckSameVis(bvh, nobvh);
+    }
+}
+
+TEST_CASE("vis -phsmemory 0 matches the default")
+{
+    // with -phsmemory 0 every PVS row is decompressed when it's needed,
+    // by default they're all cached up front. -phsonly keeps the PVS of the
+    // first run, so only the PHS is recalculated.
+    LoadTestmapQ2("q2_light_translucency.map");
+    const fs::path bsp_path = TestmapBsp("q2_light_translucency.map");
+
+    const mvis_t cached = RunVis(bsp_path, {});
+    const mvis_t uncached = RunVis(bsp_path, {"-phsonly", "-phsmemory", "0"});
+
+    REQUIRE(!cached.bits.empty());
+    CHECK(DecompressRows(cached, VIS_PVS) == DecompressRows(uncached, VIS_PVS));
+    CHECK(DecompressRows(cached, VIS_PHS) == DecompressRows(uncached, VIS_PHS));
+}
+
+TEST_CASE("vis -threads 1 matches the default thread count, Q1")
+{
+    // Q1 clusters are expanded to leafs when the rows are compressed
+    LoadTestmapQ1("light_general.map");
+    const fs::path bsp_path = TestmapBsp("light_general.map");
+
+    const mvis_t threaded = RunVis(bsp_path, {});
+    const mvis_t single = RunVis(bsp_path, {}, true);
+
+    REQUIRE(!threaded.bits.empty());
+    CheckSameVis(threaded, single);
+}
+
+TEST_CASE("vis resumes from a checkpoint ending in a cut-off record")
+{
+    LoadTestmapQ2("q2_vis_rooms.map");
+    const fs::path bsp_path = TestmapBsp("q2_vis_rooms.map");
+
+    // a clean run, keeping its state file
+    const mvis_t clean = RunVis(bsp_path, {"-noautoclean"}, true);
+    REQUIRE(fs::exists(statefile));
+
+    // the finished portals are still loaded; write them out as the checkpoint
+    // of a run stopped partway: a snapshot with the first third done, then a
+    // record for each portal of the second third, the last one cut short
+    const std::vector<portalcost_t> costs = portal_costs;
+    const size_t third = portals.size() / 3;
+    REQUIRE(third > 1);
+
+    for (size_t i = third; i < portals.size(); i++) {
+        portals[i].status = pstat_none;
+    }
+    SaveVisState();
+    StartVisCheckpoint();
+    for (size_t i = third; i < third * 2; i++) {
+        portals[i].status = pstat_done;
+        AppendVisState(portals[i]);
+    }
+    ResetVisState();
+    fs::resize_file(statefile, fs::file_size(statefile) - 1);
+
+    const mvis_t resumed = RunVis(bsp_path, {}, true);
+    CheckSameVis(clean, resumed);
+
+    // the portals from the snapshot and the whole records weren't flowed
+    // again, so they kept their saved costs
+    for (size_t i = 0; i < third * 2 - 1; i++) {
+        INFO("portal ", i);
+        CHECK(portal_costs[i].seconds == costs[i].seconds);
+        CHECK(portal_costs[i].numsteps == costs[i].numsteps);
+        CHECK(portal_costs[i].portalchecks == costs[i].portalchecks);
+    }
+}
+
+TEST_CASE("vis -incremental after editing one room matches a clean run")
+{
+    // the state of the unedited map; q2_vis_rooms_edit.map adds a pillar to
+    // one of its six rooms
+    LoadTestmapQ2("q2_vis_rooms.map");
+    const fs::path saved_state = TestmapBsp("q2_vis_rooms.map").replace_extension(".vis");
+    fs::remove(saved_state);
+    RunVis(TestmapBsp("q2_vis_rooms.map"), {"-incremental"}, true);
+    REQUIRE(fs::exists(saved_state));
+
+    LoadTestmapQ2("q2_vis_rooms_edit.map");
+    const fs::path bsp_path = TestmapBsp("q2_vis_rooms_edit.map");
+    const fs::path prt_path = fs::path(bsp_path).replace_extension(".prt");
+    const fs::path state_path = fs::path(bsp_path).replace_extension(".vis");
+
+    const mvis_t clean = RunVis(bsp_path, {"-nostate"}, true);
+
+    // older than the portal file, as if qbsp was run again after the edit
+    fs::copy_file(saved_state, state_path, fs::copy_options::overwrite_existing);
+    fs::last_write_time(state_path, fs::last_write_time(prt_path) - std::chrono::seconds(1));
+
+    const mvis_t incremental = RunVis(bsp_path, {"-incremental"}, true);
+    CheckSameVis(clean, incremental);
+}
+
+TEST_CASE("vis -workers 2 matches a single process")
+{
+    LoadTestmapQ2("q2_vis_rooms.map");
+    const fs::path bsp_path = TestmapBsp("q2_vis_rooms.map");
+
+    const mvis_t single = RunVis(bsp_path, {"-nostate"}, true);
+
+    RunVis(bsp_path, {"-nostate", "-workers", "2", "-worker", "0"}, true);
+    RunVis(bsp_path, {"-nostate", "-workers", "2", "-worker", "1"}, true);
+    REQUIRE(fs::exists(fs::path(bsp_path).replace_extension("w0.vis")));
+    REQUIRE(fs::exists(fs::path(bsp_path).replace_extension("w1.vis")));
+
+    // worker 1's share, with the costs it recorded
+    std::vector<size_t> share;
+    for (size_t i = 0; i < portals.size(); i++) {
+        if (portals[i].status == pstat_done) {
+            share.push_back(i);
+        }
+    }
+    const std::vector<portalcost_t> costs = portal_costs;
+    REQUIRE(!share.empty());
+    REQUIRE(share.size() < portals.size());
+
+    const mvis_t merged = RunVis(bsp_path, {"-nostate", "-workers", "2"}, true);
+    CheckSameVis(single, merged);
+
+    // the merge takes the costs from the workers' records
+    for (size_t i : share) {
+        INFO("portal ", i);
+        CHECK(portal_costs[i].seconds == costs[i].seconds);
+        CHECK(portal_costs[i].nummightsee == costs[i].nummightsee);
+        CHECK(portal_costs[i].numsteps == costs[i].numsteps);
+        CHECK(portal_costs[i].portalchecks == costs[i].portalchecks);
+    }
+}
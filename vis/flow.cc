@@ -1,8 +1,10 @@
 #include <vis/vis.hh>
 #include <vis/leafbits.hh>
+#include <vis/viscost.hh>
 #include <common/log.hh>
 #include <common/parallel.hh>
-#include <bit> // for std::popcount
+#include <algorithm>
+#include <numeric>
 
 /*
   ==============
@@ -22,11 +24,24 @@
 
   Note that when passing in the 'source' plane, taking a copy, rather than a
   pointer, was measurably faster
+
+  The distances of the pass points to the source plane are found for all of
+  the points at once with viswinding_soa_t; each candidate plane is tested
+  point by point so it can stop at the first point behind it.
   ==============
 */
 static void ClipToSeparators(visstats_t &stats, const viswinding_t *source, const qplane3d src_pl, const viswinding_t *pass,
     viswinding_t *&target, unsigned int test, pstack_t &stack)
 {
+    viswinding_soa_t pass_soa;
+    alignas(32) vec_t src_dists[MAX_WINDING];
+
+    if (pass->size() > MAX_WINDING)
+        FError("pass->numpoints > MAX_WINDING ({} > {})", pass->size(), MAX_WINDING);
+
+    pass_soa.load(*pass);
+    pass_soa.distances(src_pl, src_dists);
+
     // check all combinations
     for (size_t i = 0; i < source->size(); i++) {
         const size_t l = (i + 1) % source->size();
@@ -41,7 +56,7 @@ static void ClipToSeparators(visstats_t &stats, const viswinding_t *source, cons
             // This also tells us which side of the separating plane has
             //  the source portal.
             bool fliptest;
-            vec_t d = src_pl.distance_to(pass->at(j));
+            const vec_t d = src_dists[j];
             if (d < -VIS_ON_EPSILON)
                 fliptest = true;
             else if (d > VIS_ON_EPSILON)
@@ -72,12 +87,14 @@ static void ClipToSeparators(visstats_t &stats, const viswinding_t *source, cons
             // if all of the pass portal points are now on the positive side,
             // this is the separating plane
             //
+            // one point at a time: most candidates are rejected by one of
+            // the first few points
             int count = 0;
             size_t k = 0;
             for (; k < pass->size(); k++) {
                 if (k == j)
                     continue;
-                d = sep.distance_to(pass->at(k));
+                const vec_t d = sep.distance_to(pass->at(k));
                 if (d < -VIS_ON_EPSILON)
                     break;
                 else if (d > VIS_ON_EPSILON)
@@ -131,11 +148,8 @@ static vistest_action VisTests(visstats_t &stats, pstack_t &stack, const pstack_
     /* TEST 0 :: source -> pass -> target */
     if (vis_options.level.value() > 0) {
         if (stack.numseparators[0]) {
-            for (int j = 0; j < stack.numseparators[0]; j++) {
-                stack.pass = ClipStackWinding(stats, stack.pass, stack, stack.separators[0][j]);
-                if (!stack.pass)
-                    break;
-            }
+            stack.pass =
+                ClipStackWindingPlanes(stats, stack.pass, stack, stack.separators[0], stack.numseparators[0]);
         } else {
             /* Using prevstack source for separator cache correctness */
             ClipToSeparators(stats, prevstack->source, head->portalplane, prevstack->pass, stack.pass, 0, stack);
@@ -149,11 +163,8 @@ static vistest_action VisTests(visstats_t &stats, pstack_t &stack, const pstack_
     /* TEST 1 :: pass -> source -> target */
     if (vis_options.level.value() > 1) {
         if (stack.numseparators[1]) {
-            for (int j = 0; j < stack.numseparators[1]; j++) {
-                stack.pass = ClipStackWinding(stats, stack.pass, stack, stack.separators[1][j]);
-                if (!stack.pass)
-                    break;
-            }
+            stack.pass =
+                ClipStackWindingPlanes(stats, stack.pass, stack, stack.separators[1], stack.numseparators[1]);
         } else {
             /* Using prevstack source for separator cache correctness */
             ClipToSeparators(stats, prevstack->pass, prevstack->portalplane, prevstack->source, stack.pass, 1, stack);
@@ -333,10 +344,7 @@ IterativeTargetChecks(visstats_t &stats, pstack_t* const head)
         if (stack->next)
         {
             pstack_t* next = stack->next;
-            uint32_t *nextsee = next->mightsee->data();
-            uint32_t *mightsee = stack->mightsee->data();
-            for (int i = 0; i < numblocks; i++)
-                nextsee[i] &= mightsee[i];
+            LeafBits_And(next->mightsee->data(), next->mightsee->data(), stack->mightsee->data(), numblocks);
         }
 
         // mark done
@@ -395,6 +403,8 @@ static void RecursiveLeafFlow(int leafnum, threaddata_t *thread, pstack_t &prevs
     stack.next = nullptr;
     stack.leaf = leaf;
     stack.portal = nullptr;
+    stack.depth = prevstack.depth + 1;
+    thread->maxdepth = std::max(thread->maxdepth, stack.depth);
     stack.numseparators[0] = 0;
     stack.numseparators[1] = 0;
 
@@ -425,14 +435,9 @@ static void RecursiveLeafFlow(int leafnum, threaddata_t *thread, pstack_t &prevs
         }
 
         const auto might = stack.mightsee->data(); // buffer of stack.mightsee can change between iterations
-        uint32_t more = 0;
         const int numblocks = (portalleafs + leafbits_t::mask) >> leafbits_t::shift;
-        for (int j = 0; j < numblocks; j++) {
-            might[j] = prevstack.mightsee->data()[j] & test[j];
-            more |= (might[j] & ~vis[j]);
-        }
 
-        if (!more) {
+        if (!LeafBits_AndHasNew(might, prevstack.mightsee->data(), test, vis, numblocks)) {
             // can't see anything new
             thread->stats.c_portalskip++;
             continue;
@@ -443,10 +448,7 @@ static void RecursiveLeafFlow(int leafnum, threaddata_t *thread, pstack_t &prevs
 
         // calculate num_expected_targetchecks only if we're using it, since it's somewhat expensive to compute
         if (vis_options.targetratio.value() > 0.0) {
-            int nummightsee = 0;
-            for (int j = 0; j < numblocks; j++) {
-                nummightsee += std::popcount(might[j]);
-            }
+            const int nummightsee = LeafBits_Popcount(might, numblocks);
             stack.num_expected_targetchecks = prevstack.num_expected_targetchecks + nummightsee;
         }
 
@@ -534,11 +536,19 @@ visstats_t PortalFlow(visportal_t *p)
     data.pstack_head.source = p->winding.get();
     data.pstack_head.portalplane = p->plane;
     data.pstack_head.mightsee = &p->mightsee;
+    data.pstack_head.depth = 0;
     data.numsteps = 0;
     data.numtargetchecks = 0;
+    data.maxdepth = 0;
+
+    portalcost_t &cost = portal_costs[p - portals.data()];
+    cost.nummightsee = p->nummightsee;
 
     RecursiveLeafFlow(p->leaf, &data, data.pstack_head);
 
+    cost.numsteps = data.numsteps;
+    cost.maxdepth = data.maxdepth;
+
     return data.stats;
 }
 
@@ -565,77 +575,251 @@ static void SimpleFlood(visportal_t &srcportal, int leafnum, const leafbits_t &p
     }
 }
 
+/*
+  ============================================================================
+  Portal BVH
+
+  BasePortalThread only needs the portals that have a point in front of the
+  source portal (and within visdist of its plane), so the candidates are
+  found by walking a BVH over the portal winding bounds instead of testing
+  every portal. Nodes are only rejected when every point in them would fail
+  the exact tests below, which still run on the candidates, so mightsee is
+  the same as testing every portal.
+  ============================================================================
+*/
+
+struct portal_bvh_node_t
+{
+    aabb3d bounds;
+    // leaf if count != 0, in which case first indexes portal_bvh_portals;
+    // otherwise first is the left child and first + 1 the right child
+    uint32_t first = 0;
+    uint32_t count = 0;
+};
+
+constexpr uint32_t PORTAL_BVH_LEAF_SIZE = 4;
+
+static std::vector<portal_bvh_node_t> portal_bvh_nodes;
+static std::vector<uint32_t> portal_bvh_portals;
+static std::vector<aabb3d> portal_bounds;
+
+static void PortalBVH_BuildNode(
+    uint32_t nodenum, std::vector<uint32_t>::iterator begin, std::vector<uint32_t>::iterator end)
+{
+    aabb3d bounds, centroids;
+
+    for (auto it = begin; it != end; it++) {
+        bounds += portal_bounds[*it];
+        centroids += portal_bounds[*it].centroid();
+    }
+
+    portal_bvh_nodes[nodenum].bounds = bounds;
+
+    const size_t count = end - begin;
+
+    if (count <= PORTAL_BVH_LEAF_SIZE) {
+        portal_bvh_nodes[nodenum].first = begin - portal_bvh_portals.begin();
+        portal_bvh_nodes[nodenum].count = count;
+        return;
+    }
+
+    // median split along the longest centroid axis
+    const qvec3d size = centroids.size();
+    const int axis = (size[0] >= size[1] && size[0] >= size[2]) ? 0 : (size[1] >= size[2]) ? 1 : 2;
+    auto mid = begin + (count / 2);
+
+    std::nth_element(begin, mid, end, [axis](uint32_t a, uint32_t b) {
+        const vec_t ca = portal_bounds[a].centroid()[axis];
+        const vec_t cb = portal_bounds[b].centroid()[axis];
+        return ca < cb || (ca == cb && a < b);
+    });
+
+    // children are allocated as a consecutive pair
+    const uint32_t left = portal_bvh_nodes.size();
+    portal_bvh_nodes.emplace_back();
+    portal_bvh_nodes.emplace_back();
+
+    portal_bvh_nodes[nodenum].first = left;
+    portal_bvh_nodes[nodenum].count = 0;
+
+    PortalBVH_BuildNode(left, begin, mid);
+    PortalBVH_BuildNode(left + 1, mid, end);
+}
+
+static void PortalBVH_Build()
+{
+    portal_bounds.resize(numportals * 2);
+    portal_bvh_portals.resize(numportals * 2);
+
+    for (size_t i = 0; i < numportals * 2; i++) {
+        const viswinding_t &w = *portals[i].winding;
+        portal_bounds[i] = aabb3d(w.points, w.points + w.size());
+        portal_bvh_portals[i] = i;
+    }
+
+    portal_bvh_nodes.clear();
+
+    if (!portal_bvh_portals.empty()) {
+        portal_bvh_nodes.emplace_back();
+        PortalBVH_BuildNode(0, portal_bvh_portals.begin(), portal_bvh_portals.end());
+    }
+}
+
+static void PortalBVH_Free()
+{
+    portal_bvh_nodes = {};
+    portal_bvh_portals = {};
+    portal_bounds = {};
+}
+
 /*
   ==============
-  BasePortalVis
+  PortalBVH_Candidates
+
+  Returns the portals that may have a point further than -VIS_ON_EPSILON in
+  front of the plane and, with visdist, a point within visdist of it
   ==============
 */
-static void BasePortalThread(size_t portalnum)
+static void PortalBVH_Candidates(const qplane3d &plane, std::vector<uint32_t> &out)
 {
-    leafbits_t portalsee(numportals * 2);
+    // slack for the different rounding of the box and per-point distances
+    constexpr vec_t epsilon = VIS_EQUAL_EPSILON;
 
-    visportal_t &p = portals[portalnum];
-    viswinding_t &w = *p.winding;
+    const vec_t visdist = vis_options.visdist.value();
+    const vec_t min_front = -(VIS_ON_EPSILON + epsilon);
+    // distFromPortal rounds to float, so leave some relative slack too
+    const vec_t max_front = visdist * 1.0001 + epsilon;
 
-    p.mightsee.resize(portalleafs);
+    out.clear();
 
-    for (size_t i = 0; i < numportals * 2; i++) {
-        if (i == portalnum) {
-            continue;
-        }
+    if (portal_bvh_nodes.empty()) {
+        return;
+    }
 
-        visportal_t &tp = portals[i];
-        viswinding_t &tw = *tp.winding;
+    uint32_t stack[64];
+    int stack_size = 0;
+    stack[stack_size++] = 0;
 
-        // Quick test - completely at the back?
-        float d = p.plane.distance_to(tw.origin);
-        if (d < -tw.radius)
-            continue;
+    while (stack_size) {
+        const portal_bvh_node_t &node = portal_bvh_nodes[stack[--stack_size]];
 
-        int cctp = 0;
-        size_t j;
-        for (j = 0; j < tw.size(); j++) {
-            d = p.plane.distance_to(tw[j]);
-            cctp += d > -VIS_ON_EPSILON;
-            if (d > VIS_ON_EPSILON)
-                break;
+        const qvec3d half = node.bounds.size() * 0.5;
+        const vec_t center = plane.distance_to(node.bounds.centroid());
+        const vec_t extent = fabs(plane.normal[0]) * half[0] + fabs(plane.normal[1]) * half[1] +
+                             fabs(plane.normal[2]) * half[2];
+
+        // every point is behind the plane
+        if (center + extent < min_front) {
+            continue;
         }
-        if (j == tw.size()) {
-            if (cctp != tw.size())
-                continue; // no points on front
-        } else
-            cctp = 0;
-
-        // Quick test - completely on front?
-        d = tp.plane.distance_to(w.origin);
-        if (d > w.radius)
+        // every point is in front, past visdist
+        if (visdist > 0 && center - extent > max_front) {
             continue;
+        }
 
-        int ccp = 0;
-        for (j = 0; j < w.size(); j++) {
-            d = tp.plane.distance_to(w[j]);
-            ccp += d < VIS_ON_EPSILON;
-            if (d < -VIS_ON_EPSILON)
-                break;
+        if (node.count) {
+            out.insert(out.end(), portal_bvh_portals.begin() + node.first,
+                portal_bvh_portals.begin() + node.first + node.count);
+        } else {
+            Q_assert(stack_size + 2 <= 64);
+            stack[stack_size++] = node.first + 1;
+            stack[stack_size++] = node.first;
         }
-        if (j == w.size()) {
-            if (ccp != w.size())
-                continue; // no points on back
-        } else
-            ccp = 0;
-
-        // coplanarity check
-        if (cctp != 0 || ccp != 0)
-            if (qv::dot(p.plane.normal, tp.plane.normal) < -0.99)
-                continue;
+    }
+}
 
-        if (vis_options.visdist.value() > 0) {
-            if (tp.winding->distFromPortal(p) > vis_options.visdist.value() ||
-                p.winding->distFromPortal(tp) > vis_options.visdist.value())
-                continue;
+/*
+  ==============
+  BasePortalSee
+
+  Returns true if tp may be seen through p
+  ==============
+*/
+static bool BasePortalSee(visportal_t &p, visportal_t &tp)
+{
+    viswinding_t &w = *p.winding;
+    viswinding_t &tw = *tp.winding;
+
+    // Quick test - completely at the back?
+    float d = p.plane.distance_to(tw.origin);
+    if (d < -tw.radius)
+        return false;
+
+    int cctp = 0;
+    size_t j;
+    for (j = 0; j < tw.size(); j++) {
+        d = p.plane.distance_to(tw[j]);
+        cctp += d > -VIS_ON_EPSILON;
+        if (d > VIS_ON_EPSILON)
+            break;
+    }
+    if (j == tw.size()) {
+        if (cctp != tw.size())
+            return false; // no points on front
+    } else
+        cctp = 0;
+
+    // Quick test - completely on front?
+    d = tp.plane.distance_to(w.origin);
+    if (d > w.radius)
+        return false;
+
+    int ccp = 0;
+    for (j = 0; j < w.size(); j++) {
+        d = tp.plane.distance_to(w[j]);
+        ccp += d < VIS_ON_EPSILON;
+        if (d < -VIS_ON_EPSILON)
+            break;
+    }
+    if (j == w.size()) {
+        if (ccp != w.size())
+            return false; // no points on back
+    } else
+        ccp = 0;
+
+    // coplanarity check
+    if (cctp != 0 || ccp != 0)
+        if (qv::dot(p.plane.normal, tp.plane.normal) < -0.99)
+            return false;
+
+    if (vis_options.visdist.value() > 0) {
+        if (tp.winding->distFromPortal(p) > vis_options.visdist.value() ||
+            p.winding->distFromPortal(tp) > vis_options.visdist.value())
+            return false;
+    }
+
+    return true;
+}
+
+/*
+  ==============
+  BasePortalVis
+  ==============
+*/
+static void BasePortalThread(size_t portalnum)
+{
+    leafbits_t portalsee(numportals * 2);
+    std::vector<uint32_t> candidates;
+
+    visportal_t &p = portals[portalnum];
+
+    p.mightsee.resize(portalleafs);
+
+    if (vis_options.noportalbvh.value()) {
+        candidates.resize(numportals * 2);
+        std::iota(candidates.begin(), candidates.end(), 0);
+    } else {
+        PortalBVH_Candidates(p.plane, candidates);
+    }
+
+    for (uint32_t i : candidates) {
+        if (i == portalnum) {
+            continue;
         }
 
-        portalsee[i] = 1;
+        if (BasePortalSee(p, portals[i])) {
+            portalsee[i] = 1;
+        }
     }
 
     p.nummightsee = 0;
@@ -651,5 +835,9 @@ static void BasePortalThread(size_t portalnum)
 */
 void BasePortalVis(void)
 {
+    PortalBVH_Build();
+
     logging::parallel_for(0, numportals * 2, BasePortalThread);
+
+    PortalBVH_Free();
 }
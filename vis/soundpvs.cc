@@ -21,6 +21,11 @@
 #include <vis/vis.hh>
 #include <common/bsputils.hh>
 #include <common/parallel.hh>
+
+#include <algorithm>
+#include <atomic>
+#include <numeric>
+
 /*
 
 Some textures (sky, water, slime, lava) are considered ambien sound emiters.
@@ -159,6 +164,12 @@ CalcPHS
 
 Calculate the PHS (Potentially Hearable Set)
 by ORing together all the PVS visible from a leaf
+
+Each PVS row is needed by every row that sees it, so as many rows as fit in
+-phsmemory are decompressed once up front, the most visible ones first (vis
+is close to symmetric, so those are the rows the most others OR in). The
+rest are decompressed when needed. Rows are built in parallel and appended
+to dvis.bits in order.
 ================
 */
 void CalcPHS(mbsp_t *bsp)
@@ -166,25 +177,64 @@ void CalcPHS(mbsp_t *bsp)
     logging::funcheader();
 
     const int32_t leafbytes = (portalleafs + 7) >> 3;
-    const int32_t leaflongs = leafbytes / sizeof(long);
+    const int32_t numblocks = (portalleafs + leafbits_t::mask) >> leafbits_t::shift;
+    const uint8_t *bits_end = bsp->dvis.bits.data() + bsp->dvis.bits.size();
+
+    auto decompress_pvs = [&](int32_t leafnum, uint32_t *out) {
+        const uint8_t *scan = bsp->dvis.bits.data() + bsp->dvis.get_bit_offset(VIS_PVS, leafnum);
+        uint8_t *out_bytes = reinterpret_cast<uint8_t *>(out);
+        DecompressVis(scan, bits_end, out_bytes, out_bytes + leafbytes);
+    };
+
+    // how many rows see each row
+    std::vector<size_t> visible(portalleafs);
+    tbb::parallel_for(0, portalleafs, [&](int32_t i) {
+        leafbits_t pvs(portalleafs);
+        decompress_pvs(i, pvs.data());
+        visible[i] = LeafBits_Popcount(pvs.data(), numblocks);
+    });
 
-    // increase the bits size with approximately how much space we'll need
-    bsp->dvis.bits.reserve(bsp->dvis.bits.size() * 2);
+    const size_t max_cached = (static_cast<size_t>(vis_options.phsmemory.value()) * 1024 * 1024) /
+                              (static_cast<size_t>(numblocks) * sizeof(uint32_t));
+    const size_t numcached = std::min(static_cast<size_t>(portalleafs), max_cached);
 
-    std::vector<uint8_t> uncompressed(leafbytes);
-    std::vector<uint8_t> uncompressed_2(leafbytes);
-    std::vector<uint8_t> compressed(leafbytes * 2);
-    std::vector<uint8_t> uncompressed_orig(leafbytes);
+    std::vector<int32_t> by_visible(portalleafs);
+    std::iota(by_visible.begin(), by_visible.end(), 0);
+    std::stable_sort(by_visible.begin(), by_visible.end(),
+        [&visible](int32_t a, int32_t b) { return visible[a] > visible[b]; });
 
-    int32_t count = 0;
-    for (int32_t i = 0; i < portalleafs; i++) {
-        const uint8_t *scan = bsp->dvis.bits.data() + bsp->dvis.get_bit_offset(VIS_PVS, i);
+    std::vector<uint32_t> cache(numcached * numblocks);
+    std::vector<int32_t> cache_index(portalleafs, -1);
+    for (size_t i = 0; i < numcached; i++) {
+        cache_index[by_visible[i]] = i;
+    }
+    tbb::parallel_for(static_cast<size_t>(0), numcached,
+        [&](size_t i) { decompress_pvs(by_visible[i], cache.data() + i * numblocks); });
+
+    logging::print(logging::flag::VERBOSE, "{} of {} PVS rows cached\n", numcached, portalleafs);
+
+    std::vector<std::vector<uint8_t>> compressed_rows(portalleafs);
+    std::atomic<int64_t> count = 0;
+
+    logging::parallel_for(0, portalleafs, [&](int32_t i) {
+        leafbits_t phs(portalleafs);
+        leafbits_t scratch(portalleafs);
 
-        DecompressVis(scan, bsp->dvis.bits.data() + bsp->dvis.bits.size(), uncompressed.data(),
-            uncompressed.data() + uncompressed.size());
-        std::copy(uncompressed.begin(), uncompressed.end(), uncompressed_orig.begin());
+        auto pvs_row = [&](int32_t leafnum) -> const uint32_t * {
+            if (cache_index[leafnum] >= 0) {
+                return cache.data() + static_cast<size_t>(cache_index[leafnum]) * numblocks;
+            }
+            decompress_pvs(leafnum, scratch.data());
+            return scratch.data();
+        };
+
+        const uint32_t *pvs = pvs_row(i);
+        std::copy_n(pvs, numblocks, phs.data());
+
+        // iterate the original row, not the one being ORed into
+        const leafbits_t pvs_orig = phs;
 
-        scan = uncompressed_orig.data();
+        const uint8_t *scan = reinterpret_cast<const uint8_t *>(pvs_orig.data());
 
         for (int32_t j = 0; j < leafbytes; j++) {
             uint8_t bitbyte = scan[j];
@@ -197,31 +247,30 @@ void CalcPHS(mbsp_t *bsp)
                 int32_t index = ((j << 3) + k);
                 if (index >= portalleafs)
                     FError("Bad bit in PVS"); // pad bits should be 0
-                const uint8_t *src_compressed = bsp->dvis.bits.data() + bsp->dvis.get_bit_offset(VIS_PVS, index);
-                DecompressVis(src_compressed, bsp->dvis.bits.data() + bsp->dvis.bits.size(), uncompressed_2.data(),
-                    uncompressed_2.data() + uncompressed_2.size());
-                const long *src = reinterpret_cast<long *>(uncompressed_2.data());
-                long *dest = reinterpret_cast<long *>(uncompressed.data());
-                for (int32_t l = 0; l < leaflongs; l++)
-                    dest[l] |= src[l];
+                LeafBits_Or(phs.data(), pvs_row(index), numblocks);
             }
         }
-        for (int32_t j = 0; j < portalleafs; j++)
-            if (uncompressed[j >> 3] & nth_bit(j & 7))
-                count++;
+        count += LeafBits_Popcount(phs.data(), numblocks);
 
         //
         // compress the bit string
         //
-        compressed.clear();
-        CompressRow(uncompressed.data(), leafbytes, std::back_inserter(compressed));
+        CompressRow(reinterpret_cast<const uint8_t *>(phs.data()), leafbytes, std::back_inserter(compressed_rows[i]));
+    });
 
-        bsp->dvis.set_bit_offset(VIS_PHS, i, bsp->dvis.bits.size());
+    // increase the bits size with how much space we'll need
+    size_t phs_size = 0;
+    for (const auto &row : compressed_rows) {
+        phs_size += row.size();
+    }
+    bsp->dvis.bits.reserve(bsp->dvis.bits.size() + phs_size);
 
-        std::copy(compressed.begin(), compressed.end(), std::back_inserter(bsp->dvis.bits));
+    for (int32_t i = 0; i < portalleafs; i++) {
+        bsp->dvis.set_bit_offset(VIS_PHS, i, bsp->dvis.bits.size());
+        std::copy(compressed_rows[i].begin(), compressed_rows[i].end(), std::back_inserter(bsp->dvis.bits));
     }
 
     fmt::print("Average clusters hearable: {}\n", count / portalleafs);
 
     bsp->dvis.bits.shrink_to_fit();
-}
\ No newline at end of file
+}
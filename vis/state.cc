@@ -25,12 +25,20 @@
 #endif
 
 #include <vis/vis.hh>
+#include <vis/viscost.hh>
 #include <common/cmdlib.hh>
 #include "common/fs.hh"
 #include <common/log.hh>
+#include <array>
+#include <algorithm>
+#include <bit>
+#include <cmath>
 #include <fstream>
+#include <mutex>
+#include <sstream>
+#include <unordered_map>
 
-constexpr uint32_t VIS_STATE_VERSION = ('T' << 24 | 'Y' << 16 | 'R' << 8 | '1');
+constexpr uint32_t VIS_STATE_VERSION = ('T' << 24 | 'Y' << 16 | 'R' << 8 | '3');
 
 struct dvisstate_t
 {
@@ -50,8 +58,15 @@ struct dportal_t
     uint32_t vis;
     uint32_t nummightsee;
     uint32_t numcansee;
-
-    auto stream_data() { return std::tie(status, might, vis, nummightsee, numcansee); }
+    uint64_t hash; // PortalHash, for -incremental
+    int32_t leaf;
+    portalcost_t cost;
+
+    auto stream_data()
+    {
+        return std::tie(status, might, vis, nummightsee, numcansee, hash, leaf, cost.seconds, cost.nummightsee,
+            cost.numsteps, cost.maxdepth, cost.portalchecks, cost.portaltests, cost.targetchecks);
+    }
 };
 
 static int CompressBits(uint8_t *out, const leafbits_t &in)
@@ -94,11 +109,11 @@ static int CompressBits(uint8_t *out, const leafbits_t &in)
     return numbytes;
 }
 
-static void DecompressBits(leafbits_t &dst, const uint8_t *src)
+static void DecompressBits(leafbits_t &dst, const uint8_t *src, size_t numleafs)
 {
-    const size_t numbytes = (portalleafs + 7) >> 3;
+    const size_t numbytes = (numleafs + 7) >> 3;
 
-    dst.resize(portalleafs);
+    dst.resize(numleafs);
 
     for (size_t i = 0; i < numbytes; i++) {
         uint8_t val = *src++;
@@ -131,11 +146,149 @@ static void CopyLeafBits(leafbits_t &dst, const uint8_t *src, size_t numleafs)
     }
 }
 
+/* Reads `len` bytes written by CompressBits; zero leaves dst empty */
+static void ReadLeafBits(std::ifstream &in, leafbits_t &dst, std::vector<uint8_t> &buffer, uint32_t len, size_t numleafs)
+{
+    const size_t numbytes = (numleafs + 7) >> 3;
+
+    dst.resize(numleafs);
+
+    if (!len) {
+        return;
+    }
+    if (len > numbytes) {
+        FError("corrupt state file {}", statefile);
+    }
+
+    in.read((char *)buffer.data(), len);
+
+    if (len < numbytes) {
+        DecompressBits(dst, buffer.data(), numleafs);
+    } else {
+        CopyLeafBits(dst, buffer.data(), numleafs);
+    }
+}
+
+template<typename F>
+static void ForEachLeaf(const leafbits_t &bits, F &&f)
+{
+    for (size_t i = 0; i < bits.block_size(); i++) {
+        for (uint32_t block = bits.data()[i]; block; block &= block - 1) {
+            f((i << leafbits_t::shift) + std::countr_zero(block));
+        }
+    }
+}
+
+/*
+  ==================
+  PortalHash
+
+  Hash of the portal winding, rounded to 1/8 unit and starting from its
+  smallest point, so the same portal written by another qbsp run hashes
+  the same. The point order gives the two sides of a portal different hashes.
+  ==================
+*/
+static uint64_t PortalHash(const visportal_t &p)
+{
+    const viswinding_t &w = *p.winding;
+    std::vector<std::array<int64_t, 3>> points(w.size());
+
+    for (size_t i = 0; i < w.size(); i++) {
+        for (size_t j = 0; j < 3; j++) {
+            points[i][j] = static_cast<int64_t>(std::llround(w.at(i)[j] * 8.0));
+        }
+    }
+
+    const size_t start = std::min_element(points.begin(), points.end()) - points.begin();
+
+    // FNV-1a
+    uint64_t hash = 0xcbf29ce484222325ull;
+
+    for (size_t i = 0; i < points.size(); i++) {
+        for (int64_t v : points[(start + i) % points.size()]) {
+            for (size_t b = 0; b < sizeof(v); b++) {
+                hash ^= static_cast<uint8_t>(static_cast<uint64_t>(v) >> (b * 8));
+                hash *= 0x100000001b3ull;
+            }
+        }
+    }
+
+    return hash;
+}
+
+static std::vector<uint64_t> portal_hashes;
+
+const std::vector<uint64_t> &PortalHashes()
+{
+    if (portal_hashes.size() != portals.size()) {
+        portal_hashes.resize(portals.size());
+        for (size_t i = 0; i < portals.size(); i++) {
+            portal_hashes[i] = PortalHash(portals[i]);
+        }
+    }
+
+    return portal_hashes;
+}
+
+static void WritePortalState(std::ostream &out, const visportal_t &p, uint64_t hash, std::vector<uint8_t> &might,
+    std::vector<uint8_t> &vis)
+{
+    dportal_t pstate;
+
+    const int might_len = CompressBits(might.data(), p.mightsee);
+    const int vis_len = (p.status == pstat_done) ? CompressBits(vis.data(), p.visbits) : 0;
+
+    pstate.status = p.status;
+    pstate.might = might_len;
+    pstate.vis = vis_len;
+    pstate.nummightsee = p.nummightsee;
+    pstate.numcansee = p.numcansee;
+    pstate.hash = hash;
+    pstate.leaf = p.leaf;
+    pstate.cost = portal_costs[&p - portals.data()];
+
+    out <= pstate;
+    out.write((const char *)might.data(), might_len);
+    if (vis_len) {
+        out.write((const char *)vis.data(), vis_len);
+    }
+}
+
+/*
+ * Checkpoints
+ *
+ * The state file is a snapshot of every portal, written by SaveVisState
+ * before and after the full vis, followed by a record for each portal
+ * completed since the snapshot. AppendVisState adds the records as portals
+ * finish, so a checkpoint only costs the new work and flow threads never
+ * wait for the rest of the state to be written. A record cut short by a
+ * crash is ignored when loading.
+ */
+struct dportalrecord_t
+{
+    uint32_t portalnum;
+    uint32_t time_elapsed;
+
+    auto stream_data() { return std::tie(portalnum, time_elapsed); }
+};
+
+static std::ofstream checkpoint;
+static std::mutex checkpoint_mutex;
+
+static void CloseVisCheckpoint()
+{
+    std::scoped_lock lock(checkpoint_mutex);
+
+    if (checkpoint.is_open()) {
+        checkpoint.close();
+    }
+}
+
 void SaveVisState(void)
 {
-    int vis_len, might_len;
     dvisstate_t state;
-    dportal_t pstate;
+
+    CloseVisCheckpoint();
 
     std::ofstream out(statetmpfile, std::ios_base::out | std::ios_base::binary);
     out << endianness<std::endian::little>;
@@ -153,25 +306,10 @@ void SaveVisState(void)
     std::vector<uint8_t> might((portalleafs + 7) >> 3);
     std::vector<uint8_t> vis((portalleafs + 7) >> 3);
 
-    for (const auto &p : portals) {
-        might_len = CompressBits(might.data(), p.mightsee);
-        if (p.status == pstat_done) {
-            vis_len = CompressBits(vis.data(), p.visbits);
-        } else {
-            vis_len = 0;
-        }
-
-        pstate.status = p.status;
-        pstate.might = might_len;
-        pstate.vis = vis_len;
-        pstate.nummightsee = p.nummightsee;
-        pstate.numcansee = p.numcansee;
+    const std::vector<uint64_t> &hashes = PortalHashes();
 
-        out <= pstate;
-        out.write((const char *)might.data(), might_len);
-        if (vis_len) {
-            out.write((const char *)vis.data(), vis_len);
-        }
+    for (size_t i = 0; i < portals.size(); i++) {
+        WritePortalState(out, portals[i], hashes[i], might, vis);
     }
 
     out.close();
@@ -187,19 +325,292 @@ void SaveVisState(void)
         FError("error renaming state file ({})", ec.message());
 }
 
+void StartVisCheckpoint(void)
+{
+    std::scoped_lock lock(checkpoint_mutex);
+
+    checkpoint.open(statefile, std::ios_base::out | std::ios_base::binary | std::ios_base::app);
+    checkpoint << endianness<std::endian::little>;
+
+    if (!checkpoint) {
+        logging::print("WARNING: couldn't open {} for checkpoints\n", statefile);
+    }
+}
+
+void AppendVisState(const visportal_t &p)
+{
+    thread_local std::vector<uint8_t> might, vis;
+    thread_local std::ostringstream record(std::ios_base::out | std::ios_base::binary);
+
+    if (!checkpoint.is_open()) {
+        return;
+    }
+
+    /* Compress outside the lock */
+    might.resize((portalleafs + 7) >> 3);
+    vis.resize((portalleafs + 7) >> 3);
+    record.str({});
+    record << endianness<std::endian::little>;
+
+    const size_t portalnum = &p - portals.data();
+    record <= dportalrecord_t{(uint32_t)portalnum, (uint32_t)(I_FloatTime() - starttime).count()};
+    WritePortalState(record, p, PortalHashes()[portalnum], might, vis);
+
+    const std::string data = record.str();
+
+    std::scoped_lock lock(checkpoint_mutex);
+    checkpoint.write(data.data(), data.size());
+}
+
+void FlushVisState(void)
+{
+    std::scoped_lock lock(checkpoint_mutex);
+
+    if (checkpoint.is_open()) {
+        checkpoint.flush();
+    }
+}
+
+fs::path VisWorkerStateFile(int32_t worker)
+{
+    return fs::path(vis_options.sourceMap).replace_extension(fmt::format("w{}.vis", worker));
+}
+
 void CleanVisState(void)
 {
+    CloseVisCheckpoint();
+
     if (fs::exists(statefile)) {
         fs::remove(statefile);
     }
+
+    /* Results merged from -worker processes */
+    if (vis_options.worker.value() < 0) {
+        for (int32_t i = 0; i < vis_options.workers.value(); i++) {
+            const fs::path path = VisWorkerStateFile(i);
+            if (fs::exists(path)) {
+                fs::remove(path);
+            }
+        }
+    }
+}
+
+void ResetVisState(void)
+{
+    CloseVisCheckpoint();
+
+    portal_hashes.clear();
+}
+
+struct saved_portal_t
+{
+    dportal_t state;
+    leafbits_t mightsee, visbits;
+};
+
+/*
+  ==================
+  ReadVisState
+
+  Reads the snapshot and then the checkpoint records, which replace the
+  snapshot of their portal. Stops at the first incomplete record.
+  ==================
+*/
+static bool ReadVisState(
+    std::ifstream &in, const fs::path &path, dvisstate_t &state, std::vector<saved_portal_t> &saved)
+{
+    const uint32_t numbytes = (state.numleafs + 7) >> 3;
+    std::vector<uint8_t> compressed(numbytes);
+
+    saved.resize(state.numportals * 2);
+
+    for (auto &sp : saved) {
+        in >= sp.state;
+        if (!in || sp.state.might > numbytes || sp.state.vis > numbytes) {
+            logging::print("WARNING: state file {} is truncated, ignoring\n", path);
+            return false;
+        }
+        ReadLeafBits(in, sp.mightsee, compressed, sp.state.might, state.numleafs);
+        ReadLeafBits(in, sp.visbits, compressed, sp.state.vis, state.numleafs);
+    }
+
+    if (!in) {
+        logging::print("WARNING: state file {} is truncated, ignoring\n", path);
+        return false;
+    }
+
+    size_t numrecords = 0;
+
+    while (true) {
+        dportalrecord_t record;
+        saved_portal_t sp;
+
+        in >= record;
+        in >= sp.state;
+
+        if (!in || record.portalnum >= saved.size() || sp.state.might > numbytes || sp.state.vis > numbytes) {
+            break;
+        }
+
+        ReadLeafBits(in, sp.mightsee, compressed, sp.state.might, state.numleafs);
+        ReadLeafBits(in, sp.visbits, compressed, sp.state.vis, state.numleafs);
+
+        if (!in) {
+            break;
+        }
+
+        saved[record.portalnum] = std::move(sp);
+        state.time_elapsed = std::max(state.time_elapsed, record.time_elapsed);
+        numrecords++;
+    }
+
+    if (numrecords) {
+        logging::print("Read {} checkpointed portals\n", numrecords);
+    }
+
+    return true;
+}
+
+/*
+  ==================
+  LoadVisStateIncremental
+
+  The portal file changed since the state was saved (-incremental). Portals
+  are matched to the saved ones by PortalHash, and a leaf is matched to a
+  saved leaf if all of its portals match portals of that leaf and it had no
+  others. A portal that was done keeps its saved result if it and every leaf
+  in its saved mightsee are matched: its flow never leaves mightsee, so it
+  would only find the same leafs again. Everything else starts over from
+  BasePortalVis.
+  ==================
+*/
+static bool LoadVisStateIncremental(std::ifstream &in, dvisstate_t &state)
+{
+    if (state.testlevel != (uint32_t)vis_options.visdist.value()) {
+        logging::print("State file was made with a different -visdist, will be overwritten\n");
+        return false;
+    }
+
+    std::vector<saved_portal_t> saved;
+
+    if (!ReadVisState(in, statefile, state, saved)) {
+        return false;
+    }
+
+    logging::print("Calculating Base Vis:\n");
+    BasePortalVis();
+
+    /* Match portals, ignoring hashes that aren't unique on either side */
+    const std::vector<uint64_t> &hashes = PortalHashes();
+    std::unordered_map<uint64_t, int32_t> saved_by_hash, current_by_hash;
+
+    for (size_t i = 0; i < saved.size(); i++) {
+        auto [it, inserted] = saved_by_hash.emplace(saved[i].state.hash, static_cast<int32_t>(i));
+        if (!inserted) {
+            it->second = -1;
+        }
+    }
+    for (size_t i = 0; i < hashes.size(); i++) {
+        auto [it, inserted] = current_by_hash.emplace(hashes[i], static_cast<int32_t>(i));
+        if (!inserted) {
+            it->second = -1;
+        }
+    }
+
+    std::vector<int32_t> portal_match(portals.size(), -1);
+
+    for (size_t i = 0; i < hashes.size(); i++) {
+        if (current_by_hash[hashes[i]] != static_cast<int32_t>(i)) {
+            continue;
+        }
+        if (auto it = saved_by_hash.find(hashes[i]); it != saved_by_hash.end()) {
+            portal_match[i] = it->second;
+        }
+    }
+
+    /* Match leafs; the leaf a saved portal leads out of is the one its other side leads into */
+    std::vector<size_t> saved_leaf_portals(state.numleafs);
+
+    for (size_t i = 0; i < saved.size(); i++) {
+        const int32_t owner = saved[i ^ 1].state.leaf;
+        if (owner >= 0 && owner < (int32_t)state.numleafs) {
+            saved_leaf_portals[owner]++;
+        }
+    }
+
+    std::vector<int32_t> leaf_match(portalleafs, -1), saved_leaf_match(state.numleafs, -1);
+    int32_t matched_leafs = 0;
+
+    for (int32_t leafnum = 0; leafnum < portalleafs; leafnum++) {
+        const auto &leafportals = leafs[leafnum].portals;
+        int32_t owner = -1;
+
+        for (const visportal_t *p : leafportals) {
+            const int32_t match = portal_match[p - portals.data()];
+            if (match < 0 || (owner != -1 && saved[match ^ 1].state.leaf != owner)) {
+                owner = -1;
+                break;
+            }
+            owner = saved[match ^ 1].state.leaf;
+        }
+
+        if (owner < 0 || owner >= (int32_t)state.numleafs || saved_leaf_portals[owner] != leafportals.size() ||
+            saved_leaf_match[owner] != -1) {
+            continue;
+        }
+
+        leaf_match[leafnum] = owner;
+        saved_leaf_match[owner] = leafnum;
+        matched_leafs++;
+    }
+
+    /* Reuse the portals whose flow region didn't change */
+    int32_t reused = 0;
+
+    for (size_t i = 0; i < portals.size(); i++) {
+        const int32_t match = portal_match[i];
+
+        if (match < 0 || saved[match].state.status != pstat_done) {
+            continue;
+        }
+
+        const saved_portal_t &sp = saved[match];
+
+        if (leaf_match[portals[i ^ 1].leaf] != saved[match ^ 1].state.leaf) {
+            continue;
+        }
+
+        bool unchanged = true;
+        ForEachLeaf(sp.mightsee, [&](size_t leafnum) { unchanged = unchanged && saved_leaf_match[leafnum] >= 0; });
+
+        if (!unchanged) {
+            continue;
+        }
+
+        visportal_t &p = portals[i];
+
+        p.mightsee.resize(portalleafs);
+        p.visbits.resize(portalleafs);
+        ForEachLeaf(sp.mightsee, [&](size_t leafnum) { p.mightsee[saved_leaf_match[leafnum]] = true; });
+        ForEachLeaf(sp.visbits, [&](size_t leafnum) { p.visbits[saved_leaf_match[leafnum]] = true; });
+
+        p.nummightsee = sp.state.nummightsee;
+        p.numcansee = sp.state.numcansee;
+        p.status = pstat_done;
+        portal_costs[i] = sp.state.cost;
+        reused++;
+    }
+
+    logging::print("Matched {} of {} leafs, reusing {} of {} portals from {}\n", matched_leafs, portalleafs, reused,
+        portals.size(), statefile);
+
+    return true;
 }
 
 bool LoadVisState(void)
 {
     fs::file_time_type prt_time, state_time;
-    int numbytes;
     dvisstate_t state;
-    dportal_t pstate;
 
     if (vis_options.nostate.value()) {
         return false;
@@ -221,7 +632,9 @@ bool LoadVisState(void)
     }
 
     prt_time = fs::last_write_time(portalfile);
-    if (prt_time > state_time) {
+    const bool out_of_date = prt_time > state_time;
+
+    if (out_of_date && !vis_options.incremental.value()) {
         logging::print("State file is out of date, will be overwritten\n");
         return false;
     }
@@ -235,49 +648,114 @@ bool LoadVisState(void)
     if (state.version != VIS_STATE_VERSION) {
         FError("state file version does not match");
     }
-    if (state.numportals != numportals || state.numleafs != portalleafs) {
-        FError("state file {} does not match portal file {}", statefile, portalfile);
+    if (out_of_date || state.numportals != numportals || state.numleafs != portalleafs) {
+        if (!vis_options.incremental.value()) {
+            FError("state file {} does not match portal file {}", statefile, portalfile);
+        }
+        return LoadVisStateIncremental(in, state);
+    }
+
+    std::vector<saved_portal_t> saved;
+
+    if (!ReadVisState(in, statefile, state, saved)) {
+        return false;
     }
 
     /* Move back the start time to simulate already elapsed time */
     starttime -= duration(state.time_elapsed);
 
-    numbytes = (portalleafs + 7) >> 3;
-    std::vector<uint8_t> compressed(numbytes);
-
     /* Update the portal information */
-    for (auto &p : portals) {
-        in >= pstate;
+    for (size_t i = 0; i < portals.size(); i++) {
+        visportal_t &p = portals[i];
+        saved_portal_t &sp = saved[i];
 
-        p.status = static_cast<pstatus_t>(pstate.status);
-        p.nummightsee = pstate.nummightsee;
-        p.numcansee = pstate.numcansee;
+        p.status = static_cast<pstatus_t>(sp.state.status);
+        p.nummightsee = sp.state.nummightsee;
+        p.numcansee = sp.state.numcansee;
+        p.mightsee = std::move(sp.mightsee);
+        p.visbits = std::move(sp.visbits);
+        portal_costs[i] = sp.state.cost;
 
-        in.read((char *)compressed.data(), pstate.might);
-        p.mightsee.resize(portalleafs);
+        /* Portals that were in progress need to be started again */
+        if (p.status == pstat_working) {
+            p.status = pstat_none;
+        }
+    }
 
-        if (pstate.might < numbytes) {
-            DecompressBits(p.mightsee, compressed.data());
-        } else {
-            CopyLeafBits(p.mightsee, compressed.data(), portalleafs);
+    return true;
+}
+
+/*
+  ==================
+  MergeVisWorkers
+
+  Takes the portals completed by -worker processes from their state files.
+  Returns the merged portals, for their mightsee updates.
+  ==================
+*/
+std::vector<visportal_t *> MergeVisWorkers(void)
+{
+    std::vector<visportal_t *> merged;
+    const std::vector<uint64_t> &hashes = PortalHashes();
+
+    for (int32_t i = 0; i < vis_options.workers.value(); i++) {
+        const fs::path path = VisWorkerStateFile(i);
+        std::ifstream in(path, std::ios_base::in | std::ios_base::binary);
+
+        if (!in) {
+            logging::print("WARNING: no results from worker {} ({})\n", i, path);
+            continue;
         }
 
-        p.visbits.resize(portalleafs);
+        in >> endianness<std::endian::little>;
 
-        if (pstate.vis) {
-            in.read((char *)compressed.data(), pstate.vis);
-            if (pstate.vis < numbytes) {
-                DecompressBits(p.visbits, compressed.data());
-            } else {
-                CopyLeafBits(p.visbits, compressed.data(), portalleafs);
-            }
+        dvisstate_t state;
+        in >= state;
+
+        if (!in || state.version != VIS_STATE_VERSION || state.numportals != numportals ||
+            state.numleafs != portalleafs || state.testlevel != (uint32_t)vis_options.visdist.value()) {
+            logging::print("WARNING: {} does not match portal file {}, ignoring\n", path, portalfile);
+            continue;
         }
 
-        /* Portals that were in progress need to be started again */
-        if (p.status == pstat_working) {
-            p.status = pstat_none;
+        std::vector<saved_portal_t> saved;
+
+        if (!ReadVisState(in, path, state, saved)) {
+            continue;
+        }
+
+        bool matches = true;
+        for (size_t j = 0; j < saved.size(); j++) {
+            matches = matches && saved[j].state.hash == hashes[j];
+        }
+        if (!matches) {
+            logging::print("WARNING: {} does not match portal file {}, ignoring\n", path, portalfile);
+            continue;
+        }
+
+        size_t count = 0;
+
+        for (size_t j = 0; j < saved.size(); j++) {
+            saved_portal_t &sp = saved[j];
+            visportal_t &p = portals[j];
+
+            if (sp.state.status != pstat_done || p.status == pstat_done) {
+                continue;
+            }
+
+            p.status = pstat_done;
+            p.nummightsee = sp.state.nummightsee;
+            p.numcansee = sp.state.numcansee;
+            p.mightsee = std::move(sp.mightsee);
+            p.visbits = std::move(sp.visbits);
+            portal_costs[j] = sp.state.cost;
+
+            merged.push_back(&p);
+            count++;
         }
+
+        logging::print("Merged {} portals from {}\n", count, path);
     }
 
-    return true;
+    return merged;
 }
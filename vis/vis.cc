@@ -1,15 +1,19 @@
 #include <vis/vis.hh>
 
 #include <vis/leafbits.hh>
+#include <vis/viscost.hh>
 #include <common/log.hh>
 #include <common/bsputils.hh>
 #include <common/fs.hh>
 #include <common/parallel.hh>
 
+#include <algorithm>
 #include <climits>
 #include <cstdint>
+#include <functional>
 #include <bit> // for std::countr_zero
 #include <numeric> // for std::accumulate
+#include <set>
 
 #include <fmt/chrono.h>
 
@@ -55,6 +59,10 @@ void vis_settings::initialize(int argc, const char **argv)
         logging::print(ex.what());
         print_help();
     }
+
+    if (worker.value() >= workers.value()) {
+        FError("-worker {} needs -workers greater than it", worker.value());
+    }
 }
 } // namespace settings
 
@@ -104,37 +112,24 @@ void FreeStackWinding(viswinding_t *&w, pstack_t &stack)
 
 /*
   ==================
-  ClipStackWinding
+  ClipStackWindingDists
 
-  Clips the winding to the plane, returning the new winding on the positive
-  side. Frees the input winding (if on stack). If the resulting winding would
-  have too many points, the clip operation is aborted and the original winding
-  is returned.
+  ClipStackWinding after the fast test, given the distances of the points
+  of the winding to the plane.
   ==================
 */
-viswinding_t *ClipStackWinding(visstats_t &stats, viswinding_t *in, pstack_t &stack, const qplane3d &split)
+static viswinding_t *ClipStackWindingDists(
+    visstats_t &stats, viswinding_t *in, pstack_t &stack, const qplane3d &split, const vec_t *pointdists)
 {
     vec_t dists[MAX_WINDING + 1];
     int sides[MAX_WINDING + 1];
     size_t i;
 
-    /* Fast test first */
-    vec_t dot = split.distance_to(in->origin);
-    if (dot < -in->radius) {
-        FreeStackWinding(in, stack);
-        return nullptr;
-    } else if (dot > in->radius) {
-        return in;
-    }
-
-    if (in->size() > MAX_WINDING)
-        FError("in->numpoints > MAX_WINDING ({} > {})", in->size(), MAX_WINDING);
-
     int counts[3] = {0, 0, 0};
 
     /* determine sides for each point */
     for (i = 0; i < in->size(); i++) {
-        dot = split.distance_to((*in)[i]);
+        vec_t dot = pointdists[i];
         dists[i] = dot;
         if (dot > VIS_ON_EPSILON)
             sides[i] = SIDE_FRONT;
@@ -215,12 +210,198 @@ noclip:
     return in;
 }
 
+/*
+  ==================
+  ClipStackWinding
+
+  Clips the winding to the plane, returning the new winding on the positive
+  side. Frees the input winding (if on stack). If the resulting winding would
+  have too many points, the clip operation is aborted and the original winding
+  is returned.
+  ==================
+*/
+viswinding_t *ClipStackWinding(visstats_t &stats, viswinding_t *in, pstack_t &stack, const qplane3d &split)
+{
+    vec_t dists[MAX_WINDING];
+
+    /* Fast test first */
+    vec_t dot = split.distance_to(in->origin);
+    if (dot < -in->radius) {
+        FreeStackWinding(in, stack);
+        return nullptr;
+    } else if (dot > in->radius) {
+        return in;
+    }
+
+    if (in->size() > MAX_WINDING)
+        FError("in->numpoints > MAX_WINDING ({} > {})", in->size(), MAX_WINDING);
+
+    for (size_t i = 0; i < in->size(); i++) {
+        dists[i] = split.distance_to((*in)[i]);
+    }
+
+    return ClipStackWindingDists(stats, in, stack, split, dists);
+}
+
+/*
+  ==================
+  ClipStackWindingPlanes
+
+  Same as calling ClipStackWinding with each plane in turn, but the winding
+  is transposed once and reused by every plane until one of them clips it,
+  and its distances to each plane are found with viswinding_soa_t.
+  ==================
+*/
+viswinding_t *ClipStackWindingPlanes(
+    visstats_t &stats, viswinding_t *in, pstack_t &stack, const qplane3d *splits, size_t numsplits)
+{
+    viswinding_soa_t soa;
+    alignas(32) vec_t dists[MAX_WINDING];
+    bool loaded = false;
+
+    for (size_t i = 0; i < numsplits; i++) {
+        const qplane3d &split = splits[i];
+
+        /* Fast test first */
+        const vec_t dot = split.distance_to(in->origin);
+        if (dot < -in->radius) {
+            FreeStackWinding(in, stack);
+            return nullptr;
+        } else if (dot > in->radius) {
+            continue;
+        }
+
+        if (in->size() > MAX_WINDING)
+            FError("in->numpoints > MAX_WINDING ({} > {})", in->size(), MAX_WINDING);
+
+        if (!loaded) {
+            soa.load(*in);
+            loaded = true;
+        }
+        soa.distances(split, dists);
+
+        viswinding_t *out = ClipStackWindingDists(stats, in, stack, split, dists);
+        if (!out) {
+            return nullptr;
+        }
+        if (out != in) {
+            in = out;
+            loaded = false;
+        }
+    }
+
+    return in;
+}
+
 //============================================================================
 
 #include <mutex>
 
-static std::mutex portal_mutex;
-static std::atomic_int64_t portalIndex;
+/*
+ * Portal scheduler
+ *
+ * Portals that haven't been started are kept in buckets by nummightsee, each
+ * ordered by the portal, so they are handed out least complex first and,
+ * with one thread, in the same order as a linear scan for the smallest
+ * nummightsee. When UpdateMightsee lowers a portal's nummightsee the portal is
+ * moved to its new bucket, so the buckets never hold more than the unstarted
+ * portals. An entry popped while its portal was being moved is skipped.
+ *
+ * leaf_locks[i] protects the status, mightsee and nummightsee of the portals
+ * leading out of leaf i while they aren't being worked on. No thread holds
+ * more than one leaf lock at a time, and a bucket lock is only taken inside
+ * a leaf lock, never the other way around.
+ */
+struct portal_bucket_t
+{
+    std::mutex lock;
+    std::set<visportal_t *> queued;
+    std::atomic_size_t count = 0;
+};
+
+static std::vector<portal_bucket_t> portal_buckets;
+static std::vector<std::mutex> leaf_locks;
+static std::mutex state_mutex;
+
+// lowest bucket that may be non-empty in the low 32 bits, and a counter
+// bumped by every push in the high 32 bits, so GetNextPortal can only raise
+// the hint if nothing was pushed since it scanned the buckets below it
+static std::atomic_uint64_t portal_bucket_hint;
+constexpr uint64_t PORTAL_BUCKET_MASK = 0xffffffffull;
+
+/*
+  =============
+  PortalLeaf
+
+  Returns the leaf a portal leads out of; portals are stored in pairs, and
+  the other portal of the pair leads into it
+  =============
+*/
+static int PortalLeaf(const visportal_t *p)
+{
+    return portals[(p - portals.data()) ^ 1].leaf;
+}
+
+/*
+  =============
+  PushPortal
+
+  Queues an unstarted portal under its current nummightsee.
+
+  Called with the lock of the portal's leaf held.
+  =============
+*/
+static void PushPortal(visportal_t *p)
+{
+    const uint32_t bucketnum = p->nummightsee;
+    portal_bucket_t &bucket = portal_buckets[bucketnum];
+
+    {
+        std::scoped_lock lock(bucket.lock);
+        if (bucket.queued.insert(p).second) {
+            bucket.count++;
+        }
+    }
+
+    uint64_t hint = portal_bucket_hint.load();
+    uint64_t newhint;
+    do {
+        newhint = (((hint >> 32) + 1) << 32) | std::min<uint64_t>(hint & PORTAL_BUCKET_MASK, bucketnum);
+    } while (!portal_bucket_hint.compare_exchange_weak(hint, newhint));
+}
+
+/*
+  =============
+  UnqueuePortal
+
+  Takes a portal out of the bucket for its current nummightsee, if it's
+  still there.
+
+  Called with the lock of the portal's leaf held.
+  =============
+*/
+static void UnqueuePortal(visportal_t *p)
+{
+    portal_bucket_t &bucket = portal_buckets[p->nummightsee];
+    std::scoped_lock lock(bucket.lock);
+
+    if (bucket.queued.erase(p)) {
+        bucket.count--;
+    }
+}
+
+static void SetupPortalScheduler()
+{
+    portal_buckets = std::vector<portal_bucket_t>(portalleafs + 1);
+    leaf_locks = std::vector<std::mutex>(portalleafs);
+    portal_bucket_hint = 0;
+
+    for (auto &p : portals) {
+        if (p.status == pstat_none) {
+            PushPortal(&p);
+        }
+    }
+}
 
 /*
   =============
@@ -233,25 +414,46 @@ static std::atomic_int64_t portalIndex;
 */
 visportal_t *GetNextPortal(void)
 {
-    visportal_t *ret = nullptr;
-    uint32_t min = INT_MAX;
+    while (true) {
+        uint64_t hint = portal_bucket_hint.load();
+        size_t bucketnum = hint & PORTAL_BUCKET_MASK;
 
-    portal_mutex.lock();
+        while (bucketnum < portal_buckets.size() && !portal_buckets[bucketnum].count) {
+            bucketnum++;
+        }
 
-    for (auto &p : portals) {
-        if (p.nummightsee < min && p.status == pstat_none) {
-            min = p.nummightsee;
-            ret = &p;
+        if (bucketnum == portal_buckets.size()) {
+            return nullptr;
         }
-    }
 
-    if (ret) {
-        ret->status = pstat_working;
-    }
+        if (bucketnum != (hint & PORTAL_BUCKET_MASK)) {
+            portal_bucket_hint.compare_exchange_strong(hint, (hint & ~PORTAL_BUCKET_MASK) | bucketnum);
+        }
+
+        visportal_t *p;
+
+        {
+            portal_bucket_t &bucket = portal_buckets[bucketnum];
+            std::scoped_lock lock(bucket.lock);
 
-    portal_mutex.unlock();
+            if (bucket.queued.empty()) {
+                continue;
+            }
+
+            p = *bucket.queued.begin();
+            bucket.queued.erase(bucket.queued.begin());
+            bucket.count--;
+        }
 
-    return ret;
+        std::scoped_lock lock(leaf_locks[PortalLeaf(p)]);
+
+        // otherwise UpdateMightsee moved the portal to a lower bucket after
+        // it was popped here
+        if (p->status == pstat_none && p->nummightsee == bucketnum) {
+            p->status = pstat_working;
+            return p;
+        }
+    }
 }
 
 /*
@@ -262,21 +464,23 @@ visportal_t *GetNextPortal(void)
   longer visible from the dest leaf. Visibility is symetrical, so the reverse
   must also be true. Update mightsee for any portals on the source leaf which
   haven't yet started processing.
-
-  Called with the lock held.
   =============
 */
 static void UpdateMightsee(visstats_t &stats, const leaf_t &source, const leaf_t &dest)
 {
     size_t leafnum = &dest - leafs.data();
+    std::scoped_lock lock(leaf_locks[&source - leafs.data()]);
+
     for (visportal_t *p : source.portals) {
         if (p->status != pstat_none) {
             continue;
         }
         if (p->mightsee[leafnum]) {
+            UnqueuePortal(p);
             p->mightsee[leafnum] = false;
             p->nummightsee--;
             stats.c_mightseeupdate++;
+            PushPortal(p);
         }
     }
 }
@@ -287,63 +491,71 @@ static void UpdateMightsee(visstats_t &stats, const leaf_t &source, const leaf_t
 
   Mark the portal completed and propogate new vis information across
   to the complementry portals.
-
-  Called with the lock held.
   =============
 */
 static void PortalCompleted(visstats_t &stats, visportal_t *completed)
 {
-    portal_mutex.lock();
-
-    completed->status = pstat_done;
+    {
+        std::scoped_lock lock(leaf_locks[PortalLeaf(completed)]);
+        completed->status = pstat_done;
+    }
 
     /*
      * For each portal on the leaf, check the leafs we eliminated from
      * mightsee during the full vis so far.
      */
     const leaf_t &myleaf = leafs[completed->leaf];
-    for (int i = 0; i < myleaf.portals.size(); i++) {
-        const visportal_t *p = myleaf.portals[i];
-        if (p->status != pstat_done)
-            continue;
+    const int numblocks = (portalleafs + leafbits_t::mask) >> leafbits_t::shift;
+    std::vector<int> unseen;
 
-        auto might = p->mightsee.data();
-        auto vis = p->visbits.data();
-        int numblocks = (portalleafs + leafbits_t::mask) >> leafbits_t::shift;
-        for (int j = 0; j < numblocks; j++) {
-            uint32_t changed = might[j] & ~vis[j];
-            if (!changed)
+    {
+        std::scoped_lock lock(leaf_locks[completed->leaf]);
+
+        for (int i = 0; i < myleaf.portals.size(); i++) {
+            const visportal_t *p = myleaf.portals[i];
+            if (p->status != pstat_done)
                 continue;
 
-            /*
-             * If any of these changed bits are still visible from another
-             * portal, we can't update yet.
-             */
-            for (int k = 0; k < myleaf.portals.size(); k++) {
-                if (k == i)
-                    continue;
-                const visportal_t *p2 = myleaf.portals[k];
-                if (p2->status == pstat_done)
-                    changed &= ~p2->visbits.data()[j];
-                else
-                    changed &= ~p2->mightsee.data()[j];
+            auto might = p->mightsee.data();
+            auto vis = p->visbits.data();
+            for (int j = 0; j < numblocks; j++) {
+                uint32_t changed = might[j] & ~vis[j];
                 if (!changed)
-                    break;
-            }
+                    continue;
 
-            /*
-             * Update mightsee for any of the changed bits that survived
-             */
-            while (changed) {
-                int bit = std::countr_zero(changed);
-                changed &= ~nth_bit(bit);
-                int leafnum = (j << leafbits_t::shift) + bit;
-                UpdateMightsee(stats, leafs[leafnum], myleaf);
+                /*
+                 * If any of these changed bits are still visible from another
+                 * portal, we can't update yet.
+                 */
+                for (int k = 0; k < myleaf.portals.size(); k++) {
+                    if (k == i)
+                        continue;
+                    const visportal_t *p2 = myleaf.portals[k];
+                    if (p2->status == pstat_done)
+                        changed &= ~p2->visbits.data()[j];
+                    else
+                        changed &= ~p2->mightsee.data()[j];
+                    if (!changed)
+                        break;
+                }
+
+                while (changed) {
+                    int bit = std::countr_zero(changed);
+                    changed &= ~nth_bit(bit);
+                    unseen.push_back((j << leafbits_t::shift) + bit);
+                }
             }
         }
     }
 
-    portal_mutex.unlock();
+    /*
+     * Update mightsee for any of the changed bits that survived. Once
+     * a leaf can't be seen from this one it never can, so this doesn't
+     * need to happen under the same lock.
+     */
+    for (int leafnum : unseen) {
+        UpdateMightsee(stats, leafs[leafnum], myleaf);
+    }
 }
 
 time_point starttime, endtime, statetime;
@@ -356,23 +568,28 @@ static duration stateinterval;
 */
 static visstats_t LeafThread()
 {
-    portal_mutex.lock();
-    /* Save state if sufficient time has elapsed */
-    auto now = I_FloatTime();
-    if (now > statetime + stateinterval) {
-        statetime = now;
-        SaveVisState();
+    {
+        std::scoped_lock lock(state_mutex);
+        /* Flush the checkpoint if sufficient time has elapsed */
+        auto now = I_FloatTime();
+        if (now > statetime + stateinterval) {
+            statetime = now;
+            FlushVisState();
+        }
     }
-    portal_mutex.unlock();
 
     visportal_t *p = GetNextPortal();
     if (!p)
         return {};
 
+    const time_point start = I_FloatTime();
     visstats_t stats = PortalFlow(p);
+    VisCost_Record(p, stats, I_FloatTime() - start);
 
     PortalCompleted(stats, p);
 
+    AppendVisState(*p);
+
     logging::print(logging::flag::VERBOSE, "portal:{:4}  mightsee:{:4}  cansee:{:4}\n", (ptrdiff_t)(p - portals.data()),
         p->nummightsee, p->numcansee);
 
@@ -388,9 +605,15 @@ static visstats_t LeafThread()
 */
 int64_t totalvis;
 
-static std::vector<uint8_t> compressed;
-
-static void ClusterFlow(int clusternum, leafbits_t &buffer, mbsp_t *bsp)
+/*
+ * Ors the portal visbits of a cluster, expands them into the full leaf
+ * visibility map and compresses the row into `compressed`.
+ *
+ * Only touches the cluster's own row of `uncompressed`, so clusters can be
+ * flowed in parallel; returns the cluster's share of totalvis.
+ */
+static int64_t ClusterFlow(int clusternum, leafbits_t &buffer, const mbsp_t *bsp,
+    const std::vector<int> &cluster_leafcounts, std::vector<uint8_t> &compressed)
 {
     /*
      * Collect visible bits from all portals into buffer
@@ -400,8 +623,7 @@ static void ClusterFlow(int clusternum, leafbits_t &buffer, mbsp_t *bsp)
     for (const visportal_t *p : leaf->portals) {
         if (p->status != pstat_done)
             FError("portal not done");
-        for (int j = 0; j < numblocks; j++)
-            buffer.data()[j] |= p->visbits.data()[j];
+        LeafBits_Or(buffer.data(), p->visbits.data(), numblocks);
     }
 
     if (buffer[clusternum])
@@ -438,53 +660,85 @@ static void ClusterFlow(int clusternum, leafbits_t &buffer, mbsp_t *bsp)
      */
     logging::print(logging::flag::VERBOSE, "cluster {:4} : {:4} visible\n", clusternum, numvis);
 
+    compressed.clear();
+
+    if (bsp->loadversion->game->id == GAME_QUAKE_II) {
+        CompressRow(outbuffer, (portalleafs + 7) >> 3, std::back_inserter(compressed));
+    } else {
+        CompressRow(outbuffer, (portalleafs_real + 7) >> 3, std::back_inserter(compressed));
+    }
+
     /*
-     * increment totalvis by
+     * totalvis is increased by
      * (# of real leafs in this cluster) x (# of real leafs visible from this cluster)
      */
     if (bsp->loadversion->game->id == GAME_QUAKE_II) {
         // FIXME: not sure what this is supposed to be?
-        totalvis += numvis;
+        return numvis;
     } else {
+        return static_cast<int64_t>(cluster_leafcounts[clusternum]) * numvis;
+    }
+}
+
+/*
+  ===============
+  ClusterFlowAll
+
+  Flows every cluster in parallel, then appends the compressed rows to
+  vismap in cluster order so the output doesn't depend on scheduling
+  ===============
+*/
+static void ClusterFlowAll(mbsp_t *bsp)
+{
+    std::vector<int> cluster_leafcounts(portalleafs);
+    std::vector<std::vector<int>> cluster_leafs(portalleafs);
+
+    if (bsp->loadversion->game->id != GAME_QUAKE_II) {
         for (int i = 0; i < portalleafs_real; i++) {
-            if (bsp->dleafs[i + 1].cluster == clusternum) {
-                totalvis += numvis;
-            }
+            const int cluster = bsp->dleafs[i + 1].cluster;
+            if (cluster < 0 || cluster >= portalleafs)
+                continue;
+            cluster_leafcounts[cluster]++;
+            cluster_leafs[cluster].push_back(i + 1);
         }
     }
 
-    compressed.clear();
+    std::vector<std::vector<uint8_t>> compressed_rows(portalleafs);
+    std::vector<int64_t> cluster_totalvis(portalleafs);
 
-    /* Allocate for worst case where RLE might grow the data (unlikely) */
-    if (bsp->loadversion->game->id == GAME_QUAKE_II) {
-        CompressRow(outbuffer, (portalleafs + 7) >> 3, std::back_inserter(compressed));
-    } else {
-        CompressRow(outbuffer, (portalleafs_real + 7) >> 3, std::back_inserter(compressed));
-    }
+    logging::parallel_for(0, portalleafs, [&](int clusternum) {
+        leafbits_t buffer(portalleafs);
+        cluster_totalvis[clusternum] =
+            ClusterFlow(clusternum, buffer, bsp, cluster_leafcounts, compressed_rows[clusternum]);
+    });
 
-    /* leaf 0 is a common solid */
-    int32_t visofs = vismap.size();
+    totalvis += std::accumulate(cluster_totalvis.begin(), cluster_totalvis.end(), int64_t{0});
 
-    bsp->dvis.set_bit_offset(VIS_PVS, clusternum, visofs);
+    for (int clusternum = 0; clusternum < portalleafs; clusternum++) {
+        /* leaf 0 is a common solid */
+        int32_t visofs = vismap.size();
 
-    // Set pointers
-    if (bsp->loadversion->game->id != GAME_QUAKE_II) {
-        for (int i = 0; i < portalleafs_real; i++) {
-            if (bsp->dleafs[i + 1].cluster == clusternum) {
-                bsp->dleafs[i + 1].visofs = visofs;
-            }
+        bsp->dvis.set_bit_offset(VIS_PVS, clusternum, visofs);
+
+        // Set pointers
+        for (int leafnum : cluster_leafs[clusternum]) {
+            bsp->dleafs[leafnum].visofs = visofs;
         }
-    }
 
-    std::copy(compressed.begin(), compressed.end(), std::back_inserter(vismap));
+        const auto &compressed = compressed_rows[clusternum];
+        std::copy(compressed.begin(), compressed.end(), std::back_inserter(vismap));
+    }
 }
 
 /*
   ==================
   CalcPortalVis
+
+  `completed` are portals finished elsewhere (by -worker processes), whose
+  mightsee updates haven't been made yet
   ==================
 */
-visstats_t CalcPortalVis(const mbsp_t *bsp)
+visstats_t CalcPortalVis(const mbsp_t *bsp, const std::vector<visportal_t *> &completed = {})
 {
     // fastvis just uses mightsee for a very loose bound
     if (vis_options.fast.value()) {
@@ -505,19 +759,35 @@ visstats_t CalcPortalVis(const mbsp_t *bsp)
         }
     }
 
-    portalIndex = startcount;
+    SetupPortalScheduler();
+
+    visstats_t completed_stats{};
+    for (visportal_t *p : completed) {
+        PortalCompleted(completed_stats, p);
+    }
+
+    /* Snapshot the starting point; completed portals are appended to it */
+    statetime = I_FloatTime();
+    SaveVisState();
+    StartVisCheckpoint();
 
     std::vector<visstats_t> stats_perportal;
     stats_perportal.resize(numportals * 2);
 
-    logging::parallel_for(startcount, numportals * 2, [&](size_t i) {
+    // the progress bar is by estimated time, not portals
+    VisCost_StartProgress();
+
+    tbb::parallel_for(startcount, numportals * 2, [&](size_t i) {
         stats_perportal[i] = LeafThread();
     });
 
+    VisCost_EndProgress();
+
     const visstats_t stats = std::accumulate(stats_perportal.begin(),
         stats_perportal.end(),
         visstats_t{});
 
+    statetime = I_FloatTime();
     SaveVisState();
 
     logging::print(logging::flag::VERBOSE, "portalcheck: {}  portaltest: {}  portalpass: {}\n", stats.c_portalcheck,
@@ -543,18 +813,23 @@ visstats_t CalcVis(mbsp_t *bsp)
         BasePortalVis();
     }
 
+    std::vector<visportal_t *> merged;
+    if (vis_options.workers.value()) {
+        merged = MergeVisWorkers();
+    }
+
     logging::print("Calculating Full Vis:\n");
-    auto stats = CalcPortalVis(bsp);
+    auto stats = CalcPortalVis(bsp, merged);
+
+    if (vis_options.profile.value()) {
+        VisCost_WriteReport(fs::path(statefile).replace_extension("visprofile.json"));
+    }
 
     //
     // assemble the leaf vis lists by oring and compressing the portal lists
     //
     logging::print("Expanding clusters...\n");
-    leafbits_t buffer(portalleafs);
-    for (int i = 0; i < portalleafs; i++) {
-        ClusterFlow(i, buffer, bsp);
-        buffer.clear();
-    }
+    ClusterFlowAll(bsp);
 
     int64_t avg = totalvis;
 
@@ -571,6 +846,54 @@ visstats_t CalcVis(mbsp_t *bsp)
     return stats;
 }
 
+/*
+  ==================
+  CalcVisWorker
+
+  -worker: runs the full vis for this process's share of the portals and
+  leaves the results in its state file, for the run that merges them.
+  Portals are shared out by their geometry hash, so every process (and a
+  resumed one) agrees on the split without talking to the others.
+  ==================
+*/
+static void CalcVisWorker(const mbsp_t *bsp)
+{
+    if (LoadVisState()) {
+        logging::print("Loaded previous state. Resuming progress...\n");
+    } else {
+        logging::print("Calculating Base Vis:\n");
+        BasePortalVis();
+    }
+
+    const std::vector<uint64_t> &hashes = PortalHashes();
+    const uint64_t workers = vis_options.workers.value();
+    const uint64_t worker = vis_options.worker.value();
+    int32_t share = 0;
+
+    for (size_t i = 0; i < portals.size(); i++) {
+        // the low bits of an FNV-1a hash follow the low bits of the last
+        // bytes hashed, which are the same for most portals
+        if ((hashes[i] >> 32) % workers == worker) {
+            share++;
+        } else if (portals[i].status == pstat_none) {
+            // another process is working on it; it won't be scheduled here,
+            // and flows through it use its mightsee
+            portals[i].status = pstat_working;
+        }
+    }
+
+    logging::print("Worker {} of {}: {} of {} portals\n", worker, workers, share, portals.size());
+
+    logging::print("Calculating Full Vis:\n");
+    CalcPortalVis(bsp);
+
+    if (vis_options.profile.value()) {
+        VisCost_WriteReport(fs::path(statefile).replace_extension("visprofile.json"));
+    }
+
+    logging::print("Saved results to {}\n", statefile);
+}
+
 // ===========================================================================
 
 #include <fstream>
@@ -588,13 +911,6 @@ static void LoadPortals(const fs::path &name, mbsp_t *bsp)
     portalleafs = prtfile.portalleafs;
     portalleafs_real = prtfile.portalleafs_real;
 
-    /* Allocate for worst case where RLE might grow the data (unlikely) */
-    if (bsp->loadversion->game->id == GAME_QUAKE_II) {
-        compressed.reserve(std::max(1, (portalleafs * 2) / 8));
-    } else {
-        compressed.reserve(std::max(1, (portalleafs_real * 2) / 8));
-    }
-
     numportals = prtfile.portals.size();
 
     if (bsp->loadversion->game->id != GAME_QUAKE_II) {
@@ -664,6 +980,8 @@ static void LoadPortals(const fs::path &name, mbsp_t *bsp)
         }
     }
 
+    VisCost_Setup();
+
     // Q2 doesn't need this, it's PRT1 has the data we need
     if (bsp->loadversion->game->id == GAME_QUAKE_II) {
         return;
@@ -679,6 +997,15 @@ void vis_reset()
 {
     // FIXME: clear other data
 
+    // these are resized for each map and would keep the last map's data:
+    // a leaf's pointers to its portals, rows that are ORed into
+    portals.clear();
+    leafs.clear();
+    uncompressed.clear();
+    vismap.clear();
+    totalvis = 0;
+
+    ResetVisState();
     vis_options.reset();
 }
 
@@ -729,6 +1056,16 @@ int vis_main(int argc, const char **argv)
         statefile = fs::path(vis_options.sourceMap).replace_extension("vis");
         statetmpfile = fs::path(vis_options.sourceMap).replace_extension("vi0");
 
+        if (vis_options.worker.value() >= 0) {
+            statefile = VisWorkerStateFile(vis_options.worker.value());
+            statetmpfile = fs::path(statefile).replace_extension("vi0");
+
+            CalcVisWorker(&bsp);
+
+            logging::close();
+            return 0;
+        }
+
         if (bsp.loadversion->game->id != GAME_QUAKE_II) {
             uncompressed.resize(portalleafs * leafbytes_real);
         } else {
@@ -760,7 +1097,7 @@ int vis_main(int argc, const char **argv)
     endtime = I_FloatTime();
     logging::print("{:.2} elapsed\n", (endtime - starttime));
 
-    if (vis_options.autoclean.value()) {
+    if (vis_options.autoclean.value() && !vis_options.incremental.value()) {
         CleanVisState();
     }
 
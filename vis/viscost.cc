@@ -0,0 +1,292 @@
+/*  Copyright (C) 1996-1997  Id Software, Inc.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+
+    See file, 'COPYING', for details.
+*/
+
+#include <vis/viscost.hh>
+
+#include <vis/vis.hh>
+
+#include <common/aabb.hh>
+#include <common/json.hh>
+#include <common/log.hh>
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <mutex>
+
+std::vector<portalcost_t> portal_costs;
+
+namespace
+{
+// resolution of the progress bar
+constexpr uint64_t PROGRESS_MAX = 10000;
+
+struct viscost_progress_t
+{
+    // sums for the fit of log(seconds) = a + b * log(nummightsee)
+    double n = 0, sx = 0, sy = 0, sxx = 0, sxy = 0;
+    double a = 0, b = 0;
+
+    // portals left to flow, by their nummightsee when the full vis started
+    std::vector<uint32_t> pending;
+    std::vector<uint32_t> start_mightsee;
+
+    // of the portals flowed in this run
+    double done_seconds = 0;
+    size_t done_portals = 0;
+    size_t total_portals = 0;
+
+    time_point start, last_update, last_eta;
+    uint64_t last_progress = 0;
+};
+
+std::mutex progress_lock;
+viscost_progress_t progress;
+} // namespace
+
+void VisCost_Setup()
+{
+    portal_costs.assign(portals.size(), {});
+}
+
+static void VisCost_AddSample(const portalcost_t &cost)
+{
+    if (cost.seconds <= 0 || !cost.nummightsee) {
+        return;
+    }
+
+    const double x = std::log(static_cast<double>(cost.nummightsee));
+    const double y = std::log(static_cast<double>(cost.seconds));
+
+    progress.n++;
+    progress.sx += x;
+    progress.sy += y;
+    progress.sxx += x * x;
+    progress.sxy += x * y;
+}
+
+static void VisCost_Fit()
+{
+    const double n = progress.n;
+    const double var = n * progress.sxx - progress.sx * progress.sx;
+
+    if (n >= 2 && var > 0) {
+        progress.b = (n * progress.sxy - progress.sx * progress.sy) / var;
+        progress.a = (progress.sy - progress.b * progress.sx) / n;
+    } else if (n) {
+        progress.b = 0;
+        progress.a = progress.sy / n;
+    }
+}
+
+static double VisCost_Predict(uint32_t nummightsee)
+{
+    return std::exp(progress.a + progress.b * std::log(static_cast<double>(std::max(nummightsee, 1u))));
+}
+
+static double VisCost_Remaining()
+{
+    double remaining = 0;
+
+    for (size_t i = 0; i < progress.pending.size(); i++) {
+        if (progress.pending[i]) {
+            remaining += progress.pending[i] * VisCost_Predict(i);
+        }
+    }
+
+    return remaining;
+}
+
+static std::string VisCost_FormatTime(double seconds)
+{
+    const auto total = static_cast<int64_t>(seconds);
+    return fmt::format("{}:{:02}:{:02}", total / 3600, (total / 60) % 60, total % 60);
+}
+
+/*
+ * called with progress_lock held
+ */
+static void VisCost_UpdateProgress()
+{
+    const time_point now = I_FloatTime();
+
+    if (now - progress.last_update < std::chrono::milliseconds(250)) {
+        return;
+    }
+    progress.last_update = now;
+
+    double fraction;
+    double remaining = 0;
+
+    if (progress.n) {
+        VisCost_Fit();
+        remaining = VisCost_Remaining();
+        fraction = progress.done_seconds / (progress.done_seconds + remaining);
+    } else {
+        fraction = static_cast<double>(progress.done_portals) / progress.total_portals;
+    }
+
+    // the estimate can go back as the fit changes, the progress bar can't
+    const uint64_t count = std::clamp(
+        static_cast<uint64_t>(fraction * PROGRESS_MAX), progress.last_progress, PROGRESS_MAX - 1);
+    progress.last_progress = count;
+    logging::percent(count, PROGRESS_MAX);
+
+    if (now - progress.last_eta >= std::chrono::minutes(1) && progress.done_seconds > 0) {
+        progress.last_eta = now;
+
+        // portal seconds flowed per second, over all threads
+        const double rate = progress.done_seconds / (now - progress.start).count();
+
+        logging::print("{} portals left, estimated {} remaining\n", progress.total_portals - progress.done_portals,
+            VisCost_FormatTime(remaining / rate));
+    }
+}
+
+void VisCost_StartProgress()
+{
+    std::scoped_lock lock(progress_lock);
+
+    progress = {};
+    progress.start = progress.last_eta = I_FloatTime();
+    progress.pending.assign(portalleafs + 1, 0);
+    progress.start_mightsee.assign(portals.size(), std::numeric_limits<uint32_t>::max());
+
+    for (size_t i = 0; i < portals.size(); i++) {
+        const visportal_t &p = portals[i];
+
+        // portals done in an earlier run still teach the fit
+        if (p.status == pstat_done) {
+            VisCost_AddSample(portal_costs[i]);
+        } else if (p.status == pstat_none) {
+            progress.pending[p.nummightsee]++;
+            progress.start_mightsee[i] = p.nummightsee;
+            progress.total_portals++;
+        }
+    }
+
+    if (progress.total_portals) {
+        logging::percent(0, PROGRESS_MAX);
+    }
+}
+
+void VisCost_EndProgress()
+{
+    logging::percent(PROGRESS_MAX, PROGRESS_MAX);
+}
+
+void VisCost_Record(const visportal_t *p, const visstats_t &stats, duration elapsed)
+{
+    const size_t portalnum = p - portals.data();
+    portalcost_t &cost = portal_costs[portalnum];
+
+    cost.seconds = static_cast<float>(elapsed.count());
+    cost.portalchecks = static_cast<uint32_t>(stats.c_portalcheck);
+    cost.portaltests = static_cast<uint32_t>(stats.c_portaltest);
+    cost.targetchecks = static_cast<uint32_t>(stats.c_targetcheck);
+
+    std::scoped_lock lock(progress_lock);
+
+    VisCost_AddSample(cost);
+    progress.done_seconds += cost.seconds;
+    progress.done_portals++;
+
+    if (progress.start_mightsee[portalnum] != std::numeric_limits<uint32_t>::max()) {
+        progress.pending[progress.start_mightsee[portalnum]]--;
+    }
+
+    VisCost_UpdateProgress();
+}
+
+void VisCost_WriteReport(const fs::path &path)
+{
+    logging::funcheader();
+
+    std::vector<size_t> order;
+    for (size_t i = 0; i < portal_costs.size(); i++) {
+        if (portal_costs[i].seconds > 0) {
+            order.push_back(i);
+        }
+    }
+    std::stable_sort(order.begin(), order.end(),
+        [](size_t a, size_t b) { return portal_costs[a].seconds > portal_costs[b].seconds; });
+
+    // the leaf a portal leads out of is the one the other portal of its pair leads into
+    struct leafcost_t
+    {
+        double seconds = 0;
+        size_t portals = 0;
+        aabb3d bounds;
+    };
+    std::vector<leafcost_t> leafcosts(portalleafs);
+
+    for (size_t i = 0; i < portals.size(); i++) {
+        leafcost_t &leaf = leafcosts[portals[i ^ 1].leaf];
+        const viswinding_t &w = *portals[i].winding;
+
+        leaf.seconds += portal_costs[i].seconds;
+        leaf.portals++;
+        for (size_t j = 0; j < w.size(); j++) {
+            leaf.bounds += w[j];
+        }
+    }
+
+    std::vector<size_t> leaforder;
+    for (size_t i = 0; i < leafcosts.size(); i++) {
+        if (leafcosts[i].seconds > 0) {
+            leaforder.push_back(i);
+        }
+    }
+    std::stable_sort(leaforder.begin(), leaforder.end(),
+        [&](size_t a, size_t b) { return leafcosts[a].seconds > leafcosts[b].seconds; });
+
+    json j = json::object();
+
+    {
+        std::scoped_lock lock(progress_lock);
+        VisCost_Fit();
+        // seconds = exp(a) * nummightsee^b
+        j["model"] = {{"a", progress.a}, {"b", progress.b}, {"samples", progress.n}};
+    }
+
+    json &portals_json = (j["portals"] = json::array());
+    for (size_t i : order) {
+        const portalcost_t &cost = portal_costs[i];
+        const visportal_t &p = portals[i];
+
+        portals_json.push_back({{"portal", i}, {"leaf", portals[i ^ 1].leaf}, {"neighbor", p.leaf},
+            {"center", p.winding->origin}, {"seconds", cost.seconds}, {"nummightsee", cost.nummightsee},
+            {"numcansee", p.numcansee}, {"steps", cost.numsteps}, {"maxdepth", cost.maxdepth},
+            {"portalchecks", cost.portalchecks}, {"portaltests", cost.portaltests},
+            {"targetchecks", cost.targetchecks}});
+    }
+
+    json &leafs_json = (j["leafs"] = json::array());
+    for (size_t i : leaforder) {
+        const leafcost_t &leaf = leafcosts[i];
+
+        leafs_json.push_back({{"leaf", i}, {"seconds", leaf.seconds}, {"portals", leaf.portals},
+            {"mins", leaf.bounds.mins()}, {"maxs", leaf.bounds.maxs()}});
+    }
+
+    std::ofstream(path, std::fstream::out | std::fstream::trunc) << std::setw(4) << j;
+
+    logging::print("Wrote profile {}\n", path);
+}